@@ -0,0 +1,113 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cmath>
+
+// A scripted camera flight for benchmark runs. Keyframes are linearly
+// interpolated, so the same path at the same timestep always produces the
+// same sequence of views no matter how fast the machine is.
+class CameraPath
+{
+public:
+	struct Keyframe
+	{
+		float time;
+		glm::vec3 position;
+		float yaw;
+		float pitch;
+		float fov;
+	};
+
+	std::vector<Keyframe> keys;
+
+	// the built in path: start where the interactive camera starts, pull back
+	// to see the whole field, sweep across it and fly in close.
+	// ------------------------------------------------------------------------
+	CameraPath()
+	{
+		keys.push_back({ 0.0f, glm::vec3(0.0f, 0.0f, 3.0f), -90.0f, 0.0f, 45.0f });
+		keys.push_back({ 2.0f, glm::vec3(0.0f, 1.0f, 8.0f), -90.0f, -5.0f, 45.0f });
+		keys.push_back({ 4.0f, glm::vec3(-6.0f, 2.0f, 4.0f), -60.0f, -10.0f, 40.0f });
+		keys.push_back({ 6.0f, glm::vec3(4.0f, -1.0f, -4.0f), -135.0f, 5.0f, 35.0f });
+		keys.push_back({ 8.0f, glm::vec3(0.5f, 0.5f, -10.0f), -80.0f, 15.0f, 45.0f });
+		keys.push_back({ 10.0f, glm::vec3(0.0f, 0.0f, 3.0f), -90.0f, 0.0f, 45.0f });
+	}
+	// load a path from a text file, one keyframe per line:
+	//     time posX posY posZ yaw pitch fov
+	// lines starting with # are comments. keyframes must be in time order.
+	// ------------------------------------------------------------------------
+	bool load(const char* path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			std::cout << "ERROR::CAMERA_PATH::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+			return false;
+		}
+		std::vector<Keyframe> loaded;
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (line.empty() || line[0] == '#')
+				continue;
+			std::istringstream fields(line);
+			Keyframe key;
+			if (!(fields >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch >> key.fov))
+			{
+				std::cout << "ERROR::CAMERA_PATH::BAD_LINE " << line << std::endl;
+				return false;
+			}
+			if (!loaded.empty() && key.time < loaded.back().time)
+			{
+				std::cout << "ERROR::CAMERA_PATH::KEYFRAMES_OUT_OF_ORDER at t=" << key.time << std::endl;
+				return false;
+			}
+			loaded.push_back(key);
+		}
+		if (loaded.empty())
+		{
+			std::cout << "ERROR::CAMERA_PATH::NO_KEYFRAMES " << path << std::endl;
+			return false;
+		}
+		keys = loaded;
+		return true;
+	}
+	float duration() const
+	{
+		return keys.back().time;
+	}
+	// sample the path at time t. the path loops, so a long benchmark keeps
+	// flying the same route.
+	// ------------------------------------------------------------------------
+	void sample(float t, glm::vec3* pos, glm::vec3* front, float* fov) const
+	{
+		if (duration() > 0.0f)
+			t = std::fmod(t, duration());
+		size_t next = 1;
+		while (next < keys.size() && keys[next].time < t)
+			next++;
+		const Keyframe& a = keys[next < keys.size() ? next - 1 : keys.size() - 1];
+		const Keyframe& b = keys[next < keys.size() ? next : keys.size() - 1];
+		float span = b.time - a.time;
+		float f = span > 0.0f ? (t - a.time) / span : 0.0f;
+
+		*pos = a.position + (b.position - a.position) * f;
+		float yaw = a.yaw + (b.yaw - a.yaw) * f;
+		float pitch = a.pitch + (b.pitch - a.pitch) * f;
+		*fov = a.fov + (b.fov - a.fov) * f;
+
+		glm::vec3 dir;
+		dir.x = cos(glm::radians(yaw)) * cos(glm::radians(pitch));
+		dir.y = sin(glm::radians(pitch));
+		dir.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
+		*front = glm::normalize(dir);
+	}
+};
+#endif
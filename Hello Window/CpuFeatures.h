@@ -0,0 +1,70 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// Runtime x86 feature checks, so SIMD kernels can be compiled into the binary
+// unconditionally and picked when the machine we run on supports them.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HELLO_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// SSE2 is part of the x64 baseline, 32-bit builds need it enabled explicitly
+#if defined(HELLO_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HELLO_SSE2 1
+#endif
+
+// on gcc/clang a kernel using wider instructions than the build's baseline has
+// to be tagged, msvc lets any function use any intrinsic.
+#if defined(HELLO_X86) && (defined(__GNUC__) || defined(__clang__))
+#define HELLO_TARGET_AVX __attribute__((target("avx")))
+#define HELLO_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define HELLO_TARGET_AVX
+#define HELLO_TARGET_AVX2
+#endif
+
+struct CpuFeatures
+{
+	bool sse2 = false;
+	bool avx = false;
+	bool avx2 = false;
+
+	static const CpuFeatures& get()
+	{
+		static const CpuFeatures features = detect();
+		return features;
+	}
+
+private:
+	static CpuFeatures detect()
+	{
+		CpuFeatures f;
+#if defined(HELLO_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+		__cpuid(info, 1);
+		f.sse2 = (info[3] & (1 << 26)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avxBit = (info[2] & (1 << 28)) != 0;
+		// the OS also has to save the ymm registers on context switches
+		bool ymmSaved = osxsave && (_xgetbv(0) & 6) == 6;
+		f.avx = avxBit && ymmSaved;
+		if (maxLeaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			f.avx2 = f.avx && (info[1] & (1 << 5)) != 0;
+		}
+#elif defined(HELLO_X86)
+		__builtin_cpu_init();
+		f.sse2 = __builtin_cpu_supports("sse2");
+		f.avx = __builtin_cpu_supports("avx");
+		f.avx2 = __builtin_cpu_supports("avx2");
+#endif
+		return f;
+	}
+};
+#endif
@@ -0,0 +1,167 @@
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Collects per-frame CPU time, GPU time and draw call counts and writes a
+// summary with percentiles as JSON. GPU time comes from GL_TIME_ELAPSED
+// queries kept in a small ring, results are read back a few frames later so
+// measuring doesn't stall the pipeline.
+class FrameProfiler
+{
+public:
+	static const int QUERY_RING = 8;
+
+	std::vector<double> cpuMs;
+	std::vector<double> gpuMs;
+	std::vector<int> drawCalls;
+	std::vector<double> transformMs;
+
+	FrameProfiler()
+	{
+		glGenQueries(QUERY_RING, queries);
+	}
+	~FrameProfiler()
+	{
+		glDeleteQueries(QUERY_RING, queries);
+	}
+	// ------------------------------------------------------------------------
+	void beginFrame()
+	{
+		// ring is full: the oldest query has to be read back before it can be reused
+		if (pending == QUERY_RING)
+			collect(true);
+		glBeginQuery(GL_TIME_ELAPSED, queries[head]);
+		cpuStart = std::chrono::steady_clock::now();
+	}
+	// ------------------------------------------------------------------------
+	void endFrame(int frameDrawCalls, double frameTransformMs = 0.0)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		head = (head + 1) % QUERY_RING;
+		pending++;
+		cpuMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpuStart).count());
+		drawCalls.push_back(frameDrawCalls);
+		transformMs.push_back(frameTransformMs);
+		collect(false);
+	}
+	// wait for every outstanding query, call once after the last frame.
+	// ------------------------------------------------------------------------
+	void finish()
+	{
+		while (pending > 0)
+			collect(true);
+	}
+	// drop everything recorded so far, used to discard warm-up frames.
+	// ------------------------------------------------------------------------
+	void reset()
+	{
+		finish();
+		cpuMs.clear();
+		gpuMs.clear();
+		drawCalls.clear();
+		transformMs.clear();
+	}
+	// ------------------------------------------------------------------------
+	bool writeJson(const char* path, const std::string& renderer, double timestep, const std::string& extra = "") const
+	{
+		std::ofstream out(path);
+		if (!out)
+		{
+			std::cout << "ERROR::PROFILER::COULD_NOT_OPEN " << path << std::endl;
+			return false;
+		}
+		long long totalDrawCalls = 0;
+		for (int d : drawCalls)
+			totalDrawCalls += d;
+		out << "{\n";
+		out << "  \"renderer\": \"" << escape(renderer) << "\",\n";
+		out << "  \"frames\": " << cpuMs.size() << ",\n";
+		out << "  \"timestep\": " << timestep << ",\n";
+		if (!extra.empty())
+			out << extra;
+		out << "  \"cpu_frame_ms\": ";
+		writeSummary(out, cpuMs);
+		out << ",\n  \"gpu_frame_ms\": ";
+		writeSummary(out, gpuMs);
+		out << ",\n  \"transform_update_ms\": ";
+		writeSummary(out, transformMs);
+		out << ",\n  \"draw_calls\": { \"total\": " << totalDrawCalls
+			<< ", \"per_frame\": " << (drawCalls.empty() ? 0.0 : (double)totalDrawCalls / drawCalls.size()) << " }\n";
+		out << "}\n";
+		return true;
+	}
+	// nearest-rank percentile, p in [0,100]
+	// ------------------------------------------------------------------------
+	static double percentile(std::vector<double> values, double p)
+	{
+		if (values.empty())
+			return 0.0;
+		std::sort(values.begin(), values.end());
+		size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+		if (rank > 0)
+			rank--;
+		return values[std::min(rank, values.size() - 1)];
+	}
+
+private:
+	unsigned int queries[QUERY_RING];
+	int head = 0;
+	int pending = 0;
+	std::chrono::steady_clock::time_point cpuStart;
+
+	// read back finished queries in submission order
+	void collect(bool wait)
+	{
+		while (pending > 0)
+		{
+			unsigned int query = queries[(head - pending + QUERY_RING) % QUERY_RING];
+			GLint available = 0;
+			if (!wait)
+			{
+				glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					return;
+			}
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+			gpuMs.push_back(ns / 1.0e6);
+			pending--;
+			if (wait)
+				return;
+		}
+	}
+	static void writeSummary(std::ofstream& out, const std::vector<double>& values)
+	{
+		double sum = 0.0;
+		for (double v : values)
+			sum += v;
+		double mean = values.empty() ? 0.0 : sum / values.size();
+		double lo = values.empty() ? 0.0 : *std::min_element(values.begin(), values.end());
+		double hi = values.empty() ? 0.0 : *std::max_element(values.begin(), values.end());
+		out << "{ \"mean\": " << mean << ", \"min\": " << lo << ", \"max\": " << hi
+			<< ", \"p50\": " << percentile(values, 50.0)
+			<< ", \"p95\": " << percentile(values, 95.0)
+			<< ", \"p99\": " << percentile(values, 99.0) << " }";
+	}
+	static std::string escape(const std::string& s)
+	{
+		std::string r;
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				r += '\\';
+			r += c;
+		}
+		return r;
+	}
+};
+#endif
@@ -0,0 +1,161 @@
+#ifndef HEADLESS_CONTEXT_H
+#define HEADLESS_CONTEXT_H
+
+// keep eglplatform.h from pulling in Xlib, we never talk to a display server
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <glad/glad.h>
+
+#include <cstdio>
+#include <iostream>
+
+// Offscreen OpenGL context for machines without a display (CI/build agents).
+// Uses EGL on the Mesa surfaceless platform, so it runs on llvmpipe, and renders
+// into a framebuffer object instead of a window's default framebuffer.
+class HeadlessContext
+{
+public:
+	unsigned int FBO = 0;
+	unsigned int colorRBO = 0;
+	unsigned int depthRBO = 0;
+	int width = 0;
+	int height = 0;
+
+	HeadlessContext() {}
+	~HeadlessContext()
+	{
+		destroy();
+	}
+	// create the EGL display and a core profile context and make it current.
+	// if the requested version isn't available we walk down to 3.3, which is
+	// the lowest our shaders are written for.
+	// ------------------------------------------------------------------------
+	bool create(int majorVersion, int minorVersion)
+	{
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay)
+			display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		if (display == EGL_NO_DISPLAY)
+			display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+		{
+			std::cout << "ERROR::EGL::NO_DISPLAY " << std::hex << eglGetError() << std::dec << std::endl;
+			return false;
+		}
+		if (!eglBindAPI(EGL_OPENGL_API))
+		{
+			std::cout << "ERROR::EGL::OPENGL_API_UNAVAILABLE" << std::endl;
+			return false;
+		}
+
+		while (context == EGL_NO_CONTEXT && (majorVersion > 3 || (majorVersion == 3 && minorVersion >= 3)))
+		{
+			EGLint contextAttribs[] = {
+				EGL_CONTEXT_MAJOR_VERSION, majorVersion,
+				EGL_CONTEXT_MINOR_VERSION, minorVersion,
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+				EGL_NONE
+			};
+			// surfaceless + configless: there is no surface to match a config against
+			context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+			if (context == EGL_NO_CONTEXT)
+			{
+				if (minorVersion > 0)
+					minorVersion--;
+				else
+				{
+					majorVersion--;
+					minorVersion = 5;
+				}
+			}
+		}
+		if (context == EGL_NO_CONTEXT)
+		{
+			std::cout << "ERROR::EGL::CONTEXT_CREATION_FAILED " << std::hex << eglGetError() << std::dec << std::endl;
+			return false;
+		}
+		if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		{
+			std::cout << "ERROR::EGL::MAKE_CURRENT_FAILED " << std::hex << eglGetError() << std::dec << std::endl;
+			return false;
+		}
+		return true;
+	}
+	// needs a loaded GL (gladLoadGLLoader) so call it after create().
+	// binds the FBO so everything after this draws offscreen.
+	// ------------------------------------------------------------------------
+	bool createFramebuffer(int w, int h)
+	{
+		width = w;
+		height = h;
+		glGenFramebuffers(1, &FBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+		glGenRenderbuffers(1, &colorRBO);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorRBO);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRBO);
+
+		glGenRenderbuffers(1, &depthRBO);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthRBO);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthRBO);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+	// write the color attachment out as a binary PPM so a headless run can be
+	// eyeballed. rows come back bottom-up from GL so we flip while writing.
+	// ------------------------------------------------------------------------
+	bool saveFramebuffer(const char* path) const
+	{
+		FILE* f = fopen(path, "wb");
+		if (!f)
+		{
+			std::cout << "ERROR::HEADLESS::COULD_NOT_OPEN " << path << std::endl;
+			return false;
+		}
+		unsigned char* pixels = new unsigned char[(size_t)width * height * 3];
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+		fprintf(f, "P6\n%d %d\n255\n", width, height);
+		for (int y = height - 1; y >= 0; y--)
+			fwrite(pixels + (size_t)y * width * 3, 1, (size_t)width * 3, f);
+		delete[] pixels;
+		fclose(f);
+		return true;
+	}
+
+private:
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+
+	void destroy()
+	{
+		if (context != EGL_NO_CONTEXT)
+		{
+			if (FBO)
+			{
+				glDeleteFramebuffers(1, &FBO);
+				glDeleteRenderbuffers(1, &colorRBO);
+				glDeleteRenderbuffers(1, &depthRBO);
+			}
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(display, context);
+		}
+		if (display != EGL_NO_DISPLAY)
+			eglTerminate(display);
+		context = EGL_NO_CONTEXT;
+		display = EGL_NO_DISPLAY;
+	}
+};
+#endif
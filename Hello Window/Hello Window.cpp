@@ -1,6 +1,8 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <glad/glad.h>
+#ifndef HELLO_NO_GLFW
 #include <glfw3.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -9,23 +11,76 @@
 #include <glm/mat4x4.hpp>
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
-#include "Shader.h"
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
 #include "stb_image.h"
+// the implementation is in this file, headers including stb_image.h after
+// this point only need the declarations
+#undef STB_IMAGE_IMPLEMENTATION
+#include "Shader.h"
+#include "ShaderLibrary.h"
+#include "CameraPath.h"
+#include "FrameProfiler.h"
+#include "InstanceBuffer.h"
+#include "ThreadPool.h"
+#include "TextureCache.h"
+#include "TextureStreamer.h"
+#include "TransformSystem.h"
+#ifdef HELLO_HEADLESS
+#include "HeadlessContext.h"
+#endif
+
+// command line switches
+struct LaunchOptions
+{
+	bool headless = false;		// render into an FBO on an EGL context instead of a window
+	int frames = 100;			// how many frames to render before exiting in headless mode
+	const char* screenshot = NULL;	// optional .ppm dump of the last headless frame
+	const char* benchmark = NULL;	// write frame time stats to this JSON file
+	const char* cameraPath = NULL;	// keyframe file for the benchmark camera, built in path if NULL
+	float timestep = 1.0f / 60.0f;	// simulated seconds per benchmark frame
+	int warmup = 10;			// benchmark frames rendered before measuring starts
+	int instances = 10;			// cubes in the field, the first 10 are the classic layout
+	bool instancing = true;		// one instanced draw for the field, false = one draw per cube
+	float animate = 0.0f;		// fraction of the cubes that spin, their transforms change every frame
+	const char* shaderCache = NULL;	// directory for linked program binaries
+	const char* startupBench = NULL;	// time building shaderVariants programs, write JSON here and exit
+	int shaderVariants = 100;
+	bool serialShaders = false;	// compile every program blocking, one after the other (no ShaderLibrary)
+	int streamTextures = 0;		// extra textures to load in the background while rendering
+	int textureBudget = 512;	// MB of textures the cache keeps resident
+	bool cookedTextures = false;	// load the cooked .ktx2 next to each source image when there is one
+	const char* mipmaps = "box";	// box / kaiser: built on the decode threads, gpu: glGenerateMipmap
+	int width = 3840;			// framebuffer size (window or headless FBO)
+	int height = 2160;
+};
 
+LaunchOptions parseLaunchOptions(int argc, char* argv[]);
+int runStartupBenchmark(const LaunchOptions& options, GLADloadproc load);
+#ifndef HELLO_NO_GLFW
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window, glm::vec3 *pos, glm::vec3 *front, glm::vec3 *up, float deltaTime);
+#endif
 void checkForShaderErrors(int success, char* logFile, unsigned int shader);
 void checkForLinkErrors(int success, char* logFile, unsigned int program);
-void loadTextureData(const char* path);
-void setTexture2DAttribs();
+std::vector<glm::vec3> makeCubeField(const glm::vec3* seed, int seedCount, int count);
+std::string texturePath(const char* source, const LaunchOptions& options);
+#ifndef HELLO_NO_GLFW
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void setupOpenGlVersion(int majorVersion, int minorVersion, bool coreMode);
+#endif
 
-// settings
-const unsigned int SCR_WIDTH = 3840;
-const unsigned int SCR_HEIGHT = 2160;
+// settings (defaults, --width/--height override them)
+unsigned int SCR_WIDTH = 3840;
+unsigned int SCR_HEIGHT = 2160;
 
 // camera
 glm::vec3 cameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
@@ -44,38 +99,104 @@ float deltaTime = 0.0f;	// time between current frame and last frame
 float lastFrame = 0.0f;
 
 
-int main()
-{
+#ifndef HELLO_NO_GLFW
+static bool windowShouldClose(GLFWwindow* window) { return glfwWindowShouldClose(window); }
+#else
+static bool windowShouldClose(void*) { return true; }
+#endif
 
-glfwInit();
-setupOpenGlVersion(4,6,true);
-// glfw window creation
-GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
-if (window == NULL)
+int main(int argc, char* argv[])
+{
+LaunchOptions options = parseLaunchOptions(argc, argv);
+SCR_WIDTH = options.width;
+SCR_HEIGHT = options.height;
+
+#ifdef HELLO_HEADLESS
+HeadlessContext headless;
+#endif
+GLADloadproc procLoader = NULL;
+#ifndef HELLO_NO_GLFW
+GLFWwindow* window = NULL;
+#else
+void* window = NULL;
+#endif
+
+if (options.headless)
 {
-	std::cout << "Failed to create GLFW window" << std::endl;
-	glfwTerminate();
+#ifdef HELLO_HEADLESS
+	// egl: surfaceless context, no window and no display server needed
+	if (!headless.create(4, 6))
+	{
+		std::cout << "Failed to create headless EGL context" << std::endl;
+		return -1;
+	}
+	procLoader = (GLADloadproc)eglGetProcAddress;
+	if (!gladLoadGLLoader(procLoader))
+	{
+		std::cout << "Failed to initialize GLAD" << std::endl;
+		return -1;
+	}
+	if (!headless.createFramebuffer(SCR_WIDTH, SCR_HEIGHT))
+		return -1;
+	std::cout << "headless: " << glGetString(GL_RENDERER) << " | " << glGetString(GL_VERSION) << std::endl;
+#else
+	std::cout << "This build has no headless support (EGL was not found)" << std::endl;
 	return -1;
+#endif
 }
-glfwMakeContextCurrent(window);
-// is called when window is resized
-glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-glfwSetCursorPosCallback(window, mouse_callback);
-glfwSetScrollCallback(window, scroll_callback);
-
-// glad: load all OpenGL function pointers
-// ---------------------------------------
-if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+else
 {
-	std::cout << "Failed to initialize GLAD" << std::endl;
+#ifndef HELLO_NO_GLFW
+	glfwInit();
+	setupOpenGlVersion(4,6,true);
+	// glfw window creation
+	window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+	if (window == NULL)
+	{
+		std::cout << "Failed to create GLFW window" << std::endl;
+		glfwTerminate();
+		return -1;
+	}
+	glfwMakeContextCurrent(window);
+	// is called when window is resized
+	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	glfwSetCursorPosCallback(window, mouse_callback);
+	glfwSetScrollCallback(window, scroll_callback);
+
+	// glad: load all OpenGL function pointers
+	// ---------------------------------------
+	procLoader = (GLADloadproc)glfwGetProcAddress;
+	if (!gladLoadGLLoader(procLoader))
+	{
+		std::cout << "Failed to initialize GLAD" << std::endl;
+		return -1;
+	}
+#else
+	std::cout << "This build has no window support (GLFW was not found), run with --headless" << std::endl;
 	return -1;
+#endif
 }
 glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 glEnable(GL_DEPTH_TEST);
 
+if (options.shaderCache) {
+	std::error_code ec;
+	std::filesystem::create_directories(options.shaderCache, ec);
+	Shader::binaryCacheDir() = options.shaderCache;
+}
+if (options.startupBench)
+	return runStartupBenchmark(options, procLoader);
 
-Shader shader("../Shaders/vertexShader.txt", "../shaders/fragshader.txt");
+// the scene program compiles in the background, a flat grey fallback draws
+// the scene until it's linked
+std::chrono::steady_clock::time_point shaderStart = std::chrono::steady_clock::now();
+ShaderLibrary shaders(procLoader);
+shaders.setFallback("../shaders/fallbackVertexShader.txt", "../shaders/fallbackFragShader.txt");
+int sceneProgram = shaders.submit("../shaders/vertexShader.txt", "../shaders/fragShader.txt");
+if (options.serialShaders)
+	shaders.finishAll();
+double shaderLoadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shaderStart).count();
 
 
 float vert1[] = {
@@ -149,7 +270,7 @@ float vert2[] =
 };
 
 // init VBO, VAO & EBO
-unsigned int VBO1, VAO1, VBO2, VAO2, EBO1, TEX1, TEX2;
+unsigned int VBO1, VAO1, VBO2, VAO2, EBO1;
 glGenVertexArrays(1, &VAO1);
 glGenBuffers(1, &VBO1);
 glBindVertexArray(VAO1);
@@ -171,20 +292,49 @@ glEnableVertexAttribArray(1);
 //glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
 //glEnableVertexAttribArray(2);
 
-// bind and load textures
-
-glGenTextures(1, &TEX1);
-glActiveTexture(GL_TEXTURE0);
-glBindTexture(GL_TEXTURE_2D, TEX1);
-setTexture2DAttribs();
-stbi_set_flip_vertically_on_load(true);
-loadTextureData("../textures/container.jpg");
-glGenTextures(1, &TEX2);
-glActiveTexture(GL_TEXTURE1);
-glBindTexture(GL_TEXTURE_2D, TEX2);
-setTexture2DAttribs();
-loadTextureData("../textures/awesomeface.jpg");
-glBindTexture(GL_TEXTURE_2D, 0);
+// every cube is translated to its spot and tilted 20 degrees per index around
+// the same axis. the transform system only rebuilds matrices that changed.
+const glm::vec3 cubeAxis(1.0f, 0.3f, 0.5f);
+std::vector<glm::vec3> fieldPositions = makeCubeField(cubePositions, 10, options.instances);
+TransformSystem transforms;
+for (size_t i = 0; i < fieldPositions.size(); i++)
+	transforms.add(fieldPositions[i], cubeAxis, glm::radians(20.0f * i));
+ThreadPool transformPool;
+int animatedCubes = (int)(options.animate * transforms.size());
+
+// per-instance model matrices: a mat4 attribute takes four vec4 slots (2..5),
+// each advancing once per instance instead of once per vertex. the per-object
+// path keeps its matrices on the CPU instead.
+InstanceBuffer instanceBuffer;
+std::vector<glm::mat4> objectModels;
+if (options.instancing) {
+	instanceBuffer.create(transforms.capacity() * sizeof(glm::mat4));
+	// each region of the buffer needs every change, not just the last frame's
+	transforms.setTargets(instanceBuffer.regionCount());
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer.ID);
+	for (int column = 0; column < 4; column++) {
+		glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(column * sizeof(glm::vec4)));
+		glVertexAttribDivisor(2 + column, 1);
+		glEnableVertexAttribArray(2 + column);
+	}
+}
+else
+	objectModels.resize(transforms.capacity());
+// with the arrays disabled the shader reads the current generic attribute
+// instead, make that the identity so the per-object path only uses "model"
+for (int column = 0; column < 4; column++)
+	glVertexAttrib4f(2 + column, column == 0, column == 1, column == 2, column == 3);
+
+// load textures: decoded on worker threads, uploaded a few per frame by
+// textures.update() in the loop. headless and benchmark runs wait for the
+// scene's own two so every frame draws the same thing.
+TextureStreamer textures;
+textures.setMipmaps(strcmp(options.mipmaps, "gpu") != 0, strcmp(options.mipmaps, "kaiser") == 0 ? MipChain::KAISER : MipChain::BOX);
+TextureCache textureCache(textures, (size_t)options.textureBudget << 20);
+TextureCache::Handle containerTexture = textureCache.acquire(texturePath("../textures/container.jpg", options));
+TextureCache::Handle faceTexture = textureCache.acquire(texturePath("../textures/awesomeface.jpg", options));
+if (options.headless || options.benchmark)
+	textures.finishAll();
 
 glBindBuffer(GL_ARRAY_BUFFER, 0);
 glBindVertexArray(0);
@@ -204,46 +354,132 @@ glm::vec3 cameraRight = glm::normalize(glm::cross(up, cameraDirection));
 //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 
+// benchmark: scripted camera at a fixed timestep so runs are comparable
+// ---------------------------------------------------------------------
+CameraPath benchmarkPath;
+std::unique_ptr<FrameProfiler> profiler;
+int frameLimit = options.frames;
+if (options.benchmark)
+{
+	if (options.cameraPath && !benchmarkPath.load(options.cameraPath))
+		return -1;
+	profiler.reset(new FrameProfiler());
+	frameLimit += options.warmup;
+#ifndef HELLO_NO_GLFW
+	if (window)
+		glfwSwapInterval(0);
+#endif
+}
+
+// uniform handles of the program currently drawing, resolved whenever it
+// changes (fallback -> scene program), the loop only passes integers around
+unsigned int boundProgram = 0;
+int viewHandle = -1, projectionHandle = -1, modelHandle = -1;
+
 // render loop
 // -----------
-while (!glfwWindowShouldClose(window))
+std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+int framesRendered = 0;
+int streamingFrames = -1;	// frames until the --stream-textures batch was uploaded
+while ((options.headless || options.benchmark) ? framesRendered < frameLimit : !windowShouldClose(window))
 {
+	int frameDrawCalls = 0;
+	if (profiler)
+		profiler->beginFrame();
 
 	// input
 	// -----
-	float currentFrame = glfwGetTime();
+	float currentFrame;
+	if (options.benchmark)
+		currentFrame = framesRendered * options.timestep;
+	else
+		currentFrame = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
 	deltaTime = currentFrame - lastFrame;
 	lastFrame = currentFrame;
 
-	processInput(window, &cameraPos, &cameraFront, &cameraUp, deltaTime);
+	if (options.benchmark)
+		benchmarkPath.sample(currentFrame, &cameraPos, &cameraFront, &fov);
+#ifndef HELLO_NO_GLFW
+	else if (!options.headless)
+		processInput(window, &cameraPos, &cameraFront, &cameraUp, deltaTime);
+#endif
+
+	// transforms: spin the animated cubes, then rebuild whatever is dirty
+	std::chrono::steady_clock::time_point transformStart = std::chrono::steady_clock::now();
+	for (int i = 0; i < animatedCubes; i++)
+		transforms.setRotation(i, cubeAxis, glm::radians(20.0f * i + 50.0f * currentFrame));
+	if (options.instancing) {
+		if (transforms.anyDirty(instanceBuffer.region())) {
+			transforms.update((float*)instanceBuffer.beginWrite(), &transformPool, instanceBuffer.region());
+			instanceBuffer.endWrite();
+		}
+	}
+	else if (transforms.anyDirty()) {
+		transforms.update(&objectModels[0][0][0], &transformPool);
+	}
+	double transformMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - transformStart).count();
+	// --stream-textures: load a batch in the background once measuring starts
+	// to see whether it shows up in the frame times. it goes to the streamer
+	// directly, the cache would notice it's the same two files over and over
+	int streamStart = options.benchmark ? options.warmup : 0;
+	if (framesRendered == streamStart) {
+		for (int i = 0; i < options.streamTextures; i++)
+			textures.request(texturePath(i % 2 ? "../textures/awesomeface.jpg" : "../textures/container.jpg", options),
+				GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR);
+	}
+	textureCache.update();
+	if (streamingFrames < 0 && options.streamTextures > 0 && framesRendered >= streamStart && textures.pendingCount() == 0)
+		streamingFrames = framesRendered - streamStart + 1;
+	// pick up programs that finished compiling, draw with the fallback until then
+	shaders.poll();
+	Shader& shader = shaders.get(sceneProgram);
 	shader.use();
+	if (shader.ID != boundProgram) {
+		boundProgram = shader.ID;
+		viewHandle = shader.uniformHandle("view");
+		projectionHandle = shader.uniformHandle("projection");
+		modelHandle = shader.uniformHandle("model");
+		// the instanced path carries the model matrix per instance
+		shader.setMat4(modelHandle, glm::mat4(1.0f));
+		// the samplers never change units, so they only need setting once
+		shader.setInt("tex1", 0);
+		shader.setInt("tex2", 1);
+	}
 
 
 	view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
 	projection = glm::perspective(glm::radians(fov), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.00f);
-	shader.setMat4("view", view);
-	shader.setMat4("projection", projection);
+	shader.setMat4(viewHandle, view);
+	shader.setMat4(projectionHandle, projection);
 
 	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, TEX1);
+	glBindTexture(GL_TEXTURE_2D, containerTexture.get());
 	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, TEX2);
+	glBindTexture(GL_TEXTURE_2D, faceTexture.get());
 	glBindVertexArray(VAO1);
 
-	for (unsigned int i = 0; i < 10; i++) {
+	if (options.instancing) {
+		// the whole field in one draw, transforms come from this frame's
+		// region of the instance buffer
+		GLuint baseInstance = (GLuint)(instanceBuffer.regionOffset() / sizeof(glm::mat4));
+		if (baseInstance)
+			glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, 36, (GLsizei)transforms.size(), baseInstance);
+		else
+			glDrawArraysInstanced(GL_TRIANGLES, 0, 36, (GLsizei)transforms.size());
+		frameDrawCalls++;
+		instanceBuffer.fenceReads();
+	}
+	else {
+		for (int i = 0; i < transforms.size(); i++) {
 
-		// calculate the model matrix for each object and pass it to shader before drawing
-		glm::mat4 model(1);
-		model = glm::translate(model, cubePositions[i]);
-		float angle = 20.0f * i;
-		model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-		shader.setMat4("model", model);
-		shader.setInt("tex1", 0);
-		shader.setInt("tex2", 1);
-		glDrawArrays(GL_TRIANGLES, 0, 36);
+			// pass each object's model matrix to the shader before drawing it
+			shader.setMat4(modelHandle, objectModels[i]);
+			glDrawArrays(GL_TRIANGLES, 0, 36);
+			frameDrawCalls++;
+		}
 	}
 
 
@@ -257,19 +493,139 @@ while (!glfwWindowShouldClose(window))
 	glBindVertexArray(0);
 
 
-	// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-	// -------------------------------------------------------------------------------
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+#ifndef HELLO_NO_GLFW
+	if (!options.headless)
+	{
+		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+		// -------------------------------------------------------------------------------
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+#endif
+
+	// there is no swap to pace a headless benchmark, finish the frame so the
+	// cpu time covers the actual rendering rather than just command submission
+	if (options.headless && profiler)
+		glFinish();
+
+	framesRendered++;
+	if (profiler)
+	{
+		profiler->endFrame(frameDrawCalls, transformMs);
+		if (framesRendered == options.warmup)
+			profiler->reset();
+	}
+}
+
+if (profiler)
+{
+	profiler->finish();
+	std::ostringstream extra;
+	extra << "  \"resolution\": [" << SCR_WIDTH << ", " << SCR_HEIGHT << "],\n";
+	extra << "  \"warmup_frames\": " << options.warmup << ",\n";
+	extra << "  \"instances\": " << fieldPositions.size() << ",\n";
+	extra << "  \"instancing\": " << (options.instancing ? "true" : "false") << ",\n";
+	extra << "  \"animated_instances\": " << animatedCubes << ",\n";
+	extra << "  \"shader_load_ms\": " << shaderLoadMs << ",\n";
+	extra << "  \"shader_from_cache\": " << (shaders.get(sceneProgram).fromCache ? "true" : "false") << ",\n";
+	extra << "  \"textures_streamed\": " << options.streamTextures << ",\n";
+	extra << "  \"texture_stream_frames\": " << streamingFrames << ",\n";
+	extra << "  \"mipmaps\": \"" << options.mipmaps << "\",\n";
+	extra << "  \"texture_upload_bytes\": " << textures.bytesUploaded() << ",\n";
+	extra << "  \"texture_cache\": { \"hit_rate\": " << textureCache.hitRate() << ", \"hits\": " << textureCache.hitCount()
+		<< ", \"misses\": " << textureCache.missCount() << ", \"evictions\": " << textureCache.evictionCount()
+		<< ", \"resident_bytes\": " << textureCache.residentBytes() << ", \"budget_bytes\": " << textureCache.budgetBytes() << " },\n";
+	extra << "  \"camera_path\": \"" << (options.cameraPath ? options.cameraPath : "builtin") << "\",\n";
+	if (!profiler->writeJson(options.benchmark, (const char*)glGetString(GL_RENDERER), options.timestep, extra.str()))
+		return -1;
+	std::cout << "benchmark: " << profiler->cpuMs.size() << " frames, cpu p50 " << FrameProfiler::percentile(profiler->cpuMs, 50.0)
+		<< " ms p99 " << FrameProfiler::percentile(profiler->cpuMs, 99.0) << " ms, gpu p50 " << FrameProfiler::percentile(profiler->gpuMs, 50.0)
+		<< " ms, wrote " << options.benchmark << std::endl;
+	profiler.reset();
+}
+
+if (options.headless)
+{
+	// nothing presents the frames, so wait for the GPU before reading the clock
+	glFinish();
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << "headless: rendered " << framesRendered << " frames in " << seconds << "s ("
+		<< (framesRendered ? seconds * 1000.0f / framesRendered : 0.0f) << " ms/frame)" << std::endl;
+#ifdef HELLO_HEADLESS
+	if (options.screenshot)
+		headless.saveFramebuffer(options.screenshot);
+#endif
+	return 0;
 }
 
+#ifndef HELLO_NO_GLFW
 // glfw: terminate, clearing all previously allocated GLFW resources.
 // ------------------------------------------------------------------
 
 glfwTerminate();
+#endif
 return 0;
 }
 
+// parse the command line:
+//     --headless [--frames N] [--screenshot out.ppm]
+//     --benchmark out.json [--camera-path keys.txt] [--timestep s] [--warmup N]
+//     --instances N --no-instancing --animate fraction --width W --height H
+//     --shader-cache dir --startup-bench out.json [--shader-variants N] --serial-shaders
+//     --stream-textures N --texture-budget MB --cooked-textures --mipmaps box|kaiser|gpu
+// ---------------------------------------------------------------------------------------------------------
+LaunchOptions parseLaunchOptions(int argc, char* argv[])
+{
+	LaunchOptions options;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0)
+			options.headless = true;
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			options.frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc)
+			options.screenshot = argv[++i];
+		else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+			options.benchmark = argv[++i];
+		else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc)
+			options.cameraPath = argv[++i];
+		else if (strcmp(argv[i], "--timestep") == 0 && i + 1 < argc)
+			options.timestep = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+			options.warmup = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+			options.instances = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--no-instancing") == 0)
+			options.instancing = false;
+		else if (strcmp(argv[i], "--animate") == 0 && i + 1 < argc)
+			options.animate = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc)
+			options.shaderCache = argv[++i];
+		else if (strcmp(argv[i], "--startup-bench") == 0 && i + 1 < argc)
+			options.startupBench = argv[++i];
+		else if (strcmp(argv[i], "--shader-variants") == 0 && i + 1 < argc)
+			options.shaderVariants = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--serial-shaders") == 0)
+			options.serialShaders = true;
+		else if (strcmp(argv[i], "--stream-textures") == 0 && i + 1 < argc)
+			options.streamTextures = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc)
+			options.textureBudget = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cooked-textures") == 0)
+			options.cookedTextures = true;
+		else if (strcmp(argv[i], "--mipmaps") == 0 && i + 1 < argc)
+			options.mipmaps = argv[++i];
+		else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+			options.width = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+			options.height = atoi(argv[++i]);
+		else
+			std::cout << "unknown argument " << argv[i] << std::endl;
+	}
+	return options;
+}
+
+#ifndef HELLO_NO_GLFW
+
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
 void processInput(GLFWwindow* window, glm::vec3 *pos, glm::vec3 *front, glm::vec3 *up, float deltaTime)
@@ -309,6 +665,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 	// height will be significantly larger than specified on retina displays.
 	glViewport(0, 0, width, height);
 }
+#endif
 
 void checkForShaderErrors(int success, char* logFile, unsigned int shader) {
 
@@ -330,26 +687,117 @@ void checkForLinkErrors(int success, char* logFile, unsigned int program) {
 	}
 }
 
-void loadTextureData(const char* path) {
-
-	int h, w, nrChannels;
-	unsigned char* data = stbi_load(path, &w, &h, &nrChannels, 0);
-	if (data) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		stbi_image_free(data);
+// build shaderVariants distinct programs (the scene shader with a different
+// #define each) and time it. run once against an empty --shader-cache and once
+// against the filled one to see what the cache saves on a cold start, and with
+// --serial-shaders to compare against submitting them all to a ShaderLibrary.
+// ---------------------------------------------------------------------------------------------------------
+int runStartupBenchmark(const LaunchOptions& options, GLADloadproc load)
+{
+	std::vector<double> programMs;
+	int cacheHits = 0;
+	bool parallel = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (options.serialShaders) {
+		for (int i = 0; i < options.shaderVariants; i++) {
+			std::chrono::steady_clock::time_point programStart = std::chrono::steady_clock::now();
+			Shader variant("../shaders/vertexShader.txt", "../shaders/fragShader.txt", "#define VARIANT " + std::to_string(i) + "\n");
+			// some drivers finish compiling on first use, make that part of the cost
+			variant.use();
+			programMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - programStart).count());
+			if (variant.fromCache)
+				cacheHits++;
+			glDeleteProgram(variant.ID);
+		}
 	}
 	else {
-		std::cout << "ERROR::failed to load texture" << std::endl;
+		// everything goes in up front, then we wait for the last one; per program
+		// time is when it was seen ready, counted from the start
+		ShaderLibrary library(load);
+		parallel = library.parallelCompile();
+		for (int i = 0; i < options.shaderVariants; i++)
+			library.submit("../shaders/vertexShader.txt", "../shaders/fragShader.txt", "#define VARIANT " + std::to_string(i) + "\n");
+		std::vector<bool> seen(library.size(), false);
+		size_t remaining = library.size();
+		while (remaining > 0) {
+			library.poll(options.shaderVariants);
+			for (size_t i = 0; i < library.size(); i++) {
+				if (seen[i] || !library.isReady((int)i))
+					continue;
+				seen[i] = true;
+				remaining--;
+				Shader& variant = library.get((int)i);
+				variant.use();
+				programMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+				if (variant.fromCache)
+					cacheHits++;
+			}
+		}
 	}
+	glFinish();
+	double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::ofstream out(options.startupBench);
+	if (!out) {
+		std::cout << "ERROR::STARTUP_BENCH::COULD_NOT_OPEN " << options.startupBench << std::endl;
+		return -1;
+	}
+	out << "{\n";
+	out << "  \"renderer\": \"" << glGetString(GL_RENDERER) << "\",\n";
+	out << "  \"variants\": " << options.shaderVariants << ",\n";
+	out << "  \"shader_cache\": " << (options.shaderCache ? "true" : "false") << ",\n";
+	out << "  \"compile\": \"" << (options.serialShaders ? "serial" : (parallel ? "parallel" : "deferred")) << "\",\n";
+	out << "  \"cache_hits\": " << cacheHits << ",\n";
+	out << "  \"total_ms\": " << totalMs << ",\n";
+	out << "  \"" << (options.serialShaders ? "per_program_ms" : "ready_after_ms") << "\": { \"p50\": " << FrameProfiler::percentile(programMs, 50.0)
+		<< ", \"p95\": " << FrameProfiler::percentile(programMs, 95.0)
+		<< ", \"p99\": " << FrameProfiler::percentile(programMs, 99.0) << " }\n";
+	out << "}\n";
+	std::cout << "startup: " << options.shaderVariants << " programs in " << totalMs << " ms, "
+		<< cacheHits << " from cache, wrote " << options.startupBench << std::endl;
+	return 0;
+}
+
+// with --cooked-textures, the .ktx2 (tools/TextureCooker) next to a source
+// image if there is one: it uploads without decoding and has its mips
+// prebuilt. not the default because llvmpipe samples BC7 in software, which
+// makes it the slowest option by far on the build agents.
+// ---------------------------------------------------------------------------------------------------------
+std::string texturePath(const char* source, const LaunchOptions& options)
+{
+	std::filesystem::path cooked = std::filesystem::path(source).replace_extension(".ktx2");
+	std::error_code ec;
+	if (options.cookedTextures && std::filesystem::exists(cooked, ec))
+		return cooked.string();
+	return source;
 }
 
-void setTexture2DAttribs() {
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// the first seedCount cubes keep their hand placed positions, the rest are laid
+// out on a grid behind them so large counts stay deterministic between runs
+// ---------------------------------------------------------------------------------------------------------
+std::vector<glm::vec3> makeCubeField(const glm::vec3* seed, int seedCount, int count)
+{
+	std::vector<glm::vec3> positions;
+	positions.reserve(count > 0 ? count : 0);
+	for (int i = 0; i < count && i < seedCount; i++)
+		positions.push_back(seed[i]);
+
+	int extra = count - seedCount;
+	if (extra <= 0)
+		return positions;
+	int side = (int)std::ceil(std::cbrt((double)extra));
+	const float spacing = 2.5f;
+	float half = (side - 1) * spacing * 0.5f;
+	for (int i = 0; i < extra; i++) {
+		int x = i % side;
+		int y = (i / side) % side;
+		int z = i / (side * side);
+		positions.push_back(glm::vec3(x * spacing - half, y * spacing - half, -20.0f - z * spacing));
+	}
+	return positions;
 }
+
+#ifndef HELLO_NO_GLFW
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 {
 	if (firstMouse)
@@ -407,5 +855,4 @@ void setupOpenGlVersion(int majorVersion, int minorVersion, bool coreMode) {
 	}
 	
 }
-
-
+#endif
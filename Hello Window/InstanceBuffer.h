@@ -0,0 +1,117 @@
+#ifndef INSTANCE_BUFFER_H
+#define INSTANCE_BUFFER_H
+
+#include <glad/glad.h>
+
+// Vertex buffer for per-instance data that the CPU writes directly. On GL 4.4+
+// it is created with immutable storage and mapped once, persistently and
+// coherently, so writes need no map/unmap per frame. The mapping is split into
+// REGIONS copies used round robin, one per frame, each with a fence placed
+// after the draws that read it: writing a frame only waits for the GPU to be
+// done with the frame REGIONS - 1 before it, not the last one. Draw from
+// regionOffset() (e.g. as a base instance). Older contexts have one region and
+// map a write-only range each time instead.
+class InstanceBuffer
+{
+public:
+	static const int REGIONS = 3;
+	unsigned int ID = 0;
+
+	InstanceBuffer() {}
+	~InstanceBuffer()
+	{
+		for (GLsync fence : fences)
+			if (fence)
+				glDeleteSync(fence);
+		if (ID)
+		{
+			if (persistent)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, ID);
+				glUnmapBuffer(GL_ARRAY_BUFFER);
+			}
+			glDeleteBuffers(1, &ID);
+		}
+	}
+	// ------------------------------------------------------------------------
+	void create(size_t sizeInBytes)
+	{
+		size = sizeInBytes;
+		glGenBuffers(1, &ID);
+		glBindBuffer(GL_ARRAY_BUFFER, ID);
+		if (GLAD_GL_VERSION_4_4 && glBufferStorage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_ARRAY_BUFFER, size * REGIONS, NULL, flags);
+			mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size * REGIONS, flags);
+			persistent = mapped != NULL;
+		}
+		else
+		{
+			glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+		}
+	}
+	// regions in use (1 without persistent mapping), the one this frame writes
+	// and draws from, and where it starts in the buffer
+	int regionCount() const
+	{
+		return persistent ? REGIONS : 1;
+	}
+	int region() const
+	{
+		return current;
+	}
+	size_t regionOffset() const
+	{
+		return current * size;
+	}
+	// pointer to write the current region through. waits for the last frame
+	// that read this region to finish, call endWrite() when done.
+	// ------------------------------------------------------------------------
+	void* beginWrite()
+	{
+		if (persistent)
+		{
+			GLsync& fence = fences[current];
+			if (fence)
+			{
+				while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+					;
+				glDeleteSync(fence);
+				fence = 0;
+			}
+			return (char*)mapped + regionOffset();
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, ID);
+		return glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT);
+	}
+	void endWrite()
+	{
+		if (!persistent)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, ID);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+	}
+	// call after the draws that source the current region have been
+	// submitted, moves on to the next region
+	// ------------------------------------------------------------------------
+	void fenceReads()
+	{
+		if (!persistent)
+			return;
+		GLsync& fence = fences[current];
+		if (fence)
+			glDeleteSync(fence);
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		current = (current + 1) % REGIONS;
+	}
+
+private:
+	size_t size = 0;
+	void* mapped = NULL;
+	bool persistent = false;
+	int current = 0;
+	GLsync fences[REGIONS] = {};
+};
+#endif
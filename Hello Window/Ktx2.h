@@ -0,0 +1,190 @@
+#ifndef KTX2_H
+#define KTX2_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Just enough of KTX 2.0 for our cooked textures: one 2D image (no layers,
+// faces or depth), block compressed, no supercompression, with its mip chain.
+// The writer is used by tools/TextureCooker, the reader by TextureStreamer.
+namespace Ktx2
+{
+	// the Vulkan format numbers KTX2 identifies formats by
+	enum Format
+	{
+		BC7_UNORM = 145,
+		BC7_SRGB = 146,
+		ETC2_RGB8_UNORM = 147,
+		ETC2_RGB8_SRGB = 148,
+		ETC2_RGBA8_UNORM = 151,
+		ETC2_RGBA8_SRGB = 152,
+		ASTC_4x4_UNORM = 157,
+		ASTC_4x4_SRGB = 158,
+	};
+
+	static const unsigned char IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+	struct Level
+	{
+		uint64_t offset;	// into the file
+		uint64_t length;
+	};
+
+	struct File
+	{
+		uint32_t format = 0;
+		uint32_t width = 0, height = 0;
+		std::vector<Level> levels;	// level 0 (full size) first
+		std::vector<unsigned char> data;	// the whole file
+
+		// reads and validates path, prints why when it can't be used
+		// --------------------------------------------------------------------
+		bool load(const std::string& path)
+		{
+			std::ifstream file(path, std::ios::binary | std::ios::ate);
+			if (!file)
+			{
+				std::cout << "ERROR::KTX2::can't open " << path << std::endl;
+				return false;
+			}
+			data.resize((size_t)file.tellg());
+			file.seekg(0);
+			file.read((char*)data.data(), data.size());
+			if (data.size() < 80 || memcmp(data.data(), IDENTIFIER, 12) != 0)
+			{
+				std::cout << "ERROR::KTX2::not a KTX2 file " << path << std::endl;
+				return false;
+			}
+			format = read32(12);
+			width = read32(20);
+			height = read32(24);
+			uint32_t depth = read32(28), layers = read32(32), faces = read32(36);
+			uint32_t levelCount = read32(40), supercompression = read32(44);
+			if (depth > 1 || layers > 1 || faces != 1 || supercompression != 0 || levelCount == 0)
+			{
+				std::cout << "ERROR::KTX2::only plain 2D textures are supported " << path << std::endl;
+				return false;
+			}
+			if (data.size() < 80 + levelCount * 24)
+				return false;
+			levels.resize(levelCount);
+			for (uint32_t i = 0; i < levelCount; i++)
+			{
+				levels[i].offset = read64(80 + i * 24);
+				levels[i].length = read64(80 + i * 24 + 8);
+				if (levels[i].offset + levels[i].length > data.size())
+				{
+					std::cout << "ERROR::KTX2::truncated " << path << std::endl;
+					return false;
+				}
+			}
+			return true;
+		}
+
+	private:
+		uint32_t read32(size_t at) const
+		{
+			uint32_t v;
+			memcpy(&v, &data[at], 4);
+			return v;
+		}
+		uint64_t read64(size_t at) const
+		{
+			uint64_t v;
+			memcpy(&v, &data[at], 8);
+			return v;
+		}
+	};
+
+	// write a BC7 texture, levels[0] is the full size image. the rows are
+	// expected bottom-up (what GL wants), which the orientation key records.
+	// ------------------------------------------------------------------------
+	inline bool writeBc7(const std::string& path, uint32_t width, uint32_t height, bool srgb,
+		const std::vector<std::vector<unsigned char>>& levels)
+	{
+		std::vector<unsigned char> out;
+		auto put32 = [&](uint32_t v) { out.insert(out.end(), (unsigned char*)&v, (unsigned char*)&v + 4); };
+		auto put64 = [&](uint64_t v) { out.insert(out.end(), (unsigned char*)&v, (unsigned char*)&v + 8); };
+		auto align = [&](size_t to) { while (out.size() % to) out.push_back(0); };
+		uint32_t levelCount = (uint32_t)levels.size();
+
+		out.insert(out.end(), IDENTIFIER, IDENTIFIER + 12);
+		put32(srgb ? BC7_SRGB : BC7_UNORM);
+		put32(1);					// typeSize
+		put32(width);
+		put32(height);
+		put32(0);					// depth
+		put32(0);					// layers
+		put32(1);					// faces
+		put32(levelCount);
+		put32(0);					// supercompression
+		size_t indexAt = out.size();
+		out.resize(out.size() + 32 + levelCount * 24);	// filled in below
+
+		// data format descriptor: one basic block, BC7, a single 128 bit sample
+		uint32_t dfdOffset = (uint32_t)out.size();
+		put32(44);					// total size
+		put32(0);					// vendor 0 (Khronos), descriptor type 0 (basic)
+		put32(2 | (40 << 16));		// version 2, block size 24 + 16 per sample
+		out.push_back(134);			// colour model BC7 (KHR_DF_MODEL_BC7)
+		out.push_back(1);			// primaries BT709
+		out.push_back(srgb ? 2 : 1);	// transfer sRGB / linear
+		out.push_back(0);			// straight alpha
+		out.push_back(3);			// 4x4 texel blocks (stored minus one)
+		out.push_back(3);
+		out.push_back(0);
+		out.push_back(0);
+		put64(16);					// bytes per plane: 16, 0...
+		put32(127 << 16);			// sample: bit offset 0, 128 bits (minus one), channel 0
+		put32(0);					// sample position
+		put32(0);					// lower
+		put32(0xFFFFFFFFu);			// upper
+
+		// key/value data, the orientation of the stored rows (right, up)
+		uint32_t kvdOffset = (uint32_t)out.size();
+		const char kv[] = "KTXorientation\0ru";
+		put32((uint32_t)sizeof(kv));
+		out.insert(out.end(), kv, kv + sizeof(kv));
+		align(4);
+		uint32_t kvdLength = (uint32_t)out.size() - kvdOffset;
+
+		// the level data goes smallest first, each 16 byte aligned
+		std::vector<uint64_t> offsets(levelCount);
+		for (uint32_t i = levelCount; i-- > 0;)
+		{
+			align(16);
+			offsets[i] = out.size();
+			out.insert(out.end(), levels[i].begin(), levels[i].end());
+		}
+
+		size_t at = indexAt;
+		auto patch32 = [&](uint32_t v) { memcpy(&out[at], &v, 4); at += 4; };
+		auto patch64 = [&](uint64_t v) { memcpy(&out[at], &v, 8); at += 8; };
+		patch32(dfdOffset);
+		patch32(44);
+		patch32(kvdOffset);
+		patch32(kvdLength);
+		patch64(0);					// no supercompression global data
+		patch64(0);
+		for (uint32_t i = 0; i < levelCount; i++)
+		{
+			patch64(offsets[i]);
+			patch64(levels[i].size());
+			patch64(levels[i].size());
+		}
+
+		std::ofstream file(path, std::ios::binary);
+		file.write((const char*)out.data(), out.size());
+		if (!file)
+		{
+			std::cout << "ERROR::KTX2::can't write " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+}
+#endif
@@ -0,0 +1,400 @@
+#ifndef MIP_CHAIN_H
+#define MIP_CHAIN_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "CpuFeatures.h"
+
+#ifdef HELLO_SSE2
+#include <immintrin.h>
+#endif
+
+// Builds a texture's mip chain on the CPU, so uploads can carry every level
+// instead of asking the driver for glGenerateMipmap (which blocks, varies in
+// filtering between vendors and on llvmpipe runs on the CPU anyway).
+//
+// BOX averages 2x2 blocks; for linear 4 byte texels that runs as integer
+// SSE2 / AVX2 with the same rounding as the scalar code. sRGB data and the
+// KAISER filter (8 tap windowed sinc per axis, sharper than the box) work on
+// linear float RGBA, one __m128 per texel, and only round back to 8 bit when a
+// level is written out, so errors don't pile up down the chain.
+class MipChain
+{
+public:
+	enum Filter { BOX, KAISER };
+	enum Isa { AUTO, SCALAR, SSE2, AVX2 };	// forcing one is for benchmarks
+
+	static int levelCount(int width, int height)
+	{
+		int levels = 1;
+		while ((width | height) >> levels)
+			levels++;
+		return levels;
+	}
+	// bytes of levels [1, levels) back to back
+	static size_t chainBytes(int width, int height, int components, int levels)
+	{
+		size_t bytes = 0;
+		for (int level = 1; level < levels; level++)
+			bytes += (size_t)std::max(width >> level, 1) * std::max(height >> level, 1) * components;
+		return bytes;
+	}
+
+	// writes levels 1 .. levels-1 of the 8 bit image level0 (components 1-4
+	// per texel, tightly packed rows) to out, chainBytes() of them
+	// ------------------------------------------------------------------------
+	static void build(const unsigned char* level0, int width, int height, int components, int levels,
+		bool srgb, Filter filter, unsigned char* out, Isa isa = AUTO)
+	{
+		if (levels < 2)
+			return;
+		if (isa == AUTO)
+		{
+			const CpuFeatures& cpu = CpuFeatures::get();
+			isa = cpu.avx2 ? AVX2 : cpu.sse2 ? SSE2 : SCALAR;
+		}
+#ifndef HELLO_SSE2
+		isa = SCALAR;
+#endif
+		if (!srgb && filter == BOX)
+		{
+			const unsigned char* src = level0;
+			int w = width, h = height;
+			for (int level = 1; level < levels; level++)
+			{
+				box8(src, w, h, components, out, isa);
+				src = out;
+				out += (size_t)std::max(w / 2, 1) * std::max(h / 2, 1) * components;
+				w = std::max(w / 2, 1);
+				h = std::max(h / 2, 1);
+			}
+			return;
+		}
+
+		// level 0 is converted a row at a time as the filters read it, the
+		// smaller levels are kept in float
+		std::vector<float> current, next;
+		Source source;
+		source.bytes = level0;
+		source.width = width;
+		source.height = height;
+		source.components = components;
+		for (int k = 0; k < 4; k++)
+			source.table[k] = srgb && components >= 3 && k < 3 ? tables().decode : tables().unorm;
+		for (int level = 1; level < levels; level++)
+		{
+			int nw = std::max(source.width / 2, 1), nh = std::max(source.height / 2, 1);
+			next.resize((size_t)nw * nh * 4);
+			if (filter == KAISER)
+				kaiser(source, next.data(), isa != SCALAR);
+			else
+				boxFloat(source, next.data(), isa != SCALAR);
+			fromFloat(next.data(), (size_t)nw * nh, components, srgb, out);
+			out += (size_t)nw * nh * components;
+			current.swap(next);
+			source.bytes = NULL;
+			source.floats = current.data();
+			source.width = nw;
+			source.height = nh;
+		}
+	}
+
+private:
+	// ---- 8 bit box ---------------------------------------------------------
+	static void box8(const unsigned char* src, int width, int height, int c, unsigned char* dst, Isa isa)
+	{
+		int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+		for (int y = 0; y < h; y++)
+		{
+			const unsigned char* row0 = src + (size_t)std::min(y * 2, height - 1) * width * c;
+			const unsigned char* row1 = src + (size_t)std::min(y * 2 + 1, height - 1) * width * c;
+			unsigned char* d = dst + (size_t)y * w * c;
+			int x = 0;
+			// the vector loops need both source columns, i.e. width >= 2
+			if (c == 4 && width >= 2)
+			{
+#ifdef HELLO_SSE2
+				if (isa == AVX2)
+					x = boxRowAvx2(row0, row1, d, w);
+				else if (isa == SSE2)
+					x = boxRowSse2(row0, row1, d, w);
+#endif
+			}
+			for (; x < w; x++)
+			{
+				int x0 = std::min(x * 2, width - 1) * c, x1 = std::min(x * 2 + 1, width - 1) * c;
+				for (int i = 0; i < c; i++)
+					d[x * c + i] = (unsigned char)((row0[x0 + i] + row0[x1 + i] + row1[x0 + i] + row1[x1 + i] + 2) >> 2);
+			}
+		}
+	}
+#ifdef HELLO_SSE2
+	// 4 output texels per iteration: widen to 16 bit, add the rows, then add
+	// neighbouring texels by pairing up 64 bit halves. returns texels done.
+	static int boxRowSse2(const unsigned char* row0, const unsigned char* row1, unsigned char* d, int w)
+	{
+		const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+		int x = 0;
+		for (; x + 4 <= w; x += 4)
+		{
+			__m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16));
+			__m128i a1 = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16));
+			// s0 = texels 0,1  s1 = 2,3  s2 = 4,5  s3 = 6,7, rows summed
+			__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(a1, zero));
+			__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(a1, zero));
+			__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero));
+			__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero));
+			__m128i q01 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+			__m128i q23 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+			q01 = _mm_srli_epi16(_mm_add_epi16(q01, two), 2);
+			q23 = _mm_srli_epi16(_mm_add_epi16(q23, two), 2);
+			_mm_storeu_si128((__m128i*)(d + x * 4), _mm_packus_epi16(q01, q23));
+		}
+		return x;
+	}
+	// same 8 wide. the unpacks work per 128 bit lane, so the packed result
+	// comes out with its middle quarters swapped and gets permuted back.
+	HELLO_TARGET_AVX2 static int boxRowAvx2(const unsigned char* row0, const unsigned char* row1, unsigned char* d, int w)
+	{
+		const __m256i zero = _mm256_setzero_si256(), two = _mm256_set1_epi16(2);
+		int x = 0;
+		for (; x + 8 <= w; x += 8)
+		{
+			__m256i a0 = _mm256_loadu_si256((const __m256i*)(row0 + x * 8));
+			__m256i b0 = _mm256_loadu_si256((const __m256i*)(row0 + x * 8 + 32));
+			__m256i a1 = _mm256_loadu_si256((const __m256i*)(row1 + x * 8));
+			__m256i b1 = _mm256_loadu_si256((const __m256i*)(row1 + x * 8 + 32));
+			__m256i s0 = _mm256_add_epi16(_mm256_unpacklo_epi8(a0, zero), _mm256_unpacklo_epi8(a1, zero));
+			__m256i s1 = _mm256_add_epi16(_mm256_unpackhi_epi8(a0, zero), _mm256_unpackhi_epi8(a1, zero));
+			__m256i s2 = _mm256_add_epi16(_mm256_unpacklo_epi8(b0, zero), _mm256_unpacklo_epi8(b1, zero));
+			__m256i s3 = _mm256_add_epi16(_mm256_unpackhi_epi8(b0, zero), _mm256_unpackhi_epi8(b1, zero));
+			__m256i qa = _mm256_add_epi16(_mm256_unpacklo_epi64(s0, s1), _mm256_unpackhi_epi64(s0, s1));
+			__m256i qb = _mm256_add_epi16(_mm256_unpacklo_epi64(s2, s3), _mm256_unpackhi_epi64(s2, s3));
+			qa = _mm256_srli_epi16(_mm256_add_epi16(qa, two), 2);
+			qb = _mm256_srli_epi16(_mm256_add_epi16(qb, two), 2);
+			__m256i packed = _mm256_packus_epi16(qa, qb);
+			_mm256_storeu_si256((__m256i*)(d + x * 4), _mm256_permute4x64_epi64(packed, 0xD8));
+		}
+		return x;
+	}
+#endif
+
+	// ---- float paths -------------------------------------------------------
+	// lookup tables, built once (thread safe, decoders call this concurrently)
+	static const int ENCODE_STEPS = 16384;
+	struct Tables
+	{
+		float decode[256];					// sRGB byte -> linear
+		float unorm[256];					// byte -> 0..1
+		unsigned char encode[ENCODE_STEPS + 1];	// linear in 1/ENCODE_STEPS steps -> sRGB byte
+		float kaiser[8];
+
+		Tables()
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				float v = i / 255.0f;
+				decode[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+				unorm[i] = v;
+			}
+			for (int i = 0; i <= ENCODE_STEPS; i++)
+			{
+				float v = (float)i / ENCODE_STEPS;
+				float s = v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+				encode[i] = (unsigned char)std::lround(std::min(std::max(s, 0.0f), 1.0f) * 255.0f);
+			}
+			// 8 taps at -3.5 .. 3.5 source texels from the output texel's
+			// centre: sinc for a 2x reduction under a Kaiser window (alpha 4)
+			const float alpha = 4.0f, pi = 3.14159265f;
+			float total = 0.0f;
+			for (int i = 0; i < 8; i++)
+			{
+				float d = i - 3.5f;
+				float x = d * 0.5f;
+				float r = d / 4.0f;
+				kaiser[i] = std::sin(pi * x) / (pi * x) * besselI0(alpha * std::sqrt(1.0f - r * r)) / besselI0(alpha);
+				total += kaiser[i];
+			}
+			for (int i = 0; i < 8; i++)
+				kaiser[i] /= total;
+		}
+		static float besselI0(float x)
+		{
+			float sum = 1.0f, term = 1.0f;
+			for (int k = 1; k < 20; k++)
+			{
+				term *= (x / (2.0f * k)) * (x / (2.0f * k));
+				sum += term;
+			}
+			return sum;
+		}
+	};
+	static const Tables& tables()
+	{
+		static const Tables t;
+		return t;
+	}
+	// 8 bit texels to RGBA float, colour channels linearised for sRGB (alpha,
+	// and the channels of 1/2 component images, are always linear)
+	// the level being filtered: 8 bit level 0 or a float RGBA level
+	struct Source
+	{
+		const unsigned char* bytes = NULL;
+		const float* floats = NULL;
+		int width = 0, height = 0, components = 4;
+		const float* table[4];		// byte -> float per channel, sRGB decode or plain
+
+		// row y as RGBA float, converted into temp if it has to be
+		const float* row(int y, float* temp) const
+		{
+			if (floats)
+				return floats + (size_t)y * width * 4;
+			const unsigned char* src = bytes + (size_t)y * width * components;
+			float* d = temp;
+			for (int x = 0; x < width; x++, src += components, d += 4)
+			{
+				d[1] = d[2] = d[3] = 0.0f;
+				for (int k = 0; k < components; k++)
+					d[k] = table[k][src[k]];
+			}
+			return temp;
+		}
+	};
+	static void fromFloat(const float* src, size_t count, int c, bool srgb, unsigned char* dst)
+	{
+		const unsigned char* encode = tables().encode;
+		bool encoded[4];
+		float scale[4];
+		for (int k = 0; k < 4; k++)
+		{
+			encoded[k] = srgb && c >= 3 && k < 3;
+			scale[k] = encoded[k] ? (float)ENCODE_STEPS : 255.0f;
+		}
+		for (size_t i = 0; i < count; i++, src += 4, dst += c)
+		{
+			int index[4];
+#ifdef HELLO_SSE2
+			__m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+			v = _mm_add_ps(_mm_mul_ps(v, _mm_loadu_ps(scale)), _mm_set1_ps(0.5f));
+			_mm_storeu_si128((__m128i*)index, _mm_cvttps_epi32(v));
+#else
+			for (int k = 0; k < 4; k++)
+				index[k] = (int)(std::min(std::max(src[k], 0.0f), 1.0f) * scale[k] + 0.5f);
+#endif
+			for (int k = 0; k < c; k++)
+				dst[k] = encoded[k] ? encode[index[k]] : (unsigned char)index[k];
+		}
+	}
+	static void boxFloat(const Source& src, float* dst, bool simd)
+	{
+		int width = src.width, height = src.height;
+		int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+		std::vector<float> temp0(src.floats ? 0 : (size_t)width * 4), temp1(temp0.size());
+		for (int y = 0; y < h; y++)
+		{
+			const float* row0 = src.row(std::min(y * 2, height - 1), temp0.data());
+			const float* row1 = src.row(std::min(y * 2 + 1, height - 1), temp1.data());
+			float* d = dst + (size_t)y * w * 4;
+			for (int x = 0; x < w; x++)
+			{
+				int x0 = std::min(x * 2, width - 1) * 4, x1 = std::min(x * 2 + 1, width - 1) * 4;
+#ifdef HELLO_SSE2
+				if (simd)
+				{
+					__m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+						_mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+					_mm_storeu_ps(d + x * 4, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+					continue;
+				}
+#endif
+				for (int k = 0; k < 4; k++)
+					d[x * 4 + k] = (row0[x0 + k] + row0[x1 + k] + row1[x0 + k] + row1[x1 + k]) * 0.25f;
+			}
+		}
+		(void)simd;
+	}
+	// horizontal pass for one row: w output texels from width source texels
+	static void kaiserRow(const float* src, int width, float* dst, int w, bool simd)
+	{
+		const float* weights = tables().kaiser;
+		for (int x = 0; x < w; x++)
+		{
+			int first = x * 2 - 3;
+			float sum[4] = { 0, 0, 0, 0 };
+#ifdef HELLO_SSE2
+			if (simd)
+			{
+				__m128 acc = _mm_setzero_ps();
+				for (int t = 0; t < 8; t++)
+				{
+					int j = std::min(std::max(first + t, 0), width - 1);
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + j * 4), _mm_set1_ps(weights[t])));
+				}
+				_mm_storeu_ps(dst + x * 4, acc);
+				continue;
+			}
+#endif
+			for (int t = 0; t < 8; t++)
+			{
+				int j = std::min(std::max(first + t, 0), width - 1);
+				for (int k = 0; k < 4; k++)
+					sum[k] += src[j * 4 + k] * weights[t];
+			}
+			memcpy(dst + x * 4, sum, sizeof(sum));
+		}
+	}
+	// separable: rows are filtered horizontally into a ring of the last 8, each
+	// output row is then a weighted sum of 8 ring rows, walked left to right so
+	// the vertical pass streams through memory instead of striding down columns
+	static void kaiser(const Source& src, float* dst, bool simd)
+	{
+		const float* weights = tables().kaiser;
+		int width = src.width, height = src.height;
+		int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+		std::vector<float> temp(src.floats ? 0 : (size_t)width * 4);
+		std::vector<float> ring((size_t)8 * w * 4);
+		int ringRow[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+		for (int y = 0; y < h; y++)
+		{
+			const float* taps[8];
+			for (int t = 0; t < 8; t++)
+			{
+				int j = std::min(std::max(y * 2 - 3 + t, 0), height - 1);
+				float* slot = &ring[(size_t)(j & 7) * w * 4];
+				if (ringRow[j & 7] != j)
+				{
+					kaiserRow(src.row(j, temp.data()), width, slot, w, simd);
+					ringRow[j & 7] = j;
+				}
+				taps[t] = slot;
+			}
+			float* d = dst + (size_t)y * w * 4;
+			size_t n = (size_t)w * 4, i = 0;
+#ifdef HELLO_SSE2
+			if (simd)
+			{
+				for (; i < n; i += 4)
+				{
+					__m128 acc = _mm_mul_ps(_mm_loadu_ps(taps[0] + i), _mm_set1_ps(weights[0]));
+					for (int t = 1; t < 8; t++)
+						acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(taps[t] + i), _mm_set1_ps(weights[t])));
+					_mm_storeu_ps(d + i, acc);
+				}
+			}
+#endif
+			for (; i < n; i++)
+			{
+				float sum = 0.0f;
+				for (int t = 0; t < 8; t++)
+					sum += taps[t][i] * weights[t];
+				d[i] = sum;
+			}
+		}
+	}
+};
+#endif
@@ -5,17 +5,47 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+
+// KHR_parallel_shader_compile isn't in our generated glad, the token is all we need
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
 
 class Shader
 {
 public:
 	unsigned int ID;
-	// constructor generates the shader on the fly
+	// true when the program came out of the binary cache instead of being compiled
+	bool fromCache = false;
+
+	// directory for linked program binaries, empty disables the cache. the
+	// directory must exist, it is shared by every Shader created afterwards.
 	// ------------------------------------------------------------------------
-	Shader(const char* vertexPath, const char* fragmentPath)
+	static std::string& binaryCacheDir()
+	{
+		static std::string dir;
+		return dir;
+	}
+	// set once the context is known to support KHR_parallel_shader_compile,
+	// then isReady() can ask GL_COMPLETION_STATUS_KHR without blocking
+	// ------------------------------------------------------------------------
+	static bool& completionStatusSupported()
+	{
+		static bool supported = false;
+		return supported;
+	}
+	// constructor generates the shader on the fly. defines (e.g. "#define FOG\n")
+	// are inserted right after the #version line of both stages.
+	// with blocking = false compile and link are only kicked off: poll isReady()
+	// and call finish() before using the program (ShaderLibrary does this).
+	// ------------------------------------------------------------------------
+	Shader(const char* vertexPath, const char* fragmentPath, const std::string& defines = "", bool blocking = true)
 	{
 		// 1. retrieve the vertex/fragment source code from filePath
 		std::string vertexCode;
@@ -45,32 +75,80 @@ public:
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 		}
+		if (!defines.empty())
+		{
+			vertexCode = insertDefines(vertexCode, defines);
+			fragmentCode = insertDefines(fragmentCode, defines);
+		}
+		// a program linked from exactly these sources on this driver before
+		// can be loaded as a binary, skipping compile and link entirely
+		if (!binaryCacheDir().empty())
+		{
+			cachePath = binaryCachePath(vertexCode, fragmentCode);
+			if (loadBinary(cachePath))
+			{
+				fromCache = true;
+				reflectUniforms();
+				return;
+			}
+		}
 		const char* vShaderCode = vertexCode.c_str();
 		const char * fShaderCode = fragmentCode.c_str();
-		// 2. compile shaders
-		unsigned int vertex, fragment;
-		int success;
-		char infoLog[512];
+		// 2. compile shaders. nothing here waits on the driver, the status
+		// checks all happen in finish()
 		// vertex shader
 		vertex = glCreateShader(GL_VERTEX_SHADER);
 		glShaderSource(vertex, 1, &vShaderCode, NULL);
 		glCompileShader(vertex);
-		checkCompileErrors(vertex, "VERTEX");
 		// fragment Shader
 		fragment = glCreateShader(GL_FRAGMENT_SHADER);
 		glShaderSource(fragment, 1, &fShaderCode, NULL);
 		glCompileShader(fragment);
-		checkCompileErrors(fragment, "FRAGMENT");
 		// shader Program
 		ID = glCreateProgram();
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
+		if (!cachePath.empty())
+			glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(ID);
-		checkCompileErrors(ID, "PROGRAM");
+		pending = true;
+		if (blocking)
+			finish();
+	}
+	// true once compile + link are done and finish() won't stall. without
+	// KHR_parallel_shader_compile we can't ask, so it always says yes.
+	// ------------------------------------------------------------------------
+	bool isReady() const
+	{
+		if (!pending || !completionStatusSupported())
+			return true;
+		GLint done = GL_FALSE;
+		glGetProgramiv(ID, GL_COMPLETION_STATUS_KHR, &done);
+		return done == GL_TRUE;
+	}
+	bool isPending() const
+	{
+		return pending;
+	}
+	// check errors, drop the shader objects, cache the binary and reflect the
+	// uniforms. returns whether the program linked.
+	// ------------------------------------------------------------------------
+	bool finish()
+	{
+		if (!pending)
+			return linked;
+		pending = false;
+		checkCompileErrors(vertex, "VERTEX");
+		checkCompileErrors(fragment, "FRAGMENT");
+		linked = checkCompileErrors(ID, "PROGRAM");
 		// delete the shaders as they're linked into our program now and no longer necessery
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
-
+		vertex = fragment = 0;
+		if (linked && !cachePath.empty())
+			storeBinary(cachePath);
+		reflectUniforms();
+		return linked;
 	}
 	// activate the shader
 	// ------------------------------------------------------------------------
@@ -78,69 +156,336 @@ public:
 	{
 		glUseProgram(ID);
 	}
-	// utility uniform functions
+	// uniform handles: look a name up once (e.g. before the render loop) and
+	// pass the handle to the setters below in hot code. a handle is the
+	// uniform's location, -1 for names that aren't active in the program,
+	// which glUniform* silently ignores just like a missing location.
+	// ------------------------------------------------------------------------
+	int uniformHandle(const std::string &name) const
+	{
+		if (uniformSlots.empty())
+			return -1;
+		unsigned int mask = (unsigned int)uniformSlots.size() - 1;
+		unsigned int hash = hashName(name.c_str());
+		for (unsigned int i = hash & mask; ; i = (i + 1) & mask)
+		{
+			const UniformSlot &slot = uniformSlots[i];
+			if (slot.location == EMPTY_SLOT)
+				return -1;
+			if (slot.hash == hash && slot.name == name)
+				return slot.location;
+		}
+	}
+	// utility uniform functions, by handle
+	// ------------------------------------------------------------------------
+	void setBool(int handle, bool value) const
+	{
+		glUniform1i(handle, (int)value);
+	}
+	void setInt(int handle, int value) const
+	{
+		glUniform1i(handle, value);
+	}
+	void setFloat(int handle, float value) const
+	{
+		glUniform1f(handle, value);
+	}
+	void setVec2(int handle, const glm::vec2 &value) const
+	{
+		glUniform2fv(handle, 1, &value[0]);
+	}
+	void setVec3(int handle, const glm::vec3 &value) const
+	{
+		glUniform3fv(handle, 1, &value[0]);
+	}
+	void setVec4(int handle, const glm::vec4 &value) const
+	{
+		glUniform4fv(handle, 1, &value[0]);
+	}
+	void setMat2(int handle, const glm::mat2 &mat) const
+	{
+		glUniformMatrix2fv(handle, 1, GL_FALSE, &mat[0][0]);
+	}
+	void setMat3(int handle, const glm::mat3 &mat) const
+	{
+		glUniformMatrix3fv(handle, 1, GL_FALSE, &mat[0][0]);
+	}
+	void setMat4(int handle, const glm::mat4 &mat) const
+	{
+		glUniformMatrix4fv(handle, 1, GL_FALSE, &mat[0][0]);
+	}
+	// utility uniform functions, by name (resolved through the cached table,
+	// no driver query)
 	// ------------------------------------------------------------------------
 	void setBool(const std::string &name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		glUniform1i(uniformHandle(name), (int)value);
 	}
 	// ------------------------------------------------------------------------
 	void setInt(const std::string &name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1i(uniformHandle(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setFloat(const std::string &name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1f(uniformHandle(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setVec2(const std::string &name, const glm::vec2 &value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(uniformHandle(name), 1, &value[0]);
 	}
 	void setVec2(const std::string &name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(uniformHandle(name), x, y);
 	}
 	// ------------------------------------------------------------------------
 	void setVec3(const std::string &name, const glm::vec3 &value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(uniformHandle(name), 1, &value[0]);
 	}
 	void setVec3(const std::string &name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(uniformHandle(name), x, y, z);
 	}
 	// ------------------------------------------------------------------------
 	void setVec4(const std::string &name, const glm::vec4 &value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(uniformHandle(name), 1, &value[0]);
 	}
 	void setVec4(const std::string &name, float x, float y, float z, float w) const
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(uniformHandle(name), x, y, z, w);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string &name, const glm::mat2 &mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(uniformHandle(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string &name, const glm::mat3 &mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(uniformHandle(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat4(const std::string &name, const glm::mat4 &mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix4fv(uniformHandle(name), 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	// state carried from the constructor to finish()
+	unsigned int vertex = 0, fragment = 0;
+	bool pending = false;
+	bool linked = true;
+	std::string cachePath;
+
+	// open addressing table of active uniforms, filled once after linking
+	static const int EMPTY_SLOT = -2;
+	struct UniformSlot
+	{
+		unsigned int hash = 0;
+		int location = EMPTY_SLOT;
+		std::string name;
+	};
+	std::vector<UniformSlot> uniformSlots;
+
+	// FNV-1a, names are short so this is cheaper than std::hash and stable
+	static unsigned int hashName(const char* name)
+	{
+		unsigned int hash = 2166136261u;
+		for (; *name; name++)
+		{
+			hash ^= (unsigned char)*name;
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+	void insertUniform(const std::string &name, int location)
+	{
+		unsigned int mask = (unsigned int)uniformSlots.size() - 1;
+		unsigned int hash = hashName(name.c_str());
+		unsigned int i = hash & mask;
+		while (uniformSlots[i].location != EMPTY_SLOT)
+		{
+			if (uniformSlots[i].hash == hash && uniformSlots[i].name == name)
+				return;
+			i = (i + 1) & mask;
+		}
+		uniformSlots[i].hash = hash;
+		uniformSlots[i].location = location;
+		uniformSlots[i].name = name;
+	}
+	// ask the driver for every active uniform once. arrays are registered as
+	// "name" and every "name[i]" (GL only reports "name[0]"), each element
+	// with its own location, so "lights[2]" or "arr[1].pos[3]" still resolve.
+	// ------------------------------------------------------------------------
+	void reflectUniforms()
+	{
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+		struct Active
+		{
+			std::string name;
+			GLint size;
+		};
+		std::vector<Active> active;
+		std::vector<GLchar> nameBuffer(maxLength > 0 ? maxLength : 1);
+		unsigned int entries = 0;
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(ID, (GLuint)i, (GLsizei)nameBuffer.size(), &length, &size, &type, nameBuffer.data());
+			active.push_back({ std::string(nameBuffer.data(), length), size });
+			entries += size > 1 ? size + 1 : 2;
+		}
+		// load factor under 1/2
+		unsigned int capacity = 8;
+		while (capacity < entries * 2)
+			capacity *= 2;
+		uniformSlots.assign(capacity, UniformSlot());
+
+		for (const Active &uniform : active)
+		{
+			GLint location = glGetUniformLocation(ID, uniform.name.c_str());
+			// uniforms inside blocks have no location, they are set through buffers
+			if (location < 0)
+				continue;
+			insertUniform(uniform.name, location);
+			if (uniform.name.size() <= 3 || uniform.name.compare(uniform.name.size() - 3, 3, "[0]") != 0)
+				continue;
+			std::string base = uniform.name.substr(0, uniform.name.size() - 3);
+			insertUniform(base, location);
+			// elements of an array aren't guaranteed to have consecutive locations
+			for (GLint element = 1; element < uniform.size; element++)
+			{
+				std::string name = base + "[" + std::to_string(element) + "]";
+				GLint elementLocation = glGetUniformLocation(ID, name.c_str());
+				if (elementLocation >= 0)
+					insertUniform(name, elementLocation);
+			}
+		}
+	}
+
+	// program binary cache file: magic, format, size, then the driver's blob.
+	// the file name already encodes sources + driver, so stale entries simply
+	// stop being looked up after a driver update or shader edit.
+	struct BinaryHeader
+	{
+		char magic[4];
+		GLenum format;
+		GLint length;
+	};
+
+	static std::string insertDefines(const std::string& code, const std::string& defines)
+	{
+		size_t version = code.find("#version");
+		if (version == std::string::npos)
+			return defines + code;
+		size_t lineEnd = code.find('\n', version);
+		if (lineEnd == std::string::npos)
+			return code + "\n" + defines;
+		return code.substr(0, lineEnd + 1) + defines + code.substr(lineEnd + 1);
+	}
+	// FNV-1a over both sources and the GL_VENDOR/GL_RENDERER/GL_VERSION strings,
+	// binaries are only valid for the exact driver that produced them
+	// ------------------------------------------------------------------------
+	static std::string binaryCachePath(const std::string& vertexCode, const std::string& fragmentCode)
+	{
+		unsigned long long hash = 14695981039346656037ull;
+		auto mix = [&hash](const char* data, size_t length)
+		{
+			for (size_t i = 0; i < length; i++)
+			{
+				hash ^= (unsigned char)data[i];
+				hash *= 1099511628211ull;
+			}
+			// separator, so "ab"+"c" and "a"+"bc" hash differently
+			hash ^= 0xff;
+			hash *= 1099511628211ull;
+		};
+		mix(vertexCode.data(), vertexCode.size());
+		mix(fragmentCode.data(), fragmentCode.size());
+		const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (GLenum name : driverStrings)
+		{
+			const char* value = (const char*)glGetString(name);
+			if (value)
+				mix(value, strlen(value));
+		}
+		char file[32];
+		snprintf(file, sizeof(file), "%016llx.bin", hash);
+		return binaryCacheDir() + "/" + file;
+	}
+	// returns false (and leaves no program behind) when there's no usable entry
+	// or the driver rejects the binary, the caller then compiles from source
+	// ------------------------------------------------------------------------
+	bool loadBinary(const std::string& path)
+	{
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		if (formats <= 0)
+			return false;
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return false;
+		BinaryHeader header;
+		if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "HTPB", 4) != 0 || header.length <= 0)
+			return false;
+		std::vector<char> binary(header.length);
+		if (!file.read(binary.data(), header.length))
+			return false;
+
+		ID = glCreateProgram();
+		glProgramBinary(ID, header.format, binary.data(), header.length);
+		GLint success = 0;
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			// driver changed in a way the key didn't catch, or a corrupt file
+			std::cout << "shader cache: driver rejected " << path << ", recompiling" << std::endl;
+			glDeleteProgram(ID);
+			ID = 0;
+			return false;
+		}
+		return true;
+	}
+	// write to a temporary name first so a crash never leaves half a binary
+	// ------------------------------------------------------------------------
+	void storeBinary(const std::string& path) const
+	{
+		GLint length = 0;
+		glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		BinaryHeader header;
+		memcpy(header.magic, "HTPB", 4);
+		header.length = length;
+		std::vector<char> binary(length);
+		glGetProgramBinary(ID, length, NULL, &header.format, binary.data());
+
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+			if (!file)
+				return;
+			file.write((const char*)&header, sizeof(header));
+			file.write(binary.data(), length);
+			if (!file)
+				return;
+		}
+		std::remove(path.c_str());
+		std::rename(temporary.c_str(), path.c_str());
+	}
+
 	// utility function for checking shader compilation/linking errors.
 	// ------------------------------------------------------------------------
-	void checkCompileErrors(GLuint shader, std::string type)
+	bool checkCompileErrors(GLuint shader, std::string type)
 	{
 		GLint success;
 		GLchar infoLog[1024];
@@ -162,6 +507,7 @@ private:
 				std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
+		return success != 0;
 	}
 };
 #endif
\ No newline at end of file
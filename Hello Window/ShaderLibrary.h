@@ -0,0 +1,154 @@
+#ifndef SHADER_LIBRARY_H
+#define SHADER_LIBRARY_H
+
+#include <glad/glad.h>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Shader.h"
+
+// Compiles many programs without serializing startup on each of them.
+// submit() only kicks off compile + link; with KHR_parallel_shader_compile the
+// driver builds them on its own threads and poll() picks up the finished ones
+// through GL_COMPLETION_STATUS_KHR without blocking. Until a program is ready,
+// and for good if it fails to link, get() hands out the fallback program so
+// the render loop keeps drawing.
+class ShaderLibrary
+{
+public:
+	// load is the same proc loader glad was initialised with (the extension's
+	// entry point isn't part of our glad)
+	// ------------------------------------------------------------------------
+	explicit ShaderLibrary(GLADloadproc load, unsigned int compilerThreads = 0xFFFFFFFFu)
+	{
+		parallel = hasExtension("GL_KHR_parallel_shader_compile") || hasExtension("GL_ARB_parallel_shader_compile");
+		if (parallel)
+		{
+			typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+			PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxThreads =
+				(PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsKHR");
+			if (!maxThreads)
+				maxThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsARB");
+			// 0xFFFFFFFF lets the driver pick, 0 would turn the threads off again
+			if (maxThreads)
+				maxThreads(compilerThreads);
+		}
+		Shader::completionStatusSupported() = parallel;
+	}
+	~ShaderLibrary()
+	{
+		for (std::unique_ptr<Shader>& program : programs)
+			glDeleteProgram(program->ID);
+		if (fallback)
+			glDeleteProgram(fallback->ID);
+	}
+	ShaderLibrary(const ShaderLibrary&) = delete;
+	ShaderLibrary& operator=(const ShaderLibrary&) = delete;
+	// returns a handle for get(). the program isn't usable until poll() has
+	// seen it finish, get() returns the fallback until then.
+	// ------------------------------------------------------------------------
+	int submit(const char* vertexPath, const char* fragmentPath, const std::string& defines = "")
+	{
+		programs.emplace_back(new Shader(vertexPath, fragmentPath, defines, false));
+		failed.push_back(false);
+		return (int)programs.size() - 1;
+	}
+	// the fallback is built blocking, it has to be usable right away
+	// ------------------------------------------------------------------------
+	void setFallback(const char* vertexPath, const char* fragmentPath)
+	{
+		fallback.reset(new Shader(vertexPath, fragmentPath));
+	}
+	// finish whatever is done compiling. without the extension there is no way
+	// to ask, so at most budget programs are finished (blocking) per call,
+	// which spreads the stalls over several frames. returns the number of
+	// programs still pending.
+	// ------------------------------------------------------------------------
+	int poll(int budget = 1)
+	{
+		int stillPending = 0;
+		for (size_t handle = 0; handle < programs.size(); handle++)
+		{
+			if (!programs[handle]->isPending())
+				continue;
+			if (parallel ? programs[handle]->isReady() : budget-- > 0)
+				finish((int)handle);
+			else
+				stillPending++;
+		}
+		return stillPending;
+	}
+	// block until everything submitted is linked
+	// ------------------------------------------------------------------------
+	void finishAll()
+	{
+		for (size_t handle = 0; handle < programs.size(); handle++)
+			finish((int)handle);
+	}
+	bool isReady(int handle) const
+	{
+		return !programs[handle]->isPending();
+	}
+	// finished but didn't link
+	bool linkFailed(int handle) const
+	{
+		return failed[handle];
+	}
+	// the program if it's ready and linked, otherwise the fallback
+	// ------------------------------------------------------------------------
+	Shader& get(int handle)
+	{
+		Shader& program = *programs[handle];
+		if (program.isPending() && !fallback)
+			finish(handle);
+		if ((program.isPending() || failed[handle]) && fallback)
+			return *fallback;
+		return program;
+	}
+	bool parallelCompile() const
+	{
+		return parallel;
+	}
+	size_t size() const
+	{
+		return programs.size();
+	}
+
+private:
+	std::vector<std::unique_ptr<Shader>> programs;
+	std::vector<bool> failed;	// per handle, the link failed
+	std::unique_ptr<Shader> fallback;
+	bool parallel = false;
+
+	// finish a pending program and remember whether it linked, the log says so
+	// once (Shader itself already printed the driver's info log)
+	void finish(int handle)
+	{
+		if (!programs[handle]->isPending())
+			return;
+		if (!programs[handle]->finish())
+		{
+			failed[handle] = true;
+			std::cout << "ERROR::SHADER_LIBRARY::LINK_FAILED program " << handle
+				<< (fallback ? ", drawing with the fallback instead" : ", there is no fallback") << std::endl;
+		}
+	}
+
+	static bool hasExtension(const char* name)
+	{
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+			if (extension && strcmp(extension, name) == 0)
+				return true;
+		}
+		return false;
+	}
+};
+#endif
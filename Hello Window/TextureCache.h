@@ -0,0 +1,276 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TextureStreamer.h"
+
+// Hands out shared textures on top of a TextureStreamer. Lookups go by
+// canonical path, file size and modification time plus the sampling settings,
+// which takes a stat and no reading, so two relative spellings of one path
+// share a texture and an edited file or different sampling gets its own. The
+// same image under two names is caught on the decode worker, which hashes the
+// file once it has read it (TextureStreamer's dedupe): update() then folds the
+// second entry into the first. Handles are reference counted; textures nobody
+// references stay resident until the total goes over the budget, then the
+// least recently used of them are deleted first.
+class TextureCache
+{
+public:
+	// reference to a cached texture, copies share it. the texture may still be
+	// streaming in, get() returns the placeholder until it's there.
+	class Handle
+	{
+	public:
+		Handle() {}
+		Handle(const Handle& other) : cache(other.cache), entry(other.entry)
+		{
+			if (cache)
+				cache->target(entry).references++;
+		}
+		Handle& operator=(const Handle& other)
+		{
+			if (this != &other)
+			{
+				reset();
+				cache = other.cache;
+				entry = other.entry;
+				if (cache)
+					cache->target(entry).references++;
+			}
+			return *this;
+		}
+		~Handle()
+		{
+			reset();
+		}
+		void reset()
+		{
+			if (cache)
+				cache->target(entry).references--;
+			cache = NULL;
+		}
+		// the GL texture name, also marks the texture as recently used
+		GLuint get() const
+		{
+			return cache ? cache->use(entry) : 0;
+		}
+		bool valid() const
+		{
+			return cache != NULL;
+		}
+
+	private:
+		friend class TextureCache;
+		TextureCache* cache = NULL;
+		int entry = -1;
+
+		Handle(TextureCache* cache, int entry) : cache(cache), entry(entry)
+		{
+			cache->target(entry).references++;
+		}
+	};
+
+	// budgetBytes is the video memory the cache may keep resident
+	// ------------------------------------------------------------------------
+	TextureCache(TextureStreamer& streamer, size_t budgetBytes) : streamer(streamer), budget(budgetBytes)
+	{
+	}
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	// the sampling is part of what is shared: minFilter also decides whether
+	// the texture gets a mip chain
+	// ------------------------------------------------------------------------
+	Handle acquire(const std::string& path, GLint wrap = GL_REPEAT, GLint minFilter = GL_LINEAR, GLint magFilter = GL_LINEAR,
+		bool srgb = false)
+	{
+		std::error_code ec;
+		std::string canonical = std::filesystem::weakly_canonical(path, ec).string();
+		if (ec)
+			canonical = path;
+		uintmax_t size = std::filesystem::file_size(canonical, ec);
+		std::filesystem::file_time_type modified;
+		if (!ec)
+			modified = std::filesystem::last_write_time(canonical, ec);
+		if (ec)
+		{
+			std::cout << "ERROR::texture not found " << path << std::endl;
+			misses++;
+			return Handle();
+		}
+		std::string key = canonical + "|" + std::to_string(size) + "|" + std::to_string(modified.time_since_epoch().count()) + "|" +
+			std::to_string(wrap) + "|" + std::to_string(minFilter) + "|" + std::to_string(magFilter) + "|" + std::to_string(srgb);
+
+		std::unordered_map<std::string, int>::iterator byKeyIt = byKey.find(key);
+		if (byKeyIt != byKey.end() && target(byKeyIt->second).resident())
+		{
+			hits++;
+			return Handle(this, byKeyIt->second);
+		}
+
+		misses++;
+		int index;
+		if (byKeyIt != byKey.end())
+			index = resolve(byKeyIt->second);	// evicted earlier, reuse the slot
+		else
+		{
+			index = (int)entries.size();
+			entries.push_back(Entry());
+			Entry& e = entries[index];
+			e.path = canonical;
+			e.wrap = wrap;
+			e.minFilter = minFilter;
+			e.magFilter = magFilter;
+			e.srgb = srgb;
+			byKey[key] = index;
+		}
+		Entry& e = entries[index];
+		e.streamHandle = streamer.request(e.path, e.wrap, e.minFilter, e.magFilter, e.srgb, true);
+		e.bytes = 0;
+		e.lru = lru.insert(lru.end(), index);
+		return Handle(this, index);
+	}
+	// GL thread, once per frame: upload what finished decoding, fold entries
+	// whose file turned out to hold an image that is already loaded into that
+	// one, then evict unreferenced textures until the cache is back under its
+	// budget
+	// ------------------------------------------------------------------------
+	void update(size_t maxUploadBytes = 8u << 20)
+	{
+		streamer.update(maxUploadBytes);
+		for (int index = 0; index < (int)entries.size(); index++)
+		{
+			// entries with bytes have a texture of their own already
+			Entry& e = entries[index];
+			if (e.alias >= 0 || !e.resident() || e.bytes > 0)
+				continue;
+			int original = streamer.duplicateOf(e.streamHandle);
+			if (original < 0)
+				continue;
+			// the original is still live, it is only released by eviction below
+			for (int other = 0; other < (int)entries.size(); other++)
+			{
+				Entry& o = entries[other];
+				if (other == index || o.alias >= 0 || o.streamHandle != original)
+					continue;
+				streamer.release(e.streamHandle);
+				e.streamHandle = -1;
+				e.alias = other;
+				o.references += e.references;
+				e.references = 0;
+				lru.erase(e.lru);
+				// it was the same image after all
+				misses--;
+				hits++;
+				break;
+			}
+		}
+
+		resident = 0;
+		for (Entry& e : entries)
+		{
+			if (!e.resident())
+				continue;
+			if (e.bytes == 0)
+				e.bytes = streamer.residentBytes(e.streamHandle);
+			resident += e.bytes;
+		}
+		// oldest first, skipping anything still referenced
+		std::list<int>::iterator it = lru.begin();
+		while (resident > budget && it != lru.end())
+		{
+			Entry& e = entries[*it];
+			if (e.references > 0)
+			{
+				++it;
+				continue;
+			}
+			streamer.release(e.streamHandle);
+			resident -= e.bytes;
+			e.streamHandle = -1;
+			e.bytes = 0;
+			evictions++;
+			it = lru.erase(it);
+		}
+	}
+
+	double hitRate() const
+	{
+		return hits + misses ? (double)hits / (hits + misses) : 0.0;
+	}
+	size_t residentBytes() const
+	{
+		return resident;
+	}
+	size_t budgetBytes() const
+	{
+		return budget;
+	}
+	int hitCount() const
+	{
+		return hits;
+	}
+	int missCount() const
+	{
+		return misses;
+	}
+	int evictionCount() const
+	{
+		return evictions;
+	}
+
+private:
+	struct Entry
+	{
+		std::string path;			// canonical
+		GLint wrap = GL_REPEAT, minFilter = GL_LINEAR, magFilter = GL_LINEAR;
+		bool srgb = false;
+		int streamHandle = -1;		// -1 once evicted
+		int references = 0;
+		size_t bytes = 0;			// known once uploaded
+		int alias = -1;				// folded into this entry for good, which holds the references
+		std::list<int>::iterator lru;
+
+		bool resident() const
+		{
+			return streamHandle >= 0;
+		}
+	};
+
+	TextureStreamer& streamer;
+	size_t budget;
+	size_t resident = 0;
+	std::vector<Entry> entries;
+	std::list<int> lru;				// front is the least recently used
+	std::unordered_map<std::string, int> byKey;	// path, size, mtime and sampling
+	int hits = 0, misses = 0, evictions = 0;
+
+	int resolve(int index) const
+	{
+		while (entries[index].alias >= 0)
+			index = entries[index].alias;
+		return index;
+	}
+	Entry& target(int index)
+	{
+		return entries[resolve(index)];
+	}
+	GLuint use(int index)
+	{
+		Entry& e = target(index);
+		if (!e.resident())
+			return 0;
+		lru.splice(lru.end(), lru, e.lru);
+		return streamer.get(e.streamHandle);
+	}
+};
+#endif
@@ -0,0 +1,856 @@
+#ifndef TEXTURE_STREAMER_H
+#define TEXTURE_STREAMER_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Ktx2.h"
+#include "MipChain.h"
+#include "ThreadPool.h"
+#include "stb_image.h"
+
+// Loads textures without stalling the render thread. A request is decoded by
+// stb_image on a worker thread, from a read-only mapping of the file straight
+// into a slot of a persistently mapped pixel unpack buffer (stbi_load_into),
+// so there is no intermediate copy of the image. update() on the GL thread
+// then creates the texture and issues glTexSubImage2D from that slot, fencing
+// it so the slot is only handed out again once the GPU has consumed the copy.
+// Contexts without GL 4.4, and images bigger than a slot, upload from client
+// memory instead.
+// Textures get immutable storage (glTexStorage2D) in a sized format picked from
+// the image's channel count, with a mip chain only when the min filter samples
+// one. RGB images are decoded as RGBA, so the driver gets 4 byte texels and
+// aligned rows instead of repacking them itself.
+// Mip chains are built on the decode thread (MipChain) and staged behind the
+// top level, so the GL thread only copies levels; setMipmaps(false, ...) goes
+// back to glGenerateMipmap for comparison.
+// Baseline JPEGs decode on several of the pool's threads at once (entropy
+// decoding, IDCT and color conversion pipelined over MCU rows, or whole
+// restart intervals in parallel), so one big image alone isn't stuck on one.
+// Big JPEGs are decoded at 1/8 size first (scale_log2 3, a DC-only IDCT
+// for most blocks) and that preview goes up on its own, so get() has the
+// image's colours to show long before the full decode is done.
+// Every decode passes its own stbi_load_options, the pool to split it over
+// included, so the workers never touch stb_image's process-wide settings and
+// each failure keeps its own reason.
+// Each worker keeps an stbi_arena for the decoder's scratch memory (JPEG
+// planes, PNG inflate buffers), reset between requests, so a stream of
+// textures stops going to malloc for it once the first few are in.
+// Cooked .ktx2 files (tools/TextureCooker) skip stb_image: their prebuilt,
+// block compressed levels are staged as they are and uploaded with
+// glCompressedTexSubImage2D.
+// Requests made with dedupe are read into memory on the worker and hashed
+// there before decoding; one that turns out to be the same image with the same
+// settings as a request still loaded isn't decoded again (duplicateOf()).
+class TextureStreamer
+{
+public:
+	// slots * slotBytes of staging memory, 4 x 16MB fits four 2048^2 RGBA images
+	// ------------------------------------------------------------------------
+	explicit TextureStreamer(unsigned int decodeThreads = 2, int slots = 4, size_t slotBytes = 16u << 20)
+		: slotBytes(slotBytes)
+	{
+		slotFences.assign(slots, (GLsync)0);
+		slotFree.assign(slots, true);
+		if (GLAD_GL_VERSION_4_4 && glBufferStorage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glGenBuffers(1, &stagingBuffer);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, slots * slotBytes, NULL, flags);
+			staging = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slots * slotBytes, flags);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (!staging)
+			{
+				glDeleteBuffers(1, &stagingBuffer);
+				stagingBuffer = 0;
+			}
+		}
+		// what get() hands out while a texture is still on its way
+		unsigned char grey[4] = { 128, 128, 128, 255 };
+		glGenTextures(1, &placeholder);
+		glBindTexture(GL_TEXTURE_2D, placeholder);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		pool.reset(new ThreadPool(decodeThreads));
+	}
+	~TextureStreamer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		slotReleased.notify_all();
+		// joins the decoders, jobs that haven't started yet see stopping and bail
+		pool.reset();
+		for (std::unique_ptr<Request>& request : requests)
+		{
+			if (request->texture)
+				glDeleteTextures(1, &request->texture);
+			if (request->preview)
+				glDeleteTextures(1, &request->preview);
+			free(request->pixels);
+			stbi_image_free(request->previewPixels);
+		}
+		for (GLsync fence : slotFences)
+			if (fence)
+				glDeleteSync(fence);
+		if (stagingBuffer)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &stagingBuffer);
+		}
+		glDeleteTextures(1, &placeholder);
+	}
+	TextureStreamer(const TextureStreamer&) = delete;
+	TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+	// queue path for loading, returns a handle for get(). wrap and filter
+	// settings are applied once the texture exists, srgb picks the SRGB8 /
+	// SRGB8_ALPHA8 formats for colour data that was authored in sRGB.
+	// with dedupe the file's contents are hashed on the worker, and if another
+	// dedupe request with the same contents and settings is loaded or still
+	// loading this one borrows its texture instead of decoding the file again.
+	// ------------------------------------------------------------------------
+	int request(const std::string& path, GLint wrap = GL_REPEAT, GLint minFilter = GL_LINEAR, GLint magFilter = GL_LINEAR, bool srgb = false,
+		bool dedupe = false)
+	{
+		Request* r = new Request();
+		r->path = path;
+		r->wrap = wrap;
+		r->minFilter = minFilter;
+		r->magFilter = magFilter;
+		r->srgb = srgb;
+		r->dedupe = dedupe;
+		int handle;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			handle = (int)requests.size();
+			r->handle = handle;
+			requests.emplace_back(r);
+			pending++;
+		}
+		pool->submit([this, r] { decode(r); });
+		return handle;
+	}
+	// GL thread, once per frame: recycle staging slots the GPU is done with and
+	// upload decoded textures, at most maxBytes worth so a burst of finished
+	// decodes is spread over several frames. returns the number uploaded.
+	// ------------------------------------------------------------------------
+	int update(size_t maxBytes = 8u << 20)
+	{
+		recycleSlots();
+		int uploaded = 0;
+		size_t bytes = 0;
+		// previews are small and are what's on screen until the rest arrives
+		for (;;)
+		{
+			Request* r;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (previews.empty())
+					break;
+				r = previews.front();
+				previews.erase(previews.begin());
+			}
+			bytes += (size_t)r->previewWidth * r->previewHeight * r->components;
+			uploadPreview(r);
+		}
+		while (bytes < maxBytes)
+		{
+			Request* r;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (decoded.empty())
+					break;
+				r = decoded.front();
+				decoded.erase(decoded.begin());
+			}
+			if (r->state == Request::DUPLICATE || r->state == Request::RELEASED)
+			{
+				// a duplicate (maybe released already) has nothing of its own to upload
+			}
+			else if (r->state == Request::FAILED)
+			{
+				std::cout << "ERROR::failed to load texture " << r->path;
+				if (r->failure)
+					std::cout << ": " << r->failure;
+				std::cout << std::endl;
+				if (r->preview)
+				{
+					glDeleteTextures(1, &r->preview);
+					std::lock_guard<std::mutex> lock(mutex);
+					r->preview = 0;
+				}
+			}
+			else
+			{
+				bytes += r->bytes;
+				upload(r);
+				uploaded++;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			pending--;
+		}
+		uploadedBytes += bytes;
+		return uploaded;
+	}
+	// block (still on the GL thread) until every request so far is uploaded
+	// ------------------------------------------------------------------------
+	void finishAll()
+	{
+		while (pendingCount() > 0)
+		{
+			if (update((size_t)-1) == 0)
+				std::this_thread::yield();
+		}
+	}
+	// the texture if it's uploaded, otherwise its preview if that is, otherwise
+	// a 1x1 grey placeholder. a duplicate gives the texture it borrows.
+	// ------------------------------------------------------------------------
+	GLuint get(int handle) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const Request& r = resolve(handle);
+		if (r.state == Request::READY)
+			return r.texture;
+		return r.preview ? r.preview : placeholder;
+	}
+	bool isReady(int handle) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return resolve(handle).state == Request::READY;
+	}
+	// the request whose texture this dedupe request borrows, -1 if it has its
+	// own (or its file hasn't been read yet). the borrowed texture goes away
+	// when that request is released.
+	// ------------------------------------------------------------------------
+	int duplicateOf(int handle) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return requests[handle]->duplicateOf;
+	}
+	// video memory of an uploaded texture including its mip chain, 0 before
+	// ------------------------------------------------------------------------
+	size_t residentBytes(int handle) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const Request& r = *requests[handle];
+		return r.state == Request::READY ? r.gpuBytes : 0;
+	}
+	// delete the texture, get() returns the placeholder afterwards. a request
+	// that is still in flight is deleted as soon as it has been uploaded.
+	// ------------------------------------------------------------------------
+	void release(int handle)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Request& r = *requests[handle];
+		forgetContents(r);
+		if (r.state == Request::DUPLICATE)
+			r.state = Request::RELEASED;
+		else if (r.state == Request::READY)
+		{
+			glDeleteTextures(1, &r.texture);
+			r.texture = 0;
+			r.state = Request::RELEASED;
+		}
+		else
+			r.releaseOnUpload = true;
+		if (r.preview)
+		{
+			glDeleteTextures(1, &r.preview);
+			r.preview = 0;
+		}
+	}
+	int pendingCount() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return pending;
+	}
+	size_t bytesUploaded() const
+	{
+		return uploadedBytes;
+	}
+	bool persistentStaging() const
+	{
+		return staging != NULL;
+	}
+	// where mip chains of decoded images come from: built on the decode thread
+	// with filter, or by glGenerateMipmap after the upload. set it before
+	// making requests.
+	// ------------------------------------------------------------------------
+	void setMipmaps(bool onCpu, MipChain::Filter filter = MipChain::BOX)
+	{
+		cpuMips = onCpu;
+		mipFilter = filter;
+	}
+	// JPEGs at least minSize pixels on a side get a 1/8 size preview first,
+	// 0 turns previews off. set it before making requests.
+	// ------------------------------------------------------------------------
+	void setPreviews(int minSize)
+	{
+		previewMinSize = minSize;
+	}
+	// images are flipped bottom-up by default, the way glTexSubImage2D wants
+	// rows. set it before making requests.
+	// ------------------------------------------------------------------------
+	void setFlip(bool flipVertically)
+	{
+		flip = flipVertically;
+	}
+
+private:
+	struct Request
+	{
+		enum State { DECODING, STAGED, DECODED, FAILED, READY, RELEASED, DUPLICATE };
+		std::string path;
+		GLint wrap, minFilter, magFilter;
+		bool srgb = false;
+		int handle = -1;
+		State state = DECODING;
+		bool dedupe = false;
+		uint64_t contentKey = 0;	// hash of the file and the settings, once read
+		bool keyed = false;			// in byContent under contentKey
+		int duplicateOf = -1;
+		int width = 0, height = 0, channels = 0;
+		int components = 0;		// per texel in the staged data, 3 channel images are widened to 4
+		size_t bytes = 0;		// staged data
+		size_t gpuBytes = 0;	// storage of all levels
+		GLenum compressedFormat = 0;	// set for .ktx2 files, staged data is then the levels back to back
+		std::vector<size_t> levelBytes;
+		int stagedLevels = 1;	// uncompressed images: levels in the staged data, more than 1 when built on the CPU
+		unsigned char* pixels = NULL;	// client copy (malloc) when it didn't go through a slot
+		int slot = -1;
+		GLuint texture = 0;
+		bool releaseOnUpload = false;
+		// 1/8 size decode, components per texel like the full one
+		int previewWidth = 0, previewHeight = 0;
+		unsigned char* previewPixels = NULL;
+		GLuint preview = 0;
+		const char* failure = NULL;		// stb_image's reason, when it was stb_image that failed
+	};
+
+	std::unique_ptr<ThreadPool> pool;
+	std::vector<std::unique_ptr<Request>> requests;
+	std::vector<Request*> decoded;		// waiting for update(), in decode order
+	std::vector<Request*> previews;		// same, for previews
+	std::unordered_map<uint64_t, int> byContent;	// live dedupe requests by contentKey
+	mutable std::mutex mutex;
+	std::condition_variable slotReleased;
+	int pending = 0;
+	bool stopping = false;
+
+	GLuint stagingBuffer = 0;
+	unsigned char* staging = NULL;
+	size_t slotBytes;
+	std::vector<GLsync> slotFences;		// GL thread only
+	std::vector<bool> slotFree;			// guarded by mutex
+	GLuint placeholder = 0;
+	size_t uploadedBytes = 0;
+	bool cpuMips = true;
+	MipChain::Filter mipFilter = MipChain::BOX;
+	int previewMinSize = 1024;
+	bool flip = true;
+
+	// worker thread
+	void decode(Request* r)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				return;
+		}
+		// sized by the previous request, nothing of it is in use between them
+		stbi_arena_reset(&scratchArena());
+		if (r->path.size() > 5 && r->path.compare(r->path.size() - 5, 5, ".ktx2") == 0)
+		{
+			decodeKtx2(r);
+			return;
+		}
+		// dedupe requests decode from the bytes they were hashed from, the
+		// others straight from the file
+		const std::vector<unsigned char>* bytes = NULL;
+		if (r->dedupe)
+		{
+			std::vector<unsigned char>& buffer = fileBuffer();
+			if (!readFile(r->path, buffer))
+			{
+				finishDecode(r, Request::FAILED);
+				return;
+			}
+			if (isDuplicate(r, buffer.data(), buffer.size()))
+				return;
+			bytes = &buffer;
+		}
+		// the header first, so stb_image can decode into memory we picked
+		stbi_load_options options = decodeOptions(0);
+		int known = bytes ? stbi_info_from_memory(bytes->data(), (int)bytes->size(), &r->width, &r->height, &r->channels)
+			: stbi_info_ex(r->path.c_str(), &r->width, &r->height, &r->channels, &options);
+		if (!known)
+		{
+			r->failure = bytes ? stbi_failure_reason() : options.failure_reason;
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		r->components = r->channels == 3 ? 4 : r->channels;
+		size_t topBytes = (size_t)r->width * r->height * r->components;
+		if (topBytes > INT_MAX)
+		{
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		if (previewMinSize > 0 && std::max(r->width, r->height) >= previewMinSize)
+			decodePreview(r, bytes);
+		if (!cpuMips || !usesMipmaps(r->minFilter))
+		{
+			r->bytes = topBytes;
+			stage(r, [&](unsigned char* destination)
+			{
+				return decodeInto(r, bytes, destination);
+			});
+			return;
+		}
+		// the chain is built in local memory, staging memory can be uncached
+		// and slow to read back from. level 0 is decoded right in front of it.
+		r->stagedLevels = MipChain::levelCount(r->width, r->height);
+		std::vector<unsigned char> levels(topBytes + MipChain::chainBytes(r->width, r->height, r->components, r->stagedLevels));
+		if (!decodeInto(r, bytes, levels.data()))
+		{
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		MipChain::build(levels.data(), r->width, r->height, r->components, r->stagedLevels, r->srgb, mipFilter,
+			levels.data() + topBytes);
+		r->bytes = levels.size();
+		stage(r, [&](unsigned char* destination)
+		{
+			memcpy(destination, levels.data(), levels.size());
+			return true;
+		});
+	}
+	// this worker's scratch memory for stb_image, freed when the pool's threads exit
+	static stbi_arena& scratchArena()
+	{
+		struct Arena
+		{
+			stbi_arena arena;
+			Arena() { stbi_arena_init(&arena, 0); }
+			~Arena() { stbi_arena_free(&arena); }
+		};
+		thread_local Arena scratch;
+		return scratch.arena;
+	}
+	// this worker's copy of the file being decoded, for dedupe requests
+	static std::vector<unsigned char>& fileBuffer()
+	{
+		thread_local std::vector<unsigned char> buffer;
+		return buffer;
+	}
+	static bool readFile(const std::string& path, std::vector<unsigned char>& buffer)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		buffer.resize(size > 0 ? (size_t)size : 0);
+		bool ok = size > 0 && fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+		fclose(file);
+		return ok;
+	}
+	// hash the contents and the settings that end up in the texture, then
+	// either become the request others with that key borrow from, or borrow
+	// from the one that already is. true if r was finished as a duplicate.
+	bool isDuplicate(Request* r, const unsigned char* data, size_t size)
+	{
+		// FNV-1a 64 over 8 byte words, then the settings
+		uint64_t h = 14695981039346656037ull;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, data + i, 8);
+			h = (h ^ word) * 1099511628211ull;
+		}
+		for (; i < size; i++)
+			h = (h ^ data[i]) * 1099511628211ull;
+		int settings[] = { r->wrap, r->minFilter, r->magFilter, r->srgb, flip, cpuMips, (int)mipFilter };
+		for (int setting : settings)
+			h = (h ^ (uint64_t)(uint32_t)setting) * 1099511628211ull;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unordered_map<uint64_t, int>::iterator it = byContent.find(h);
+		if (it != byContent.end())
+		{
+			r->duplicateOf = it->second;
+			r->state = Request::DUPLICATE;
+			decoded.push_back(r);
+			return true;
+		}
+		r->contentKey = h;
+		r->keyed = true;
+		byContent[h] = r->handle;
+		return false;
+	}
+	// r no longer has a texture to lend, caller holds the mutex
+	void forgetContents(Request& r)
+	{
+		if (!r.keyed)
+			return;
+		r.keyed = false;
+		std::unordered_map<uint64_t, int>::iterator it = byContent.find(r.contentKey);
+		if (it != byContent.end() && it->second == r.handle)
+			byContent.erase(it);
+	}
+	// the request whose texture handle shows, caller holds the mutex
+	const Request& resolve(int handle) const
+	{
+		const Request& r = *requests[handle];
+		return r.duplicateOf >= 0 && r.state == Request::DUPLICATE ? *requests[r.duplicateOf] : r;
+	}
+	// this decode's settings, the same for every thread. a big JPEG on its own
+	// gets the other decode threads' help
+	stbi_load_options decodeOptions(int components) const
+	{
+		stbi_load_options options;
+		stbi_load_options_init(&options);
+		options.desired_channels = components;
+		options.flip_vertically = flip;
+		options.scratch = &scratchArena().allocator;
+		options.parallel_for = ThreadPool::runTasks;
+		options.parallel_user = pool.get();
+		options.parallel_threads = (int)pool->size();
+		return options;
+	}
+	// level 0 with r->components per texel into destination, rows packed.
+	// from bytes when the file was read already, otherwise from r->path.
+	bool decodeInto(Request* r, const std::vector<unsigned char>* bytes, unsigned char* destination)
+	{
+		int width, height, channels;
+		int stride = r->width * r->components;
+		stbi_load_options options = decodeOptions(r->components);
+		int ok = bytes ? stbi_load_into_from_memory_ex(bytes->data(), (int)bytes->size(), destination, stride, stride * r->height,
+				&width, &height, &channels, &options)
+			: stbi_load_into_ex(r->path.c_str(), destination, stride, stride * r->height, &width, &height, &channels, &options);
+		if (!ok)
+		{
+			r->failure = options.failure_reason;
+			return false;
+		}
+		// the file changed under us since stbi_info. not the channel count: the
+		// texels are r->components whatever the file has, and the two may differ
+		// anyway for formats whose header doesn't tell the whole story
+		return width == r->width && height == r->height;
+	}
+	// scaled decoding fails on anything but a JPEG, which then has no preview
+	void decodePreview(Request* r, const std::vector<unsigned char>* bytes)
+	{
+		int width, height, channels;
+		stbi_load_options options = decodeOptions(r->components);
+		options.scale_log2 = 3;
+		unsigned char* pixels = bytes ? stbi_load_from_memory_ex(bytes->data(), (int)bytes->size(), &width, &height, &channels, &options)
+			: stbi_load_ex(r->path.c_str(), &width, &height, &channels, &options);
+		if (!pixels)
+			return;
+		r->previewWidth = width;
+		r->previewHeight = height;
+		r->previewPixels = pixels;
+		std::lock_guard<std::mutex> lock(mutex);
+		previews.push_back(r);
+	}
+	void decodeKtx2(Request* r)
+	{
+		Ktx2::File file;
+		if (!file.load(r->path))
+		{
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		if (r->dedupe && isDuplicate(r, file.data.data(), file.data.size()))
+			return;
+		switch (file.format)
+		{
+		case Ktx2::BC7_UNORM: r->compressedFormat = GL_COMPRESSED_RGBA_BPTC_UNORM; break;
+		case Ktx2::BC7_SRGB: r->compressedFormat = GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM; break;
+		case Ktx2::ETC2_RGB8_UNORM: r->compressedFormat = GL_COMPRESSED_RGB8_ETC2; break;
+		case Ktx2::ETC2_RGB8_SRGB: r->compressedFormat = GL_COMPRESSED_SRGB8_ETC2; break;
+		case Ktx2::ETC2_RGBA8_UNORM: r->compressedFormat = GL_COMPRESSED_RGBA8_ETC2_EAC; break;
+		case Ktx2::ETC2_RGBA8_SRGB: r->compressedFormat = GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC; break;
+		case Ktx2::ASTC_4x4_UNORM: r->compressedFormat = 0x93B0; break;	// GL_COMPRESSED_RGBA_ASTC_4x4_KHR
+		case Ktx2::ASTC_4x4_SRGB: r->compressedFormat = 0x93D0; break;	// GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR
+		default:
+			std::cout << "ERROR::KTX2::unsupported format " << file.format << " in " << r->path << std::endl;
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		r->width = file.width;
+		r->height = file.height;
+		// the file has the whole chain, only the levels the filter samples go up
+		size_t levels = usesMipmaps(r->minFilter) ? file.levels.size() : 1;
+		r->bytes = 0;
+		for (size_t i = 0; i < levels; i++)
+		{
+			r->levelBytes.push_back((size_t)file.levels[i].length);
+			r->bytes += (size_t)file.levels[i].length;
+		}
+		stage(r, [&](unsigned char* destination)
+		{
+			for (size_t i = 0; i < levels; i++)
+			{
+				memcpy(destination, &file.data[(size_t)file.levels[i].offset], r->levelBytes[i]);
+				destination += r->levelBytes[i];
+			}
+			return true;
+		});
+	}
+	// put r->bytes of data into a staging slot through fill(destination), or
+	// into client memory when it doesn't fit / there is no staging buffer.
+	// fill returns false if it couldn't produce the data.
+	template <typename Fill>
+	void stage(Request* r, Fill fill)
+	{
+		if (staging && r->bytes <= slotBytes)
+		{
+			int slot = acquireSlot();
+			if (slot >= 0)
+			{
+				if (!fill(staging + slot * slotBytes))
+				{
+					releaseSlot(slot);
+					finishDecode(r, Request::FAILED);
+					return;
+				}
+				r->slot = slot;
+				finishDecode(r, Request::STAGED);
+				return;
+			}
+		}
+		r->pixels = (unsigned char*)malloc(r->bytes);
+		if (!fill(r->pixels))
+		{
+			free(r->pixels);
+			r->pixels = NULL;
+			finishDecode(r, Request::FAILED);
+			return;
+		}
+		finishDecode(r, Request::DECODED);
+	}
+	void finishDecode(Request* r, Request::State state)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// a failed image has nothing to lend, later requests try for themselves
+		if (state == Request::FAILED)
+			forgetContents(*r);
+		r->state = state;
+		decoded.push_back(r);
+	}
+	// waits for update() to recycle a slot, -1 when shutting down
+	int acquireSlot()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			if (stopping)
+				return -1;
+			for (size_t i = 0; i < slotFree.size(); i++)
+			{
+				if (slotFree[i])
+				{
+					slotFree[i] = false;
+					return (int)i;
+				}
+			}
+			slotReleased.wait(lock);
+		}
+	}
+	// a slot that was acquired but not filled
+	void releaseSlot(int slot)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slotFree[slot] = true;
+		}
+		slotReleased.notify_all();
+	}
+	void recycleSlots()
+	{
+		bool released = false;
+		for (size_t i = 0; i < slotFences.size(); i++)
+		{
+			if (!slotFences[i] || glClientWaitSync(slotFences[i], 0, 0) == GL_TIMEOUT_EXPIRED)
+				continue;
+			glDeleteSync(slotFences[i]);
+			slotFences[i] = 0;
+			std::lock_guard<std::mutex> lock(mutex);
+			slotFree[i] = true;
+			released = true;
+		}
+		if (released)
+			slotReleased.notify_all();
+	}
+	// GL thread
+	void uploadPixels(Request* r, const unsigned char* source)
+	{
+		// by channel count: grey, grey + alpha, rgb, rgba
+		static const GLenum linearFormats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+		static const GLenum srgbFormats[] = { GL_R8, GL_RG8, GL_SRGB8, GL_SRGB8_ALPHA8 };
+		static const GLenum dataFormats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+		static const int texelBytes[] = { 1, 2, 4, 4 };	// rgb8 is padded to 4 bytes by every driver we know of
+		GLenum internalFormat = (r->srgb ? srgbFormats : linearFormats)[r->channels - 1];
+		GLenum format = dataFormats[r->components - 1];
+		int levels = usesMipmaps(r->minFilter) ? MipChain::levelCount(r->width, r->height) : 1;
+
+		r->gpuBytes = 0;
+		for (int level = 0; level < levels; level++)
+			r->gpuBytes += (size_t)std::max(r->width >> level, 1) * std::max(r->height >> level, 1) * texelBytes[r->channels - 1];
+		if (GLAD_GL_VERSION_4_2 && glTexStorage2D)
+			glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, r->width, r->height);
+		else
+		{
+			// same layout in mutable storage, the max level keeps it complete
+			for (int level = 0; level < levels; level++)
+				glTexImage2D(GL_TEXTURE_2D, level, internalFormat, std::max(r->width >> level, 1), std::max(r->height >> level, 1), 0,
+					format, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		}
+		for (int level = 0; level < r->stagedLevels; level++)
+		{
+			int w = std::max(r->width >> level, 1), h = std::max(r->height >> level, 1);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, rowAlignment((size_t)w * r->components));
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, w, h, format, GL_UNSIGNED_BYTE, source);
+			source += (size_t)w * h * r->components;
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if (levels > r->stagedLevels)
+			glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	// same format and sampling as the full texture, mipmapped by the driver
+	// since the image is small
+	void uploadPreview(Request* r)
+	{
+		static const GLenum linearFormats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+		static const GLenum srgbFormats[] = { GL_R8, GL_RG8, GL_SRGB8, GL_SRGB8_ALPHA8 };
+		static const GLenum dataFormats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+		GLenum internalFormat = (r->srgb ? srgbFormats : linearFormats)[r->channels - 1];
+		int levels = usesMipmaps(r->minFilter) ? MipChain::levelCount(r->previewWidth, r->previewHeight) : 1;
+		glGenTextures(1, &r->preview);
+		glBindTexture(GL_TEXTURE_2D, r->preview);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, r->wrap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, r->wrap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, r->minFilter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, r->magFilter);
+		if (GLAD_GL_VERSION_4_2 && glTexStorage2D)
+			glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, r->previewWidth, r->previewHeight);
+		else
+		{
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, r->previewWidth, r->previewHeight, 0, dataFormats[r->components - 1],
+				GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, rowAlignment((size_t)r->previewWidth * r->components));
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, r->previewWidth, r->previewHeight, dataFormats[r->components - 1],
+			GL_UNSIGNED_BYTE, r->previewPixels);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if (levels > 1)
+			glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		stbi_image_free(r->previewPixels);
+		r->previewPixels = NULL;
+		// the request was released in the meantime
+		std::lock_guard<std::mutex> lock(mutex);
+		if (r->releaseOnUpload)
+		{
+			glDeleteTextures(1, &r->preview);
+			r->preview = 0;
+		}
+	}
+	// the levels come prebuilt, nothing to generate
+	void uploadCompressed(Request* r, const unsigned char* source)
+	{
+		int levels = (int)r->levelBytes.size();
+		r->gpuBytes = r->bytes;
+		if (GLAD_GL_VERSION_4_2 && glTexStorage2D)
+			glTexStorage2D(GL_TEXTURE_2D, levels, r->compressedFormat, r->width, r->height);
+		else
+		{
+			for (int level = 0; level < levels; level++)
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, r->compressedFormat, std::max(r->width >> level, 1),
+					std::max(r->height >> level, 1), 0, (GLsizei)r->levelBytes[level], NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		}
+		for (int level = 0; level < levels; level++)
+		{
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, std::max(r->width >> level, 1), std::max(r->height >> level, 1),
+				r->compressedFormat, (GLsizei)r->levelBytes[level], source);
+			source += r->levelBytes[level];
+		}
+	}
+	static bool usesMipmaps(GLint minFilter)
+	{
+		return minFilter != GL_NEAREST && minFilter != GL_LINEAR;
+	}
+	// largest GL_UNPACK_ALIGNMENT the rows satisfy
+	static int rowAlignment(size_t rowBytes)
+	{
+		return rowBytes % 8 == 0 ? 8 : rowBytes % 4 == 0 ? 4 : rowBytes % 2 == 0 ? 2 : 1;
+	}
+	void upload(Request* r)
+	{
+		glGenTextures(1, &r->texture);
+		glBindTexture(GL_TEXTURE_2D, r->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, r->wrap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, r->wrap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, r->minFilter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, r->magFilter);
+		const unsigned char* source = r->pixels;
+		if (r->slot >= 0)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+			source = (const unsigned char*)(r->slot * slotBytes);	// offset into the bound buffer
+		}
+		if (r->compressedFormat)
+			uploadCompressed(r, source);
+		else
+			uploadPixels(r, source);
+		if (r->slot >= 0)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			slotFences[r->slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			r->slot = -1;
+		}
+		free(r->pixels);
+		r->pixels = NULL;
+		glBindTexture(GL_TEXTURE_2D, 0);
+		std::lock_guard<std::mutex> lock(mutex);
+		r->state = Request::READY;
+		if (r->preview)
+		{
+			glDeleteTextures(1, &r->preview);
+			r->preview = 0;
+		}
+		if (r->releaseOnUpload)
+		{
+			glDeleteTextures(1, &r->texture);
+			r->texture = 0;
+			r->state = Request::RELEASED;
+		}
+	}
+};
+#endif
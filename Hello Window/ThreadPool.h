@@ -0,0 +1,153 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed from one job queue. submit() is for fire and
+// forget work (decoding, streaming), parallelFor() splits a range into chunks
+// and blocks until all of them ran, with the calling thread helping out.
+class ThreadPool
+{
+public:
+	// threads == 0 picks one worker per hardware thread minus the caller's
+	// ------------------------------------------------------------------------
+	explicit ThreadPool(unsigned int threads = 0)
+	{
+		if (threads == 0)
+		{
+			unsigned int hw = std::thread::hardware_concurrency();
+			threads = hw > 1 ? hw - 1 : 1;
+		}
+		for (unsigned int i = 0; i < threads; i++)
+			workers.emplace_back([this] { workerLoop(); });
+	}
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& t : workers)
+			t.join();
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+	// ------------------------------------------------------------------------
+	void submit(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+			outstanding++;
+		}
+		wake.notify_one();
+	}
+	// block until every job submitted so far has finished
+	// ------------------------------------------------------------------------
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this] { return outstanding == 0; });
+	}
+	// run fn(begin, end) over [0, count) in chunks of at least grain items.
+	// ------------------------------------------------------------------------
+	template <typename Fn>
+	void parallelFor(size_t count, size_t grain, Fn fn)
+	{
+		if (count == 0)
+			return;
+		grain = std::max<size_t>(grain, 1);
+		size_t chunks = (count + grain - 1) / grain;
+		if (chunks == 1 || workers.empty())
+		{
+			fn((size_t)0, count);
+			return;
+		}
+
+		struct Range
+		{
+			std::atomic<size_t> next{ 0 };
+			std::atomic<size_t> done{ 0 };
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+		std::shared_ptr<Range> range = std::make_shared<Range>();
+		auto work = [range, chunks, grain, count, &fn]
+		{
+			size_t chunk;
+			while ((chunk = range->next.fetch_add(1)) < chunks)
+			{
+				size_t begin = chunk * grain;
+				fn(begin, std::min(begin + grain, count));
+				if (range->done.fetch_add(1) + 1 == chunks)
+				{
+					std::lock_guard<std::mutex> lock(range->mutex);
+					range->finished.notify_all();
+				}
+			}
+		};
+		size_t helpers = std::min(workers.size(), chunks - 1);
+		for (size_t i = 0; i < helpers; i++)
+			submit(work);
+		work();
+		std::unique_lock<std::mutex> lock(range->mutex);
+		range->finished.wait(lock, [&] { return range->done.load() == chunks; });
+	}
+	// task(data, 0..count-1) on the pool, for C code that takes a parallel-for
+	// callback with a user pointer (stbi_load_options.parallel_for), pool being this
+	// ------------------------------------------------------------------------
+	static void runTasks(void* pool, void (*task)(void*, int), void* data, int count)
+	{
+		static_cast<ThreadPool*>(pool)->parallelFor((size_t)count, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+				task(data, (int)i);
+		});
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	size_t outstanding = 0;
+	bool stopping = false;
+
+	void workerLoop()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty())
+					return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--outstanding == 0)
+					idle.notify_all();
+			}
+		}
+	}
+};
+#endif
@@ -0,0 +1,262 @@
+#ifndef TRANSFORM_SYSTEM_H
+#define TRANSFORM_SYSTEM_H
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <vector>
+
+#include "CpuFeatures.h"
+#include "ThreadPool.h"
+
+#ifdef HELLO_SSE2
+#include <immintrin.h>
+#endif
+
+// Position / rotation / scale for many objects, stored as structure of arrays
+// so the model matrices can be built 4 (SSE) or 8 (AVX) objects at a time.
+// Objects live in blocks of BLOCK; changing an object marks its block dirty and
+// update() only rebuilds dirty blocks, writing column-major mat4s straight into
+// the destination (typically a mapped instance buffer). With several
+// destinations that are written in turn (the regions of an InstanceBuffer) a
+// block stays dirty for each one until update() has written it there.
+class TransformSystem
+{
+public:
+	static const int BLOCK = 8;
+
+	// returns the index of the new object. the rotation is angle (radians)
+	// around axis, the matrix is translate * rotate * scale like glm would build.
+	// ------------------------------------------------------------------------
+	int add(const glm::vec3& position, const glm::vec3& axis, float angle, const glm::vec3& scale = glm::vec3(1.0f))
+	{
+		int index = count++;
+		if (index % BLOCK == 0)
+		{
+			// grow by a whole block, padding objects are identity transforms
+			for (int i = 0; i < BLOCK; i++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					pos[c].push_back(0.0f);
+					scl[c].push_back(1.0f);
+					rot[c].push_back(0.0f);
+				}
+				rot[3].push_back(1.0f);
+			}
+			dirty.push_back(allTargets);
+		}
+		setPosition(index, position);
+		setRotation(index, axis, angle);
+		setScale(index, scale);
+		return index;
+	}
+	// ------------------------------------------------------------------------
+	void setPosition(int index, const glm::vec3& position)
+	{
+		pos[0][index] = position.x;
+		pos[1][index] = position.y;
+		pos[2][index] = position.z;
+		dirty[index / BLOCK] = allTargets;
+	}
+	void setRotation(int index, const glm::vec3& axis, float angle)
+	{
+		glm::vec3 n = glm::normalize(axis);
+		float s = std::sin(angle * 0.5f);
+		rot[0][index] = n.x * s;
+		rot[1][index] = n.y * s;
+		rot[2][index] = n.z * s;
+		rot[3][index] = std::cos(angle * 0.5f);
+		dirty[index / BLOCK] = allTargets;
+	}
+	void setScale(int index, const glm::vec3& scale)
+	{
+		scl[0][index] = scale.x;
+		scl[1][index] = scale.y;
+		scl[2][index] = scale.z;
+		dirty[index / BLOCK] = allTargets;
+	}
+	// objects added so far, and how many matrices update() may write (always a
+	// whole number of blocks); size destination buffers by capacity()
+	int size() const
+	{
+		return count;
+	}
+	int capacity() const
+	{
+		return (int)dirty.size() * BLOCK;
+	}
+	// how many destinations update() writes in turn (1 to 8), everything is
+	// dirty for all of them afterwards
+	void setTargets(int targets)
+	{
+		allTargets = (unsigned char)((1u << targets) - 1);
+		for (unsigned char& d : dirty)
+			d = allTargets;
+	}
+	bool anyDirty(int target = 0) const
+	{
+		for (unsigned char d : dirty)
+			if (d & (1u << target))
+				return true;
+		return false;
+	}
+	// rebuild the matrices of every block dirty for target into destination,
+	// which holds capacity() column-major mat4s. returns the number of blocks
+	// rebuilt.
+	// ------------------------------------------------------------------------
+	int update(float* destination, ThreadPool* pool = NULL, int target = 0)
+	{
+		dirtyList.clear();
+		for (int b = 0; b < (int)dirty.size(); b++)
+		{
+			if (dirty[b] & (1u << target))
+			{
+				dirtyList.push_back(b);
+				dirty[b] &= ~(1u << target);
+			}
+		}
+		if (dirtyList.empty())
+			return 0;
+
+		const CpuFeatures& cpu = CpuFeatures::get();
+		auto run = [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				int first = dirtyList[i] * BLOCK;
+#ifdef HELLO_SSE2
+				if (cpu.avx)
+					buildBlockAvx(first, destination + first * 16);
+				else
+				{
+					buildQuadSse(first, destination + first * 16);
+					buildQuadSse(first + 4, destination + (first + 4) * 16);
+				}
+#else
+				(void)cpu;
+				for (int j = first; j < first + BLOCK; j++)
+					buildScalar(j, destination + j * 16);
+#endif
+			}
+		};
+		// ~2k objects per chunk, smaller work isn't worth waking a thread for
+		if (pool)
+			pool->parallelFor(dirtyList.size(), 256, run);
+		else
+			run(0, dirtyList.size());
+		return (int)dirtyList.size();
+	}
+
+private:
+	int count = 0;
+	std::vector<float> pos[3];	// x, y, z
+	std::vector<float> rot[4];	// unit quaternion x, y, z, w
+	std::vector<float> scl[3];
+	std::vector<unsigned char> dirty;	// one bit per target, per block
+	unsigned char allTargets = 1;
+	std::vector<int> dirtyList;
+
+	// the reference version, also what the SIMD kernels compute lane-wise:
+	// columns 0-2 are the quaternion's rotation matrix scaled per axis,
+	// column 3 is the translation.
+	void buildScalar(int i, float* m) const
+	{
+		float x = rot[0][i], y = rot[1][i], z = rot[2][i], w = rot[3][i];
+		float sx = scl[0][i], sy = scl[1][i], sz = scl[2][i];
+		m[0] = (1.0f - 2.0f * (y * y + z * z)) * sx;
+		m[1] = 2.0f * (x * y + w * z) * sx;
+		m[2] = 2.0f * (x * z - w * y) * sx;
+		m[3] = 0.0f;
+		m[4] = 2.0f * (x * y - w * z) * sy;
+		m[5] = (1.0f - 2.0f * (x * x + z * z)) * sy;
+		m[6] = 2.0f * (y * z + w * x) * sy;
+		m[7] = 0.0f;
+		m[8] = 2.0f * (x * z + w * y) * sz;
+		m[9] = 2.0f * (y * z - w * x) * sz;
+		m[10] = (1.0f - 2.0f * (x * x + y * y)) * sz;
+		m[11] = 0.0f;
+		m[12] = pos[0][i];
+		m[13] = pos[1][i];
+		m[14] = pos[2][i];
+		m[15] = 1.0f;
+	}
+
+#ifdef HELLO_SSE2
+	// lanes hold one matrix element for 4 objects: transpose each group of
+	// four to get one matrix column per object and store it
+	static void storeColumns(float* m, __m128 a, __m128 b, __m128 c, __m128 d, int column)
+	{
+		_MM_TRANSPOSE4_PS(a, b, c, d);
+		_mm_storeu_ps(m + 0 * 16 + column * 4, a);
+		_mm_storeu_ps(m + 1 * 16 + column * 4, b);
+		_mm_storeu_ps(m + 2 * 16 + column * 4, c);
+		_mm_storeu_ps(m + 3 * 16 + column * 4, d);
+	}
+	void buildQuadSse(int i, float* m) const
+	{
+		__m128 x = _mm_loadu_ps(&rot[0][i]), y = _mm_loadu_ps(&rot[1][i]);
+		__m128 z = _mm_loadu_ps(&rot[2][i]), w = _mm_loadu_ps(&rot[3][i]);
+		__m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+		__m128 x2 = _mm_mul_ps(x, two), y2 = _mm_mul_ps(y, two), z2 = _mm_mul_ps(z, two);
+		__m128 xx = _mm_mul_ps(x, x2), yy = _mm_mul_ps(y, y2), zz = _mm_mul_ps(z, z2);
+		__m128 xy = _mm_mul_ps(x, y2), xz = _mm_mul_ps(x, z2), yz = _mm_mul_ps(y, z2);
+		__m128 wx = _mm_mul_ps(w, x2), wy = _mm_mul_ps(w, y2), wz = _mm_mul_ps(w, z2);
+		__m128 sx = _mm_loadu_ps(&scl[0][i]), sy = _mm_loadu_ps(&scl[1][i]), sz = _mm_loadu_ps(&scl[2][i]);
+
+		storeColumns(m,
+			_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx),
+			_mm_mul_ps(_mm_add_ps(xy, wz), sx),
+			_mm_mul_ps(_mm_sub_ps(xz, wy), sx),
+			zero, 0);
+		storeColumns(m,
+			_mm_mul_ps(_mm_sub_ps(xy, wz), sy),
+			_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy),
+			_mm_mul_ps(_mm_add_ps(yz, wx), sy),
+			zero, 1);
+		storeColumns(m,
+			_mm_mul_ps(_mm_add_ps(xz, wy), sz),
+			_mm_mul_ps(_mm_sub_ps(yz, wx), sz),
+			_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz),
+			zero, 2);
+		storeColumns(m, _mm_loadu_ps(&pos[0][i]), _mm_loadu_ps(&pos[1][i]), _mm_loadu_ps(&pos[2][i]), one, 3);
+	}
+	// same math 8 wide, the transposes and stores go through the 128-bit halves
+	HELLO_TARGET_AVX void buildBlockAvx(int i, float* m) const
+	{
+		__m256 x = _mm256_loadu_ps(&rot[0][i]), y = _mm256_loadu_ps(&rot[1][i]);
+		__m256 z = _mm256_loadu_ps(&rot[2][i]), w = _mm256_loadu_ps(&rot[3][i]);
+		__m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f);
+		__m256 x2 = _mm256_mul_ps(x, two), y2 = _mm256_mul_ps(y, two), z2 = _mm256_mul_ps(z, two);
+		__m256 xx = _mm256_mul_ps(x, x2), yy = _mm256_mul_ps(y, y2), zz = _mm256_mul_ps(z, z2);
+		__m256 xy = _mm256_mul_ps(x, y2), xz = _mm256_mul_ps(x, z2), yz = _mm256_mul_ps(y, z2);
+		__m256 wx = _mm256_mul_ps(w, x2), wy = _mm256_mul_ps(w, y2), wz = _mm256_mul_ps(w, z2);
+		__m256 sx = _mm256_loadu_ps(&scl[0][i]), sy = _mm256_loadu_ps(&scl[1][i]), sz = _mm256_loadu_ps(&scl[2][i]);
+
+		__m256 e[4][3];
+		e[0][0] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), sx);
+		e[0][1] = _mm256_mul_ps(_mm256_add_ps(xy, wz), sx);
+		e[0][2] = _mm256_mul_ps(_mm256_sub_ps(xz, wy), sx);
+		e[1][0] = _mm256_mul_ps(_mm256_sub_ps(xy, wz), sy);
+		e[1][1] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, zz)), sy);
+		e[1][2] = _mm256_mul_ps(_mm256_add_ps(yz, wx), sy);
+		e[2][0] = _mm256_mul_ps(_mm256_add_ps(xz, wy), sz);
+		e[2][1] = _mm256_mul_ps(_mm256_sub_ps(yz, wx), sz);
+		e[2][2] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, yy)), sz);
+		e[3][0] = _mm256_loadu_ps(&pos[0][i]);
+		e[3][1] = _mm256_loadu_ps(&pos[1][i]);
+		e[3][2] = _mm256_loadu_ps(&pos[2][i]);
+
+		__m128 zero = _mm_setzero_ps(), one4 = _mm_set1_ps(1.0f);
+		for (int column = 0; column < 4; column++)
+		{
+			__m128 last = column == 3 ? one4 : zero;
+			storeColumns(m, _mm256_castps256_ps128(e[column][0]), _mm256_castps256_ps128(e[column][1]),
+				_mm256_castps256_ps128(e[column][2]), last, column);
+			storeColumns(m + 4 * 16, _mm256_extractf128_ps(e[column][0], 1), _mm256_extractf128_ps(e[column][1], 1),
+				_mm256_extractf128_ps(e[column][2], 1), last, column);
+		}
+	}
+#endif
+};
+#endif
@@ -196,6 +196,147 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Memory-mapped files  (disable by defining STBI_NO_MMAP)
+//
+// stbi_load_mapped and stbi_load_16_mapped take a filename like stbi_load,
+// but map the whole file read-only (mmap, or MapViewOfFile on Windows) and
+// decode from the mapped view as if it was passed to stbi_load_from_memory.
+// That skips the 128 byte refill buffer and its fread per refill: the
+// decoders read straight from the page cache, without copying the file.
+// If the file can't be mapped (a pipe, a file over 2GB, no mmap on the
+// platform) they fall back to the stdio path, so they can always be used in
+// place of stbi_load.
+//
+// ===========================================================================
+//
+// Decoding into your own memory
+//
+// stbi_load_into, stbi_load_into_from_memory and stbi_load_into_from_callbacks
+// write the 8-bit image into a buffer you provide, output_stride bytes from
+// one row to the next, instead of returning a new allocation; e.g. straight
+// into a mapped pixel buffer object. Get the size with stbi_info first. They
+// return 1 on success, 0 on failure (including a buffer of output_size bytes
+// that is too small). The vertical flip is applied while writing the rows.
+// JPEGs are converted straight into the buffer; the other formats still
+// decode into memory of their own first and are copied over row by row.
+// stbi_load_into opens the file like stbi_load_mapped.
+//
+// ===========================================================================
+//
+// Scaled JPEG decoding
+//
+// stbi_load_scaled, stbi_load_scaled_from_memory and stbi_load_into_scaled
+// decode a JPEG at 1/2, 1/4 or 1/8 of its size (scale_log2 1, 2 or 3; 0 is
+// a normal load), for thumbnails or the small mips of a big texture. Each
+// 8x8 block goes through a 4x4, 2x2 or DC-only IDCT of its low frequencies
+// instead of the full one (the method of IJG's jidctred.c), so the Huffman
+// decoding is all that costs as much as at full size. Chroma subsampled 2x
+// or 4x both ways is scaled that much less, so it isn't upsampled again.
+// The image comes out ceil(w / 2^scale_log2) by ceil(h / 2^scale_log2),
+// close to a box filter of the full decode but not the same pixels. Other
+// formats fail to load, so check the result rather than the file type.
+// stbi_load_into_scaled opens the file like stbi_load_mapped.
+//
+// ===========================================================================
+//
+// Per-call options
+//
+// stbi_set_flip_vertically_on_load and friends change every later load in
+// the process, which is no good when several threads load at once and want
+// different things. The _ex functions take those settings with the call:
+//
+//     stbi_load_options opt;
+//     stbi_load_options_init(&opt);     // what the process-wide ones say
+//     opt.desired_channels = 4;
+//     opt.flip_vertically = 1;
+//     pixels = stbi_load_ex(filename, &x, &y, &n, &opt);
+//     if (!pixels) report(opt.failure_reason);
+//
+// With an allocator, everything the call allocates comes from it, the
+// image it returns too (free that with allocator->free, not
+// stbi_image_free). Tasks run through the call's parallel_for allocate from
+// the same allocator, so it has to be safe to call from those threads.
+// Buffers the JPEG and PNG decoders only need while decoding (component
+// planes, coefficients, line buffers, the compressed and inflated PNG data)
+// come from opt->scratch instead, when it's set. An stbi_arena makes those
+// cheap for a thread that loads one image after another:
+//
+//     stbi_arena arena;
+//     stbi_arena_init(&arena, 0);       // or a size to start with
+//     opt.scratch = &arena.allocator;
+//     for (each image) {
+//        pixels = stbi_load_ex(filename, &x, &y, &n, &opt);
+//        ...
+//        stbi_arena_reset(&arena);
+//     }
+//     stbi_arena_free(&arena);
+//
+// The first images may still go to malloc for what doesn't fit; the reset
+// after them grows the block to fit, after which a batch of similar images
+// decodes without allocating or faulting in any new scratch pages. An
+// arena serves one call at a time (and that call's tasks).
+// The error of a call that fails goes to opt->failure_reason. For the other
+// functions, stbi_failure_reason() is kept per thread when the compiler has
+// thread-local storage (define STBI_THREAD_LOCAL to override the keyword);
+// the process-wide settings themselves are still process-wide.
+//
+// ===========================================================================
+//
+// Stage timing  (enable by defining STBI_STAGE_TIMING)
+//
+// Built with STBI_STAGE_TIMING, an _ex call given opt->stage_times adds the
+// seconds it spent in each part of decoding to it:
+//   - decode: Huffman decoding, inflate, RLE and LZW, and whatever isn't in
+//     another stage (TGA, BMP and GIF are nearly all this);
+//   - transform: JPEG dequantization and IDCT, PNG unfiltering;
+//   - convert: JPEG upsampling and color conversion, PNG bit depth
+//     expansion, de-interlacing, palettes and transparency, channel
+//     conversion, HDR to LDR and back, flipping;
+//   - wait: tasks run through the parallel-for waiting on each other,
+//     and the caller waiting on them;
+//   - read: the read callback (stdio for stbi_load_ex). A mapped file's page
+//     faults land in whichever stage first touches the page.
+// Every thread running one of the call's tasks adds its own time, so with
+// threads the stages add up to more than the call took. The clock is read
+// a few times per row of MCUs or pixels, and the serial JPEG decoder
+// Huffman decodes a whole row of MCUs before its IDCT rather than a block
+// at a time so the two can be told apart; timed loads are a little slower,
+// the pixels are the same. Without STBI_STAGE_TIMING the field is ignored.
+//
+// ===========================================================================
+//
+// Multithreaded decoding  (disable by defining STBI_NO_THREADS)
+//
+// stb_image doesn't start threads, but it can use yours. Give a call a
+// function that runs task(task_data, i) for i in [0, count), possibly on
+// several threads at once, and returns once all of them have returned:
+//
+//     opt.parallel_for = my_parallel_for;
+//     opt.parallel_user = my_pool;
+//     opt.parallel_threads = 8;
+//
+// count is at most the thread count given. Each call reads its own, so
+// threads loading with different pools (or none) don't get in each other's
+// way. stbi_set_parallel_for(my_parallel_for, my_pool, 8) sets the one the
+// functions without options use, and what stbi_load_options_init fills in;
+// don't change it while something might be loading. JPEGs of 512x512 pixels and more
+// are then decoded by that many tasks (any number of them may run on the
+// same thread, they never wait for a task that hasn't started):
+//   - baseline scans with restart markers, decoded from memory, have their
+//     restart intervals Huffman decoded concurrently;
+//   - otherwise the Huffman decoder walks the scan one MCU row at a time
+//     while the other tasks do the IDCT, upsampling and color conversion of
+//     the rows it has finished;
+//   - progressive images run their IDCT and color conversion in parallel
+//     once all scans are in.
+// Interlaced PNGs of that size are inflated by one task while up to seven
+// others unfilter each Adam7 pass as soon as its data is in. Other PNGs
+// don't use threads, but they never hold the whole inflated image either:
+// rows are unfiltered straight into the output as they're inflated.
+// The output is identical to a single threaded decode.
+//
+// ===========================================================================
+//
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
@@ -215,6 +356,28 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// With gcc 4.9+, clang 3.8+ or MSVC 2012+, the JPEG IDCT, 2x2 upsampling and
+// YCbCr->RGBA conversion also have AVX2 versions, used when the CPU and OS
+// support AVX2 (define STBI_NO_AVX2 to leave them out). They give exactly the
+// same pixels as the SSE2 ones. PNG unfiltering of 8-bit RGB and RGBA rows
+// uses SSE2 too, and AVX2 for the Up filter. simd_limit STBI_simd_sse2 or
+// STBI_simd_none in the load options keeps a call's decoder from using more
+// than that, for comparing; stbi_set_simd_limit sets the default.
+//
+// ===========================================================================
+//
+// Fast inflate
+//
+// PNG's zlib data is inflated with a 64-bit bit buffer refilled 8 bytes at a
+// time, 11-bit lookup tables (some entries decode two literals at once) and
+// matches copied a word at a time. That is about 1.5x stb's original
+// inflate on photographic PNGs and several times on flat artwork, with the
+// same bytes out; corrupt streams the original would read zeros past the
+// end of, or with length/distance codes deflate doesn't use, fail instead.
+// fast_inflate 0 in the load options goes back to the original, for
+// comparing. stbi_set_fast_inflate sets the default, which the functions
+// without options and the zlib ones read when a stream starts.
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -303,6 +466,7 @@ RECENT REVISION HISTORY:
 //
 
 
+#include <stddef.h> // size_t, for stbi_allocator
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif // STBI_NO_STDIO
@@ -359,11 +523,27 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+STBIDEF int      stbi_load_into_from_memory   (stbi_uc const *buffer, int len, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int      stbi_load_into               (char const *filename, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
 
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
+#ifndef STBI_NO_MMAP
+STBIDEF stbi_uc *stbi_load_mapped     (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+#endif
+
+// JPEGs only, at 1/2^scale_log2 size, see "Scaled JPEG decoding"
+STBIDEF stbi_uc *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int scale_log2, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled            (char const *filename, int scale_log2, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_load_into_scaled       (char const *filename, int scale_log2, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, int desired_channels);
 #endif
 
 ////////////////////////////////////
@@ -377,6 +557,9 @@ STBIDEF stbi_us *stbi_load_16_from_callbacks(stbi_io_callbacks const *clbk, void
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_MMAP
+STBIDEF stbi_us *stbi_load_16_mapped  (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
 #endif
 
 ////////////////////////////////////
@@ -412,8 +595,8 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 #endif // STBI_NO_STDIO
 
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for failure, of the last call that failed on
+// this thread (process-wide where STBI_THREAD_LOCAL is unavailable)
 STBIDEF const char *stbi_failure_reason  (void);
 
 // free the loaded image -- this is just free()
@@ -446,8 +629,93 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// the settings above, and where the memory comes from, for one call instead
+// of the whole process, see "Per-call options"
+typedef struct
+{
+   void *(*alloc)(void *user, size_t size);
+   void *(*realloc)(void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free)(void *user, void *p);
+   void *user;
+} stbi_allocator;
+
+// most advanced instruction set the JPEG and PNG decoders may use, see "SIMD support"
+enum
+{
+   STBI_simd_none = 0,
+   STBI_simd_sse2 = 1,
+   STBI_simd_avx2 = 2
+};
+
+// runs task(task_data, i) for i in [0, count) on the caller's threads, see
+// "Multithreaded decoding"
+typedef void (*stbi_parallel_task)(void *task_data, int index);
+typedef void (*stbi_parallel_for)(void *user, stbi_parallel_task task, void *task_data, int count);
+
+// seconds a call spent in each stage, see "Stage timing"
+typedef struct
+{
+   double decode, transform, convert, wait, read;
+} stbi_stage_times;
+
+typedef struct
+{
+   int desired_channels;
+   int flip_vertically;
+   int scale_log2;                  // JPEGs only, see "Scaled JPEG decoding"
+   int unpremultiply;
+   int convert_iphone_png_to_rgb;
+   const stbi_allocator *allocator; // NULL for STBI_MALLOC and friends
+   const stbi_allocator *scratch;   // memory freed before the call returns, NULL for allocator
+   stbi_stage_times *stage_times;   // added to with STBI_STAGE_TIMING, NULL for no timing
+   int simd_limit;                  // STBI_simd_*, see "SIMD support"
+   int fast_inflate;                // 0 for the original inflate, see "Fast inflate"
+   stbi_parallel_for parallel_for;  // NULL to decode on the calling thread only
+   void *parallel_user;             // passed to parallel_for
+   int parallel_threads;            // the most tasks parallel_for is given at once
+   const char *failure_reason;      // set when the call fails
+} stbi_load_options;
+
+// a scratch allocator that keeps its memory from one call to the next: one
+// block that stbi_arena_reset grows to the most the calls since the last
+// reset needed. give stbi_load_options.scratch &arena.allocator
+typedef struct
+{
+   stbi_allocator allocator;
+   // the rest is private
+   unsigned char *block;
+   size_t size, used, top, overflow_bytes, peak;
+   void *overflow;
+   long lock;
+} stbi_arena;
+
+STBIDEF void     stbi_arena_init (stbi_arena *arena, size_t size);
+STBIDEF void     stbi_arena_reset(stbi_arena *arena);
+STBIDEF void     stbi_arena_free (stbi_arena *arena);
+
+// desired_channels 0 and the process-wide settings
+STBIDEF void     stbi_load_options_init(stbi_load_options *opt);
+STBIDEF stbi_uc *stbi_load_from_memory_ex     (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *opt);
+STBIDEF int      stbi_load_into_from_memory_ex(stbi_uc const *buffer, int len, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, stbi_load_options *opt);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ex                 (char const *filename, int *x, int *y, int *channels_in_file, stbi_load_options *opt);
+STBIDEF int      stbi_load_into_ex            (char const *filename, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *channels_in_file, stbi_load_options *opt);
+STBIDEF int      stbi_info_ex                 (char const *filename, int *x, int *y, int *comp, stbi_load_options *opt);
+#endif
+
+// see "SIMD support"
+STBIDEF void stbi_set_simd_limit(int limit);
+
+// run decoding work on the caller's threads, see "Multithreaded decoding"
+#ifndef STBI_NO_THREADS
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for parallel_for, void *user, int threads);
+#endif
+
 // ZLIB client - used by PNG, available for other purposes
 
+// 0 to inflate with the original byte-at-a-time decoder, see "Fast inflate"
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_fast);
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
 STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header);
 STBIDEF char *stbi_zlib_decode_malloc(const char *buffer, int len, int *outlen);
@@ -520,6 +788,30 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdio.h>
 #endif
 
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && !defined(STBI_NO_THREADS)
+#define STBI_NO_THREADS
+#define STBI__NO_THREADED_DECODER  // stbi_set_parallel_for is declared, but has nothing to do
+#endif
+
+#if (!defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP)) || !defined(STBI_NO_THREADS) || defined(STBI_STAGE_TIMING)
+#ifdef _WIN32
+   #ifndef WIN32_LEAN_AND_MEAN
+   #define WIN32_LEAN_AND_MEAN
+   #endif
+   #ifndef NOMINMAX
+   #define NOMINMAX
+   #endif
+   #include <windows.h>
+#else
+   #include <fcntl.h>
+   #include <sched.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <time.h>
+   #include <unistd.h>
+#endif
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -542,12 +834,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -587,6 +881,22 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL       __thread
+   #else
+      #define STBI_THREAD_LOCAL
+   #endif
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -667,6 +977,40 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels on top of the SSE2 ones, picked at run time. gcc and clang
+// need them tagged with the target, since the build itself is only SSE2.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && \
+    ((defined(_MSC_VER) && _MSC_VER >= 1700) || \
+     (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+     (!defined(__clang__) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7) return 0;
+   __cpuid(info,1);
+   // AVX, and the OS saving the ymm registers (OSXSAVE, then XCR0)
+   if (((info[2] >> 28) & 1) == 0 || ((info[2] >> 27) & 1) == 0) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+}
+#else
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   // checks the OS side too
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx2") != 0;
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -702,16 +1046,43 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller's output for stbi_load_into*, NULL when we allocate it
+   stbi_uc *out_user;
+   int out_stride, out_size;
+
+   // stbi_load_scaled*: decode JPEGs at 1/2^jpeg_scale size
+   int jpeg_scale;
+
+   // the process-wide settings, or the call's stbi_load_options
+   int flip, unpremultiply, de_iphone;
+   // the image's rows are bottom-up already, stbi__convert_format wrote them so
+   int flipped;
 } stbi__context;
 
 
 static void stbi__refill_buffer(stbi__context *s);
 
+static int stbi__vertically_flip_on_load = 0;
+static int stbi__unpremultiply_on_load = 0;
+static int stbi__de_iphone_flag = 0;
+
+static void stbi__start_settings(stbi__context *s)
+{
+   s->out_user = NULL;
+   s->jpeg_scale = 0;
+   s->flip = stbi__vertically_flip_on_load;
+   s->unpremultiply = stbi__unpremultiply_on_load;
+   s->de_iphone = stbi__de_iphone_flag;
+   s->flipped = 0;
+}
+
 // initialize a memory-decode context
 static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
    s->io.read = NULL;
    s->read_from_callbacks = 0;
+   stbi__start_settings(s);
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -723,6 +1094,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->io_user_data = user;
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
+   stbi__start_settings(s);
    s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -840,24 +1212,165 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// the parts of stbi_stage_times
+enum
+{
+   STBI__STAGE_decode,
+   STBI__STAGE_transform,
+   STBI__STAGE_convert,
+   STBI__STAGE_wait,
+   STBI__STAGE_read,
+   STBI__STAGES
+};
+
+#ifdef STBI_STAGE_TIMING
+// the stage a thread working on a timed call is in, since when, and what
+// it spent in the others
+typedef struct
+{
+   double spent[STBI__STAGES];
+   double since;
+   int stage;
+} stbi__stage_clock;
+#endif
+
+// where the errors and allocations of the call running on this thread go.
+// stbi__parallel points the threads running its tasks at the caller's
+typedef struct
+{
+   const stbi_allocator *allocator, *scratch;
+   const char *failure_reason;
+   // the settings below come from the call's options; calls without options
+   // (stbi__thread_call) use the process-wide ones
+   int from_options;
+   int simd_limit, fast_inflate;
+#ifndef STBI_NO_THREADS
+   stbi_parallel_for parallel_for;
+   void *parallel_user;
+   int parallel_threads;            // 1 without parallel_for
+#endif
+#ifdef STBI_STAGE_TIMING
+   stbi_stage_times *times;         // NULL if not timed
+   stbi__stage_clock clock, *saved_clock;
+   long times_lock;
+#endif
+} stbi__call;
+
+static STBI_THREAD_LOCAL stbi__call stbi__thread_call;  // calls without options
+static STBI_THREAD_LOCAL stbi__call *stbi__current_call;
+
+#ifdef STBI_STAGE_TIMING
+// the clock of the timed call or task running on this thread, if any
+static STBI_THREAD_LOCAL stbi__stage_clock *stbi__thread_clock;
+
+static double stbi__now(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER t, f;
+   QueryPerformanceCounter(&t);
+   QueryPerformanceFrequency(&f);
+   return (double) t.QuadPart / (double) f.QuadPart;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+#endif
+}
+
+static void stbi__clock_start(stbi__stage_clock *c)
+{
+   memset(c, 0, sizeof(*c));
+   c->stage = STBI__STAGE_decode;
+   c->since = stbi__now();
+}
+
+// put this thread in stage, returns the one to go back to after
+stbi_inline static int stbi__stage(int stage)
+{
+   stbi__stage_clock *c = stbi__thread_clock;
+   int prev;
+   double t;
+   if (!c) return stage;
+   t = stbi__now();
+   prev = c->stage;
+   c->spent[prev] += t - c->since;
+   c->since = t;
+   c->stage = stage;
+   return prev;
+}
+
+static void stbi__clock_stop(stbi__call *call, stbi__stage_clock *c);
+#else
+stbi_inline static int stbi__stage(int stage)
+{
+   return stage;
+}
+#endif
+
+static stbi__call *stbi__call_state(void)
+{
+   return stbi__current_call ? stbi__current_call : &stbi__thread_call;
+}
 
 STBIDEF const char *stbi_failure_reason(void)
 {
-   return stbi__g_failure_reason;
+   return stbi__thread_call.failure_reason;
 }
 
 static int stbi__err(const char *str)
 {
-   stbi__g_failure_reason = str;
+   stbi__call_state()->failure_reason = str;
    return 0;
 }
 
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+   const stbi_allocator *a = stbi__call_state()->allocator;
+   return a ? a->alloc(a->user, size) : STBI_MALLOC(size);
+}
+
+static void *stbi__realloc_sized(void *p, size_t old_size, size_t new_size)
+{
+   const stbi_allocator *a = stbi__call_state()->allocator;
+   STBI_NOTUSED(old_size);
+   return a ? a->realloc(a->user, p, old_size, new_size) : STBI_REALLOC_SIZED(p, old_size, new_size);
+}
+
+static void stbi__free(void *p)
+{
+   const stbi_allocator *a = stbi__call_state()->allocator;
+   if (a) {
+      if (p) a->free(a->user, p);
+   } else
+      STBI_FREE(p);
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// memory that's freed before the call returns, from the call's scratch
+// allocator if it has one
+static void *stbi__scratch_malloc(size_t size)
+{
+   const stbi_allocator *a = stbi__call_state()->scratch;
+   return a ? a->alloc(a->user, size) : stbi__malloc(size);
+}
+
+#ifndef STBI_NO_PNG
+static void *stbi__scratch_realloc_sized(void *p, size_t old_size, size_t new_size)
+{
+   const stbi_allocator *a = stbi__call_state()->scratch;
+   return a ? a->realloc(a->user, p, old_size, new_size) : stbi__realloc_sized(p, old_size, new_size);
+}
+#endif
+
+static void stbi__scratch_free(void *p)
+{
+   const stbi_allocator *a = stbi__call_state()->scratch;
+   if (a) {
+      if (p) a->free(a->user, p);
+   } else
+      stbi__free(p);
 }
+#endif
 
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
@@ -926,6 +1439,22 @@ static void *stbi__malloc_mad3(int a, int b, int c, int add)
    return stbi__malloc(a*b*c + add);
 }
 
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+static void *stbi__scratch_malloc_mad2(int a, int b, int add)
+{
+   if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
+   return stbi__scratch_malloc(a*b + add);
+}
+
+#ifndef STBI_NO_JPEG
+static void *stbi__scratch_malloc_mad3(int a, int b, int c, int add)
+{
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   return stbi__scratch_malloc(a*b*c + add);
+}
+#endif
+#endif
+
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
 static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 {
@@ -962,13 +1491,282 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
-
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
 }
 
+static int stbi__simd_limit = STBI_simd_avx2;
+static int stbi__zfast_inflate = 1;  // stbi_set_fast_inflate is with the zlib code
+
+STBIDEF void stbi_set_simd_limit(int limit)
+{
+   stbi__simd_limit = limit;
+}
+
+// the running call's instruction set limit and inflate
+#ifdef STBI_SSE2
+stbi_inline static int stbi__call_simd_limit(void)
+{
+   stbi__call *call = stbi__call_state();
+   return call->from_options ? call->simd_limit : stbi__simd_limit;
+}
+#endif
+
+stbi_inline static int stbi__call_fast_inflate(void)
+{
+   stbi__call *call = stbi__call_state();
+   return call->from_options ? call->fast_inflate : stbi__zfast_inflate;
+}
+
+#ifndef STBI_NO_THREADS
+static stbi_parallel_for stbi__parallel_for_func = NULL;
+static void *stbi__parallel_for_user = NULL;
+static int stbi__parallel_threads = 1;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for parallel_for, void *user, int threads)
+{
+   stbi__parallel_for_func = parallel_for;
+   stbi__parallel_for_user = user;
+   stbi__parallel_threads = parallel_for && threads > 1 ? threads : 1;
+}
+
+// the most tasks the running call may split its work into, 1 for none
+static int stbi__call_threads(void)
+{
+   stbi__call *call = stbi__call_state();
+   return call->from_options ? call->parallel_threads : stbi__parallel_threads;
+}
+
+typedef struct
+{
+   stbi_parallel_task task;
+   void *task_data;
+   stbi__call *call;
+} stbi__parallel_job;
+
+// a task on one of the caller's threads, allocating and failing as the call
+static void stbi__parallel_run(void *job_data, int index)
+{
+   stbi__parallel_job *job = (stbi__parallel_job *) job_data;
+   stbi__call *saved = stbi__current_call;
+#ifdef STBI_STAGE_TIMING
+   // a caller running tasks while it waits isn't waiting meanwhile
+   stbi__stage_clock clock, *saved_clock = stbi__thread_clock;
+   if (saved_clock) stbi__stage(saved_clock->stage);
+   stbi__thread_clock = NULL;
+   if (job->call->times) {
+      stbi__clock_start(&clock);
+      stbi__thread_clock = &clock;
+   }
+#endif
+   stbi__current_call = job->call;
+   job->task(job->task_data, index);
+   stbi__current_call = saved;
+#ifdef STBI_STAGE_TIMING
+   if (job->call->times) stbi__clock_stop(job->call, &clock);
+   stbi__thread_clock = saved_clock;
+   if (saved_clock) saved_clock->since = stbi__now();
+#endif
+}
+
+// run count tasks on the caller's threads, or one after the other here
+static void stbi__parallel(stbi_parallel_task task, void *task_data, int count)
+{
+   int i;
+   stbi__call *call = stbi__call_state();
+   stbi_parallel_for parallel_for = call->from_options ? call->parallel_for : stbi__parallel_for_func;
+   void *user = call->from_options ? call->parallel_user : stbi__parallel_for_user;
+   if (parallel_for && count > 1) {
+      stbi__parallel_job job;
+      int stage = stbi__stage(STBI__STAGE_wait);
+      job.task = task;
+      job.task_data = task_data;
+      job.call = call;
+      parallel_for(user, stbi__parallel_run, &job, count);
+      stbi__stage(stage);
+   } else
+      for (i=0; i < count; ++i)
+         task(task_data, i);
+}
+
+// counters shared between tasks. _add returns the old value
+typedef volatile long stbi__atomic;
+#ifdef _MSC_VER
+#define stbi__atomic_get(p)       _InterlockedCompareExchange((p), 0, 0)
+#define stbi__atomic_set(p,v)     _InterlockedExchange((p), (v))
+#define stbi__atomic_add(p,v)     _InterlockedExchangeAdd((p), (v))
+#define stbi__atomic_cas(p,o,n)   (_InterlockedCompareExchange((p), (n), (o)) == (o))
+#define stbi__yield()             SwitchToThread()
+#else
+#define stbi__atomic_get(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define stbi__atomic_set(p,v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define stbi__atomic_add(p,v)     __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define stbi__atomic_cas(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+#define stbi__yield()             sched_yield()
+#endif
+
+// a task with nothing it can do yet
+static void stbi__idle(void)
+{
+   int stage = stbi__stage(STBI__STAGE_wait);
+   stbi__yield();
+   stbi__stage(stage);
+}
+#endif // !STBI_NO_THREADS
+
+#ifdef STBI__NO_THREADED_DECODER
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for parallel_for, void *user, int threads)
+{
+   STBI_NOTUSED(parallel_for);
+   STBI_NOTUSED(user);
+   STBI_NOTUSED(threads);
+}
+#endif
+
+// stbi_arena: allocations are stacked up in the block, each behind a header
+// saying where the one under it starts. freeing the top one pops it and any
+// freed ones under it; the others wait for the top to go (all of a call's
+// scratch is freed by the time it returns, so the block is empty again).
+// what doesn't fit goes to STBI_MALLOC, on a list, and counts towards the
+// size the next reset gives the block
+typedef struct stbi__arena_chunk
+{
+   struct stbi__arena_chunk *next, *prev;  // prev == itself once freed, in the block
+   size_t size, below;                     // size with the header
+} stbi__arena_chunk;
+
+#ifndef STBI_NO_THREADS
+#define stbi__arena_lock(a)    while (!stbi__atomic_cas((stbi__atomic *) &(a)->lock, 0, 1)) stbi__yield()
+#define stbi__arena_unlock(a)  stbi__atomic_set((stbi__atomic *) &(a)->lock, 0)
+#else
+#define stbi__arena_lock(a)    ((void) 0)
+#define stbi__arena_unlock(a)  ((void) 0)
+#endif
+
+static int stbi__arena_owns(stbi_arena *a, stbi__arena_chunk *c)
+{
+   return (unsigned char *) c >= a->block && (unsigned char *) c < a->block + a->size;
+}
+
+static void *stbi__arena_alloc(void *user, size_t size)
+{
+   stbi_arena *a = (stbi_arena *) user;
+   stbi__arena_chunk *c;
+   size_t need = sizeof(stbi__arena_chunk) + ((size + 15) & ~(size_t) 15);
+   if (need < size) return NULL;
+   stbi__arena_lock(a);
+   if (a->size - a->used >= need) {
+      c = (stbi__arena_chunk *) (a->block + a->used);
+      c->next = NULL;
+      c->below = a->top;
+      a->top = a->used;
+      a->used += need;
+   } else {
+      c = (stbi__arena_chunk *) STBI_MALLOC(need);
+      if (!c) { stbi__arena_unlock(a); return NULL; }
+      c->next = (stbi__arena_chunk *) a->overflow;
+      if (c->next) c->next->prev = c;
+      a->overflow = c;
+      a->overflow_bytes += need;
+   }
+   c->prev = NULL;
+   c->size = need;
+   if (a->used + a->overflow_bytes > a->peak) a->peak = a->used + a->overflow_bytes;
+   stbi__arena_unlock(a);
+   return c + 1;
+}
+
+static void stbi__arena_release(stbi_arena *a, stbi__arena_chunk *c)
+{
+   if (stbi__arena_owns(a, c)) {
+      c->prev = c;
+      while (a->used) {
+         stbi__arena_chunk *t = (stbi__arena_chunk *) (a->block + a->top);
+         if (t->prev != t) break;
+         a->used = a->top;
+         a->top = t->below;
+      }
+   } else {
+      if (c->prev) c->prev->next = c->next;
+      else a->overflow = c->next;
+      if (c->next) c->next->prev = c->prev;
+      a->overflow_bytes -= c->size;
+      STBI_FREE(c);
+   }
+}
+
+static void stbi__arena_free(void *user, void *p)
+{
+   stbi_arena *a = (stbi_arena *) user;
+   stbi__arena_lock(a);
+   stbi__arena_release(a, (stbi__arena_chunk *) p - 1);
+   stbi__arena_unlock(a);
+}
+
+static void *stbi__arena_realloc(void *user, void *p, size_t old_size, size_t new_size)
+{
+   stbi_arena *a = (stbi_arena *) user;
+   stbi__arena_chunk *c;
+   size_t need = sizeof(stbi__arena_chunk) + ((new_size + 15) & ~(size_t) 15);
+   void *q;
+   if (!p) return stbi__arena_alloc(user, new_size);
+   c = (stbi__arena_chunk *) p - 1;
+   stbi__arena_lock(a);
+   // the top one grows where it is
+   if (need >= new_size && stbi__arena_owns(a, c) && (unsigned char *) c == a->block + a->top && a->size - a->top >= need) {
+      c->size = need;
+      a->used = a->top + need;
+      if (a->used + a->overflow_bytes > a->peak) a->peak = a->used + a->overflow_bytes;
+      stbi__arena_unlock(a);
+      return p;
+   }
+   stbi__arena_unlock(a);
+   q = stbi__arena_alloc(user, new_size);
+   if (!q) return NULL;
+   memcpy(q, p, old_size < new_size ? old_size : new_size);
+   stbi__arena_free(user, p);
+   return q;
+}
+
+STBIDEF void stbi_arena_init(stbi_arena *arena, size_t size)
+{
+   memset(arena, 0, sizeof(*arena));
+   arena->allocator.alloc = stbi__arena_alloc;
+   arena->allocator.realloc = stbi__arena_realloc;
+   arena->allocator.free = stbi__arena_free;
+   arena->allocator.user = arena;
+   if (size) {
+      arena->block = (unsigned char *) STBI_MALLOC(size);
+      if (arena->block) arena->size = size;
+   }
+}
+
+STBIDEF void stbi_arena_reset(stbi_arena *arena)
+{
+   while (arena->overflow) {
+      stbi__arena_chunk *c = (stbi__arena_chunk *) arena->overflow;
+      arena->overflow = c->next;
+      STBI_FREE(c);
+   }
+   if (arena->peak > arena->size) {
+      // rounded up, so a slightly bigger image next doesn't grow it again
+      size_t size = (arena->peak + 65535) & ~(size_t) 65535;
+      STBI_FREE(arena->block);
+      arena->block = (unsigned char *) STBI_MALLOC(size);
+      arena->size = arena->block ? size : 0;
+   }
+   arena->used = arena->top = arena->overflow_bytes = arena->peak = 0;
+}
+
+STBIDEF void stbi_arena_free(stbi_arena *arena)
+{
+   stbi_arena_reset(arena);
+   STBI_FREE(arena->block);
+   arena->block = NULL;
+   arena->size = 0;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -979,6 +1777,8 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #ifndef STBI_NO_JPEG
    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
    #endif
+   // no other decoder can skip the detail it isn't going to output
+   if (s->jpeg_scale) return stbi__errpuc("not JPEG", "Scaled decoding is for JPEGs only");
    #ifndef STBI_NO_PNG
    if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
    #endif
@@ -1016,39 +1816,43 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
 
 static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
 {
-   int i;
+   int i, stage;
    int img_len = w * h * channels;
    stbi_uc *reduced;
 
    reduced = (stbi_uc *) stbi__malloc(img_len);
    if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
 
+   stage = stbi__stage(STBI__STAGE_convert);
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
+   stbi__stage(stage);
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
 static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int channels)
 {
-   int i;
+   int i, stage;
    int img_len = w * h * channels;
    stbi__uint16 *enlarged;
 
    enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
    if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
 
+   stage = stbi__stage(STBI__STAGE_convert);
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
+   stbi__stage(stage);
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
 static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
 {
-   int row;
+   int row, stage = stbi__stage(STBI__STAGE_convert);
    size_t bytes_per_row = (size_t)w * bytes_per_pixel;
    stbi_uc temp[2048];
    stbi_uc *bytes = (stbi_uc *)image;
@@ -1068,6 +1872,7 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
          bytes_left -= bytes_copy;
       }
    }
+   stbi__stage(stage);
 }
 
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
@@ -1098,7 +1903,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !s->flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1123,7 +1928,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip && !s->flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1131,24 +1936,179 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    return (stbi__uint16 *) result;
 }
 
-#if !defined(STBI_NO_HDR) || !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+// whether a w*h image of n channels fits the caller's output
+static int stbi__user_output_fits(stbi__context *s, int w, int h, int n)
 {
-   if (stbi__vertically_flip_on_load && result != NULL) {
-      int channels = req_comp ? req_comp : *comp;
-      stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
-   }
+   if (s->out_stride < w * n || (size_t) s->out_stride * (h - 1) + (size_t) w * n > (size_t) s->out_size)
+      return stbi__err("output too small", "Output buffer too small for image");
+   return 1;
 }
-#endif
 
-#ifndef STBI_NO_STDIO
+// where row y of an image of h rows goes, in the caller's output or in our
+// own tightly packed one; bottom-up if the image is to be flipped, so
+// decoders writing through this don't need the extra pass
+static stbi_uc *stbi__output_row(stbi__context *s, stbi_uc *output, int row_bytes, int y, int h)
+{
+   if (s->flip && !s->flipped) y = h - 1 - y;
+   if (output != s->out_user)
+      return output + (size_t) row_bytes * y;
+   return output + (size_t) s->out_stride * y;
+}
 
-static FILE *stbi__fopen(char const *filename, char const *mode)
+static int stbi__load_into_main(stbi__context *s, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f;
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-   if (0 != fopen_s(&f, filename, mode))
-      f=0;
+   stbi__result_info ri;
+   void *result;
+   int w, h, n, file_comp, row, stage;
+
+   if (!output || output_stride <= 0 || output_size <= 0) return stbi__err("bad output", "No output buffer");
+   s->out_user = output;
+   s->out_stride = output_stride;
+   s->out_size = output_size;
+   result = stbi__load_main(s, &w, &h, &file_comp, req_comp, &ri, 8);
+   if (result == NULL)
+      return 0;
+
+   // decoders that can write rows straight to s->out_user return it, the
+   // rest allocated the image themselves
+   if (result != output) {
+      n = req_comp ? req_comp : file_comp;
+      if (ri.bits_per_channel != 8) {
+         result = stbi__convert_16_to_8((stbi__uint16 *) result, w, h, n);
+         if (result == NULL) return 0;
+      }
+      if (!stbi__user_output_fits(s, w, h, n)) {
+         stbi__free(result);
+         return 0;
+      }
+      stage = stbi__stage(STBI__STAGE_convert);
+      for (row = 0; row < h; ++row)
+         memcpy(stbi__output_row(s, output, w * n, row, h), (stbi_uc *) result + (size_t) w * n * row, (size_t) w * n);
+      stbi__stage(stage);
+      stbi__free(result);
+   }
+   *x = w;
+   *y = h;
+   if (comp) *comp = file_comp;
+   return 1;
+}
+
+STBIDEF void stbi_load_options_init(stbi_load_options *opt)
+{
+   memset(opt, 0, sizeof(*opt));
+   opt->flip_vertically = stbi__vertically_flip_on_load;
+   opt->unpremultiply = stbi__unpremultiply_on_load;
+   opt->convert_iphone_png_to_rgb = stbi__de_iphone_flag;
+   opt->simd_limit = stbi__simd_limit;
+   opt->fast_inflate = stbi__zfast_inflate;
+#ifndef STBI_NO_THREADS
+   opt->parallel_for = stbi__parallel_for_func;
+   opt->parallel_user = stbi__parallel_for_user;
+   opt->parallel_threads = stbi__parallel_threads;
+#endif
+}
+
+#ifdef STBI_STAGE_TIMING
+// add what c counted to the call's times; tasks finish at the same time
+static void stbi__clock_stop(stbi__call *call, stbi__stage_clock *c)
+{
+   stbi_stage_times *t = call->times;
+   c->spent[c->stage] += stbi__now() - c->since;
+#ifndef STBI_NO_THREADS
+   while (!stbi__atomic_cas((stbi__atomic *) &call->times_lock, 0, 1)) stbi__yield();
+#endif
+   t->decode    += c->spent[STBI__STAGE_decode];
+   t->transform += c->spent[STBI__STAGE_transform];
+   t->convert   += c->spent[STBI__STAGE_convert];
+   t->wait      += c->spent[STBI__STAGE_wait];
+   t->read      += c->spent[STBI__STAGE_read];
+#ifndef STBI_NO_THREADS
+   stbi__atomic_set((stbi__atomic *) &call->times_lock, 0);
+#endif
+}
+#endif
+
+// the _ex functions: allocations and errors on this thread (and on the
+// threads running the call's tasks) go to call until stbi__end_call
+static stbi__call *stbi__begin_call(stbi__call *call, stbi_load_options *opt)
+{
+   stbi__call *saved = stbi__current_call;
+   call->allocator = opt->allocator;
+   call->scratch = opt->scratch;
+   call->failure_reason = NULL;
+   call->from_options = 1;
+   call->simd_limit = opt->simd_limit;
+   call->fast_inflate = opt->fast_inflate;
+#ifndef STBI_NO_THREADS
+   call->parallel_for = opt->parallel_for;
+   call->parallel_user = opt->parallel_user;
+   call->parallel_threads = opt->parallel_for && opt->parallel_threads > 1 ? opt->parallel_threads : 1;
+#endif
+#ifdef STBI_STAGE_TIMING
+   call->times = opt->stage_times;
+   call->times_lock = 0;
+   call->saved_clock = stbi__thread_clock;
+   stbi__thread_clock = NULL;
+   if (call->times) {
+      stbi__clock_start(&call->clock);
+      stbi__thread_clock = &call->clock;
+   }
+#endif
+   stbi__current_call = call;
+   return saved;
+}
+
+static int stbi__end_call(stbi__call *call, stbi__call *saved, stbi_load_options *opt, int ok)
+{
+   stbi__current_call = saved;
+#ifdef STBI_STAGE_TIMING
+   if (call->times) stbi__clock_stop(call, &call->clock);
+   stbi__thread_clock = call->saved_clock;
+#endif
+   opt->failure_reason = ok ? NULL : call->failure_reason;
+   return ok;
+}
+
+static int stbi__apply_options(stbi__context *s, stbi_load_options *opt)
+{
+   if (opt->scale_log2 < 0 || opt->scale_log2 > 3) return stbi__err("bad scale", "Scale must be 0 to 3");
+   s->jpeg_scale = opt->scale_log2;
+   s->flip = opt->flip_vertically;
+   s->unpremultiply = opt->unpremultiply;
+   s->de_iphone = opt->convert_iphone_png_to_rgb;
+   return 1;
+}
+
+static stbi_uc *stbi__load_ex_main(stbi__context *s, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   if (!stbi__apply_options(s, opt)) return NULL;
+   return stbi__load_and_postprocess_8bit(s, x, y, comp, opt->desired_channels);
+}
+
+static int stbi__load_into_ex_main(stbi__context *s, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   if (!stbi__apply_options(s, opt)) return 0;
+   return stbi__load_into_main(s, output, output_stride, output_size, x, y, comp, opt->desired_channels);
+}
+
+#if !defined(STBI_NO_HDR) || !defined(STBI_NO_LINEAR)
+static void stbi__float_postprocess(stbi__context *s, float *result, int *x, int *y, int *comp, int req_comp)
+{
+   if (s->flip && result != NULL) {
+      int channels = req_comp ? req_comp : *comp;
+      stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
+   }
+}
+#endif
+
+#ifndef STBI_NO_STDIO
+
+static FILE *stbi__fopen(char const *filename, char const *mode)
+{
+   FILE *f;
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+   if (0 != fopen_s(&f, filename, mode))
+      f=0;
 #else
    f = fopen(filename, mode);
 #endif
@@ -1202,6 +2162,222 @@ STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, i
    return result;
 }
 
+#ifndef STBI_NO_MMAP
+// a read-only view of a whole file
+typedef struct
+{
+   stbi_uc *data;
+   size_t size;
+#ifdef _WIN32
+   HANDLE mapping;
+#endif
+} stbi__mapped_file;
+
+// returns 0 without setting an error if the file can't be mapped, callers
+// then go through stdio, which reports the real problem if there is one
+static int stbi__map_file(stbi__mapped_file *m, char const *filename)
+{
+#ifdef _WIN32
+   HANDLE file;
+   LARGE_INTEGER size;
+   file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (file == INVALID_HANDLE_VALUE) return 0;
+   if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || size.QuadPart > INT_MAX) {
+      CloseHandle(file);
+      return 0;
+   }
+   m->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   CloseHandle(file); // the mapping keeps its own reference
+   if (!m->mapping) return 0;
+   m->data = (stbi_uc *) MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+   if (!m->data) {
+      CloseHandle(m->mapping);
+      return 0;
+   }
+   m->size = (size_t) size.QuadPart;
+   return 1;
+#else
+   struct stat st;
+   void *data;
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) return 0;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+      close(fd);
+      return 0;
+   }
+   data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd); // so does the mapping
+   if (data == MAP_FAILED) return 0;
+   // every decoder reads front to back, let the kernel read ahead
+   posix_madvise(data, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+   m->data = (stbi_uc *) data;
+   m->size = (size_t) st.st_size;
+   return 1;
+#endif
+}
+
+static void stbi__unmap_file(stbi__mapped_file *m)
+{
+#ifdef _WIN32
+   UnmapViewOfFile(m->data);
+   CloseHandle(m->mapping);
+#else
+   munmap(m->data, m->size);
+#endif
+}
+
+STBIDEF stbi_uc *stbi_load_mapped(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__mapped_file m;
+   stbi__context s;
+   unsigned char *result;
+   if (!stbi__map_file(&m, filename))
+      return stbi_load(filename,x,y,comp,req_comp);
+   stbi__start_mem(&s,m.data,(int) m.size);
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   stbi__unmap_file(&m);
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16_mapped(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__mapped_file m;
+   stbi__context s;
+   stbi__uint16 *result;
+   if (!stbi__map_file(&m, filename))
+      return stbi_load_16(filename,x,y,comp,req_comp);
+   stbi__start_mem(&s,m.data,(int) m.size);
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   stbi__unmap_file(&m);
+   return result;
+}
+#endif // !STBI_NO_MMAP
+
+static int stbi__load_into_file(char const *filename, int scale_log2, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   FILE *f;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      stbi__start_mem(&s,m.data,(int) m.size);
+      s.jpeg_scale = scale_log2;
+      result = stbi__load_into_main(&s,output,output_stride,output_size,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.jpeg_scale = scale_log2;
+   result = stbi__load_into_main(&s,output,output_stride,output_size,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi__load_into_file(filename, 0, output, output_stride, output_size, x, y, comp, req_comp);
+}
+
+STBIDEF int stbi_load_into_scaled(char const *filename, int scale_log2, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
+{
+   if (scale_log2 < 0 || scale_log2 > 3) return stbi__err("bad scale", "Scale must be 0 to 3");
+   return stbi__load_into_file(filename, scale_log2, output, output_stride, output_size, x, y, comp, req_comp);
+}
+
+// a context reading a whole file, from a mapping of it when it can be mapped
+typedef struct
+{
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   int mapped;
+#endif
+   FILE *f;
+} stbi__file_source;
+
+static int stbi__start_filename(stbi__context *s, stbi__file_source *src, char const *filename)
+{
+#ifndef STBI_NO_MMAP
+   src->mapped = stbi__map_file(&src->m, filename);
+   if (src->mapped) {
+      stbi__start_mem(s, src->m.data, (int) src->m.size);
+      return 1;
+   }
+#endif
+   src->f = stbi__fopen(filename, "rb");
+   if (!src->f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(s, src->f);
+   return 1;
+}
+
+static void stbi__end_filename(stbi__file_source *src)
+{
+#ifndef STBI_NO_MMAP
+   if (src->mapped) {
+      stbi__unmap_file(&src->m);
+      return;
+   }
+#endif
+   fclose(src->f);
+}
+
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int scale_log2, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   FILE *f;
+   unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+#endif
+   if (scale_log2 < 0 || scale_log2 > 3) return stbi__errpuc("bad scale", "Scale must be 0 to 3");
+#ifndef STBI_NO_MMAP
+   if (stbi__map_file(&m, filename)) {
+      stbi__start_mem(&s,m.data,(int) m.size);
+      s.jpeg_scale = scale_log2;
+      result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.jpeg_scale = scale_log2;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   stbi__call call, *saved = stbi__begin_call(&call, opt);
+   stbi__file_source src;
+   stbi__context s;
+   stbi_uc *result = NULL;
+   if (stbi__start_filename(&s, &src, filename)) {
+      result = stbi__load_ex_main(&s, x, y, comp, opt);
+      stbi__end_filename(&src);
+   }
+   stbi__end_call(&call, saved, opt, result != NULL);
+   return result;
+}
+
+STBIDEF int stbi_load_into_ex(char const *filename, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   stbi__call call, *saved = stbi__begin_call(&call, opt);
+   stbi__file_source src;
+   stbi__context s;
+   int result = 0;
+   if (stbi__start_filename(&s, &src, filename)) {
+      result = stbi__load_into_ex_main(&s, output, output_stride, output_size, x, y, comp, opt);
+      stbi__end_filename(&src);
+   }
+   return stbi__end_call(&call, saved, opt, result);
+}
+
 
 #endif //!STBI_NO_STDIO
 
@@ -1233,6 +2409,48 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int scale_log2, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   if (scale_log2 < 0 || scale_log2 > 3) return stbi__errpuc("bad scale", "Scale must be 0 to 3");
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg_scale = scale_log2;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into_main(&s,output,output_stride,output_size,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into_main(&s,output,output_stride,output_size,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   stbi__call call, *saved = stbi__begin_call(&call, opt);
+   stbi__context s;
+   stbi_uc *result;
+   stbi__start_mem(&s,buffer,len);
+   result = stbi__load_ex_main(&s, x, y, comp, opt);
+   stbi__end_call(&call, saved, opt, result != NULL);
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_memory_ex(stbi_uc const *buffer, int len, stbi_uc *output, int output_stride, int output_size, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   stbi__call call, *saved = stbi__begin_call(&call, opt);
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__end_call(&call, saved, opt, stbi__load_into_ex_main(&s, output, output_stride, output_size, x, y, comp, opt));
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1241,7 +2459,7 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
    stbi__start_mem(&s,buffer,len); 
    
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
+   if (s.flip) {
       stbi__vertical_flip_slices( result, *x, *y, *z, *comp ); 
    }
 
@@ -1258,7 +2476,7 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
       stbi__result_info ri;
       float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
       if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
+         stbi__float_postprocess(s,hdr_data,x,y,comp,req_comp);
       return hdr_data;
    }
    #endif
@@ -1389,7 +2607,9 @@ enum
 
 static void stbi__refill_buffer(stbi__context *s)
 {
+   int stage = stbi__stage(STBI__STAGE_read);
    int n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
+   stbi__stage(stage);
    if (n == 0) {
       // at end of file, treat same as if from memory, but need to handle case
       // where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
@@ -1448,11 +2668,13 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
    if (s->io.read) {
       int blen = (int) (s->img_buffer_end - s->img_buffer);
       if (blen < n) {
-         int res, count;
+         int res, count, stage;
 
          memcpy(buffer, s->img_buffer, blen);
 
+         stage = stbi__stage(STBI__STAGE_read);
          count = (s->io.read)(s->io_user_data, (char*) buffer + blen, n - blen);
+         stbi__stage(stage);
          res = (count == (n-blen));
          s->img_buffer = s->img_buffer_end;
          return res;
@@ -1510,32 +2732,145 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 //
 //  assume data buffer is malloced, so malloc a new one and free that one
 //  only failure mode is malloc failing
+//
+//  when s asks for the image flipped, the rows are written bottom-up as they
+//  are converted and s->flipped tells the caller not to flip them again
 
 static stbi_uc stbi__compute_y(int r, int g, int b)
 {
    return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
-static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+#ifdef STBI_SSE2
+#ifdef STBI_AVX2
+// 8 pixels at a time, one 128-bit lane's worth of shuffle per 4
+STBI__AVX2_TARGET
+static int stbi__convert_row_avx2(stbi_uc *dest, const stbi_uc *src, int x, int img_n, int req_comp)
 {
-   int i,j;
+   __m256i alpha = _mm256_set1_epi32((int) 0xff000000u);
+   int i = 0;
+   if (img_n == 1 && req_comp == 4) {
+      for (; i + 8 <= x; i += 8) {
+         __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i)));
+         g = _mm256_or_si256(g, _mm256_slli_epi32(g, 8));
+         g = _mm256_or_si256(g, _mm256_slli_epi32(g, 16));
+         _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(g, alpha));
+      }
+   } else if (img_n == 3 && req_comp == 4) {
+      __m256i shuf = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                      0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+      // the second load reads 4 bytes past the 24 it uses
+      for (; i + 10 <= x; i += 8) {
+         __m128i lo = _mm_loadu_si128((const __m128i *) (src + i*3));
+         __m128i hi = _mm_loadu_si128((const __m128i *) (src + i*3 + 12));
+         __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+         _mm256_storeu_si256((__m256i *) (dest + i*4), _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha));
+      }
+   } else if (img_n == 4 && req_comp == 3) {
+      __m256i shuf = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                      0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      __m256i pack = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+      // the store writes 8 bytes past the 24 it fills, the next one overwrites them
+      for (; i + 11 <= x; i += 8) {
+         __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (src + i*4)), shuf);
+         _mm256_storeu_si256((__m256i *) (dest + i*3), _mm256_permutevar8x32_epi32(v, pack));
+      }
+   }
+   return i;
+}
+#endif
+
+// the conversions every texture goes through, RGB<->RGBA and grey to RGBA;
+// returns how many pixels of the row it did, the generic loop does the rest
+static int stbi__convert_row_simd(stbi_uc *dest, const stbi_uc *src, int x, int img_n, int req_comp, int avx2)
+{
+   __m128i alpha = _mm_set1_epi32((int) 0xff000000u);
+   int i = 0;
+#ifdef STBI_AVX2
+   if (avx2)
+      i = stbi__convert_row_avx2(dest, src, x, img_n, req_comp);
+#else
+   STBI_NOTUSED(avx2);
+#endif
+   if (img_n == 1 && req_comp == 4) {
+      __m128i ones = _mm_set1_epi8(-1);
+      for (; i + 16 <= x; i += 16) {
+         __m128i g = _mm_loadu_si128((const __m128i *) (src + i));
+         __m128i gg = _mm_unpacklo_epi8(g, g), ga = _mm_unpacklo_epi8(g, ones);
+         _mm_storeu_si128((__m128i *) (dest + i*4),      _mm_unpacklo_epi16(gg, ga));
+         _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpackhi_epi16(gg, ga));
+         gg = _mm_unpackhi_epi8(g, g);
+         ga = _mm_unpackhi_epi8(g, ones);
+         _mm_storeu_si128((__m128i *) (dest + i*4 + 32), _mm_unpacklo_epi16(gg, ga));
+         _mm_storeu_si128((__m128i *) (dest + i*4 + 48), _mm_unpackhi_epi16(gg, ga));
+      }
+   } else if (img_n == 3 && req_comp == 4) {
+      // pixel k of 4 is k bytes short of its place in the output, shift each
+      // into its dword. the load reads 4 bytes past the 12 it uses
+      __m128i m0 = _mm_setr_epi32(0x00ffffff, 0, 0, 0), m1 = _mm_slli_si128(m0, 4);
+      __m128i m2 = _mm_slli_si128(m0, 8), m3 = _mm_slli_si128(m0, 12);
+      for (; i + 6 <= x; i += 4) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (src + i*3));
+         __m128i o = _mm_and_si128(v, m0);
+         o = _mm_or_si128(o, _mm_and_si128(_mm_slli_si128(v, 1), m1));
+         o = _mm_or_si128(o, _mm_and_si128(_mm_slli_si128(v, 2), m2));
+         o = _mm_or_si128(o, _mm_and_si128(_mm_slli_si128(v, 3), m3));
+         _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(o, alpha));
+      }
+   } else if (img_n == 4 && req_comp == 3) {
+      // the other way; the store writes 4 bytes past the 12 it fills
+      __m128i m0 = _mm_setr_epi32(0x00ffffff, 0, 0, 0), m1 = _mm_slli_si128(m0, 4);
+      __m128i m2 = _mm_slli_si128(m0, 8), m3 = _mm_slli_si128(m0, 12);
+      for (; i + 6 <= x; i += 4) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (src + i*4));
+         __m128i o = _mm_and_si128(v, m0);
+         o = _mm_or_si128(o, _mm_srli_si128(_mm_and_si128(v, m1), 1));
+         o = _mm_or_si128(o, _mm_srli_si128(_mm_and_si128(v, m2), 2));
+         o = _mm_or_si128(o, _mm_srli_si128(_mm_and_si128(v, m3), 3));
+         _mm_storeu_si128((__m128i *) (dest + i*3), o);
+      }
+   }
+   return i;
+}
+#endif
+
+static unsigned char *stbi__convert_format(stbi__context *s, unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+{
+   int i,j,done = 0,stage;
+   int flip = s && s->flip && !s->flipped;
    unsigned char *good;
+#ifdef STBI_SSE2
+   int simd = stbi__call_simd_limit() >= STBI_simd_sse2 && stbi__sse2_available();
+   int avx2 = 0;
+#ifdef STBI_AVX2
+   avx2 = simd && stbi__call_simd_limit() >= STBI_simd_avx2 && stbi__avx2_available();
+#endif
+#endif
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
+   stage = stbi__stage(STBI__STAGE_convert);
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
+      unsigned char *dest = good + (flip ? y-1-j : (stbi__uint32) j) * x * req_comp;
+
+#ifdef STBI_SSE2
+      if (simd) {
+         done = stbi__convert_row_simd(dest, src, x, img_n, req_comp, avx2);
+         src += done * img_n;
+         dest += done * req_comp;
+      }
+#endif
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1-done; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1555,8 +2890,10 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       }
       #undef STBI__CASE
    }
+   stbi__stage(stage);
 
-   STBI_FREE(data);
+   stbi__free(data);
+   if (flip) s->flipped = 1;
    return good;
 }
 
@@ -1565,9 +2902,10 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
    return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
-static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
+static stbi__uint16 *stbi__convert_format16(stbi__context *s, stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int i,j,stage;
+   int flip = s && s->flip && !s->flipped;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1575,13 +2913,14 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
+   stage = stbi__stage(STBI__STAGE_convert);
    for (j=0; j < (int) y; ++j) {
       stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
+      stbi__uint16 *dest = good + (flip ? y-1-j : (stbi__uint32) j) * x * req_comp;
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
       #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
@@ -1604,19 +2943,22 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
       }
       #undef STBI__CASE
    }
+   stbi__stage(stage);
 
-   STBI_FREE(data);
+   stbi__free(data);
+   if (flip) s->flipped = 1;
    return good;
 }
 
 #ifndef STBI_NO_LINEAR
 static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
-   int i,k,n;
+   int i,k,n,stage;
    float *output;
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   stage = stbi__stage(STBI__STAGE_convert);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1625,7 +2967,8 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
       }
       if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
    }
-   STBI_FREE(data);
+   stbi__stage(stage);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1634,11 +2977,12 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 #define stbi__float2int(x)   ((int) (x))
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 {
-   int i,k,n;
+   int i,k,n,stage;
    stbi_uc *output;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   stage = stbi__stage(STBI__STAGE_convert);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1655,7 +2999,8 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__stage(stage);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1710,6 +3055,10 @@ typedef struct
    int img_mcu_x, img_mcu_y;
    int img_mcu_w, img_mcu_h;
 
+// scaled decodes (see stbi_load_scaled): output at 1/2^scale size
+   int scale;
+   stbi__uint32 out_w, out_h;
+
 // definition of jpeg image component
    struct
    {
@@ -1720,6 +3069,10 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      // subsampled components of a scaled decode are scaled down less, up
+      // to not at all, so each block makes idct_size x idct_size pixels
+      int scale, idct_size;
+      void (*idct)(stbi_uc *out, int out_stride, short data[64]);
       stbi_uc *data;
       void *raw_data, *raw_coeff;
       stbi_uc *linebuf;
@@ -1747,8 +3100,15 @@ typedef struct
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   // two blocks at once if there's a kernel for it, see stbi__jpeg_idct_queue
+   void (*idct_pair_kernel)(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+
+// output, set up by stbi__jpeg_alloc_output
+   int req_comp, out_n, decode_n, is_rgb;
+   stbi_uc *output;
+   int converted;   // output already filled in while decoding the scan
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -2260,6 +3620,99 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced size IDCTs for scaled decodes, derived from jidctred: the 4x4, 2x2
+// and 1x1 pixels that the low frequencies of the block make at that size.
+// 13 bit constants, columns keep 2 extra bits like stbi__idct_block
+#define stbi__f2r(x)  ((int) (((x) * 8192 + 0.5)))
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[32],*v=val;
+   stbi_uc *o;
+   short *d = data;
+
+   // columns, only rows 0..3 of the output; column 4 doesn't contribute
+   for (i=0; i < 8; ++i,++d,++v) {
+      int t0,t2,t10,t12;
+      if (i == 4) continue;
+      if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[40]==0 && d[48]==0 && d[56]==0) {
+         v[0] = v[8] = v[16] = v[24] = d[0]*4;
+         continue;
+      }
+      t0  = d[0] * (1 << 14);
+      t2  = d[16]*stbi__f2r(1.847759065f) - d[48]*stbi__f2r(0.765366865f);
+      t10 = t0 + t2 + 2048;
+      t12 = t0 - t2 + 2048;
+      t0  = - d[56]*stbi__f2r(0.211164243f) + d[40]*stbi__f2r(1.451774981f)
+            - d[24]*stbi__f2r(2.172734803f) + d[ 8]*stbi__f2r(1.061594337f);
+      t2  = - d[56]*stbi__f2r(0.509795579f) - d[40]*stbi__f2r(0.601344887f)
+            + d[24]*stbi__f2r(0.899976223f) + d[ 8]*stbi__f2r(2.562915447f);
+      v[ 0] = (t10+t2) >> 12;
+      v[24] = (t10-t2) >> 12;
+      v[ 8] = (t12+t0) >> 12;
+      v[16] = (t12-t0) >> 12;
+   }
+
+   for (i=0, v=val, o=out; i < 4; ++i,v+=8,o+=out_stride) {
+      int t0,t2,t10,t12;
+      // 13 bits of constants, 1 more for the 4 point transform, 2 from the
+      // columns and 3 for the two sqrt(8)s: round and add 128 before the shift
+      t0  = v[0] * (1 << 14);
+      t2  = v[2]*stbi__f2r(1.847759065f) - v[6]*stbi__f2r(0.765366865f);
+      t10 = t0 + t2 + (1 << 18) + (128 << 19);
+      t12 = t0 - t2 + (1 << 18) + (128 << 19);
+      t0  = - v[7]*stbi__f2r(0.211164243f) + v[5]*stbi__f2r(1.451774981f)
+            - v[3]*stbi__f2r(2.172734803f) + v[1]*stbi__f2r(1.061594337f);
+      t2  = - v[7]*stbi__f2r(0.509795579f) - v[5]*stbi__f2r(0.601344887f)
+            + v[3]*stbi__f2r(0.899976223f) + v[1]*stbi__f2r(2.562915447f);
+      o[0] = stbi__clamp((t10+t2) >> 19);
+      o[3] = stbi__clamp((t10-t2) >> 19);
+      o[1] = stbi__clamp((t12+t0) >> 19);
+      o[2] = stbi__clamp((t12-t0) >> 19);
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   stbi_uc *o;
+   short *d = data;
+
+   // columns, only rows 0..1 of the output; columns 2, 4, 6 don't contribute
+   for (i=0; i < 8; ++i,++d,++v) {
+      int t0,t10;
+      if (i == 2 || i == 4 || i == 6) continue;
+      if (d[ 8]==0 && d[24]==0 && d[40]==0 && d[56]==0) {
+         v[0] = v[8] = d[0]*4;
+         continue;
+      }
+      t10 = d[0] * (1 << 15) + 4096;
+      t0  = - d[56]*stbi__f2r(0.720959822f) + d[40]*stbi__f2r(0.850430095f)
+            - d[24]*stbi__f2r(1.272758580f) + d[ 8]*stbi__f2r(3.624509785f);
+      v[0] = (t10+t0) >> 13;
+      v[8] = (t10-t0) >> 13;
+   }
+
+   for (i=0, v=val, o=out; i < 2; ++i,v+=8,o+=out_stride) {
+      int t0,t10;
+      t10 = v[0] * (1 << 15) + (1 << 19) + (128 << 20);
+      t0  = - v[7]*stbi__f2r(0.720959822f) + v[5]*stbi__f2r(0.850430095f)
+            - v[3]*stbi__f2r(1.272758580f) + v[1]*stbi__f2r(3.624509785f);
+      o[0] = stbi__clamp((t10+t0) >> 20);
+      o[1] = stbi__clamp((t10-t0) >> 20);
+   }
+}
+
+// the block's average, which is all the DC coefficient is
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+// by how much they scale down, less one
+static void (* const stbi__idct_reduced[3])(stbi_uc *out, int out_stride, short data[64]) = { stbi__idct_4x4, stbi__idct_2x2, stbi__idct_1x1 };
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2441,30 +3894,219 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
-#ifdef STBI_NEON
-
-// NEON integer IDCT. should produce bit-identical
-// results to the generic C version.
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+#ifdef STBI_AVX2
+// the sse2 IDCT on two blocks at once, one in each 128-bit half: every AVX2
+// instruction it needs works on the halves separately, so each block gets
+// exactly what stbi__idct_simd (and the generic version) would give it.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1)
 {
-   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
 
-   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
-   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
-   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
-   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
-   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
-   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
-   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
-   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
-   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
-   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
-   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
-   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_set1_epi32((int) (((unsigned int) (y) << 16) | ((x) & 0xffff)))
 
-#define dct_long_mul(out, inq, coeff) \
-   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load, block 0 in the low half and block 1 in the high one
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data0 + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data1 + (k)*8)), 1)
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose, same steps as stbi__idct_simd
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // store two rows of one block from a 128-bit half
+      #define dct_store2(out, stride, v) \
+         { \
+            __m128i half = (v); \
+            _mm_storel_epi64((__m128i *) out, half); out += stride; \
+            _mm_storeh_pd((double *) out, _mm_castsi128_pd(half)); out += stride; \
+         }
+
+      dct_store2(out0, out_stride0, _mm256_castsi256_si128(p0));
+      dct_store2(out0, out_stride0, _mm256_castsi256_si128(p2));
+      dct_store2(out0, out_stride0, _mm256_castsi256_si128(p1));
+      dct_store2(out0, out_stride0, _mm256_castsi256_si128(p3));
+      dct_store2(out1, out_stride1, _mm256_extracti128_si256(p0, 1));
+      dct_store2(out1, out_stride1, _mm256_extracti128_si256(p2, 1));
+      dct_store2(out1, out_stride1, _mm256_extracti128_si256(p1, 1));
+      dct_store2(out1, out_stride1, _mm256_extracti128_si256(p3, 1));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+}
+#endif // STBI_AVX2
+
+
+#ifdef STBI_NEON
+
+// NEON integer IDCT. should produce bit-identical
+// results to the generic C version.
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+
+   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
+   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
+   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
+   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
+   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
+   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
+   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
+   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
+   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
+   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
+   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
+   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+
+#define dct_long_mul(out, inq, coeff) \
+   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
 
 #define dct_long_mac(out, acc, inq, coeff) \
    int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
@@ -2683,13 +4325,177 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// blocks waiting for the IDCT. with a kernel that does two blocks at once,
+// a block is held back until a second one comes along; decoders put their
+// coefficients in data[], which stbi__jpeg_idct_block hands out so that the
+// held block isn't overwritten.
+typedef struct
+{
+   STBI_SIMD_ALIGN(short, data[2][64]);
+   stbi_uc *out;
+   int out_stride;
+   short *held;
+} stbi__idct_queue;
+
+static void stbi__jpeg_idct_init(stbi__idct_queue *q)
+{
+   q->held = NULL;
+}
+
+// where to decode the next block into
+static short *stbi__jpeg_idct_block(stbi__idct_queue *q)
+{
+   return q->data[q->held == q->data[0]];
+}
+
+// block (bx,by) of component n
+static void stbi__jpeg_idct_queue(stbi__jpeg *z, stbi__idct_queue *q, int n, int bx, int by, short *data)
+{
+   int out_stride = z->img_comp[n].w2;
+   stbi_uc *out = z->img_comp[n].data + (out_stride*by + bx) * z->img_comp[n].idct_size;
+   if (!z->idct_pair_kernel) {
+      z->img_comp[n].idct(out, out_stride, data);
+   } else if (!q->held) {
+      q->out = out;
+      q->out_stride = out_stride;
+      q->held = data;
+   } else {
+      z->idct_pair_kernel(q->out, q->out_stride, q->held, out, out_stride, data);
+      q->held = NULL;
+   }
+}
+
+static void stbi__jpeg_idct_flush(stbi__jpeg *z, stbi__idct_queue *q)
+{
+   if (q->held) {
+      z->idct_block_kernel(q->out, q->out_stride, q->held);
+      q->held = NULL;
+   }
+}
+
+// scan out an interleaved baseline MCU, scan_n components in order, each an
+// H x V group of blocks, and queue them for the IDCT. with coeff, the
+// dequantized blocks are stored there one after the other instead.
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int i, int j, short *coeff, stbi__idct_queue *q)
+{
+   int k,x,y;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      for (y=0; y < z->img_comp[n].v; ++y) {
+         for (x=0; x < z->img_comp[n].h; ++x) {
+            int ha = z->img_comp[n].ha;
+            short *data = coeff ? coeff : stbi__jpeg_idct_block(q);
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (coeff)
+               coeff += 64;
+            else
+               stbi__jpeg_idct_queue(z, q, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y, data);
+         }
+      }
+   }
+   return 1;
+}
+
+// coefficients stbi__jpeg_decode_mcu stores per MCU
+static int stbi__jpeg_mcu_coeff(stbi__jpeg *z)
+{
+   int k, blocks = 0;
+   for (k=0; k < z->scan_n; ++k)
+      blocks += z->img_comp[z->order[k]].h * z->img_comp[z->order[k]].v;
+   return blocks * 64;
+}
+
+// a row of interleaved MCUs, counting down the restart interval after each.
+// returns 0 on error, 2 if there's a marker where a restart should be (the
+// caller stops there, so we get corrupt data rather than no data), else 1
+static int stbi__jpeg_decode_mcu_row(stbi__jpeg *z, int j, short *coeff)
+{
+   int i, mcu_coeff = coeff ? stbi__jpeg_mcu_coeff(z) : 0;
+   stbi__idct_queue q;
+   stbi__jpeg_idct_init(&q);
+   for (i=0; i < z->img_mcu_x; ++i) {
+      if (!stbi__jpeg_decode_mcu(z, i, j, coeff, &q)) return 0;
+      if (coeff) coeff += mcu_coeff;
+      if (--z->todo <= 0) {
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         if (!STBI__RESTART(z->marker)) { stbi__jpeg_idct_flush(z, &q); return 2; }
+         stbi__jpeg_reset(z);
+      }
+   }
+   stbi__jpeg_idct_flush(z, &q);
+   return 1;
+}
+
+// idct MCUs [i0, i1) of MCU row j from coefficients stored by
+// stbi__jpeg_decode_mcu, coeff pointing at MCU i0's
+static void stbi__jpeg_idct_mcus(stbi__jpeg *z, int j, int i0, int i1, short *coeff)
+{
+   int i,k,x,y,stage = stbi__stage(STBI__STAGE_transform);
+   stbi__idct_queue q;
+   stbi__jpeg_idct_init(&q);
+   for (i=i0; i < i1; ++i) {
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               stbi__jpeg_idct_queue(z, &q, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y, coeff);
+               coeff += 64;
+            }
+         }
+      }
+   }
+   stbi__jpeg_idct_flush(z, &q);
+   stbi__stage(stage);
+}
+
+// idct blocks [0, count) of block row j of component n, stored one after
+// the other
+static void stbi__jpeg_idct_blocks(stbi__jpeg *z, int n, int j, int count, short *coeff)
+{
+   int i, stage = stbi__stage(STBI__STAGE_transform);
+   stbi__idct_queue q;
+   stbi__jpeg_idct_init(&q);
+   for (i=0; i < count; ++i)
+      stbi__jpeg_idct_queue(z, &q, n, i, j, coeff + 64 * i);
+   stbi__jpeg_idct_flush(z, &q);
+   stbi__stage(stage);
+}
+
+#ifdef STBI_STAGE_TIMING
+// timed, the decoders Huffman decode a row into coefficients and idct it
+// after, rather than a block at a time, so the two can be told apart. this
+// is the row, 16-byte aligned for the SIMD IDCTs; free *raw
+static short *stbi__jpeg_coeff_row(int coeff, stbi_uc **raw)
+{
+   *raw = (stbi_uc *) stbi__scratch_malloc_mad2(coeff, sizeof(short), 15);
+   if (!*raw) return NULL;
+   return (short *) (*raw + ((16 - ((stbi__uint32) (size_t) *raw & 15)) & 15));
+}
+#endif
+
+#ifndef STBI_NO_THREADS
+// tasks to decode with: 1 unless the caller gave us threads and the image is
+// big enough to be worth splitting
+static int stbi__jpeg_threads(stbi__jpeg *z)
+{
+   int threads = stbi__call_threads();
+   if (threads < 2 || z->s->img_x * z->s->img_y < (1u << 18)) return 1;
+   return threads;
+}
+
+static int stbi__jpeg_decode_threaded(stbi__jpeg *z);
+#endif
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+   z->converted = 0;
    if (!z->progressive) {
       if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
+         int i,j,r = 1;
+         stbi__idct_queue q;
+         short *coeff = NULL; // a row of blocks when timed
+         stbi_uc *raw = NULL;
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2697,52 +4503,48 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
+         stbi__jpeg_idct_init(&q);
+#ifdef STBI_STAGE_TIMING
+         if (stbi__thread_clock && !(coeff = stbi__jpeg_coeff_row(w * 64, &raw))) return stbi__err("outofmem", "Out of memory");
+#endif
+         for (j=0; j < h && r == 1; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               short *data = coeff ? coeff + 64 * i : stbi__jpeg_idct_block(&q);
+               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) { r = 0; break; }
+               if (!coeff) stbi__jpeg_idct_queue(z, &q, n, i, j, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { r = 2; ++i; break; }
                   stbi__jpeg_reset(z);
                }
             }
+            if (coeff && r) stbi__jpeg_idct_blocks(z, n, j, i, coeff);
          }
-         return 1;
+         stbi__jpeg_idct_flush(z, &q);
+         if (raw) stbi__scratch_free(raw);
+         return r != 0;
       } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+         int j, r = 1;
+         short *coeff = NULL; // a row of MCUs when timed
+         stbi_uc *raw = NULL;
+#ifndef STBI_NO_THREADS
+         if (z->scan_n == z->s->img_n && stbi__jpeg_threads(z) > 1)
+            return stbi__jpeg_decode_threaded(z);
+#endif
+#ifdef STBI_STAGE_TIMING
+         if (stbi__thread_clock && !(coeff = stbi__jpeg_coeff_row(z->img_mcu_x * stbi__jpeg_mcu_coeff(z), &raw))) return stbi__err("outofmem", "Out of memory");
+#endif
+         for (j=0; j < z->img_mcu_y && r == 1; ++j) {
+            r = stbi__jpeg_decode_mcu_row(z, j, coeff);
+            // like the threaded decoder, a row that stopped short goes through the IDCT whole
+            if (coeff && r) stbi__jpeg_idct_mcus(z, j, 0, z->img_mcu_x, coeff);
          }
-         return 1;
+         if (raw) stbi__scratch_free(raw);
+         return r != 0;
       }
    } else {
       if (z->scan_n == 1) {
@@ -2814,22 +4616,65 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
+// dequantize and idct block row j of component n of a progressive image
+static void stbi__jpeg_finish_row(stbi__jpeg *z, int n, int j)
+{
+   int i, stage = stbi__stage(STBI__STAGE_transform);
+   int w = (z->img_comp[n].x+7) >> 3;
+   stbi__idct_queue q;
+   stbi__jpeg_idct_init(&q);
+   for (i=0; i < w; ++i) {
+      short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+      stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+      stbi__jpeg_idct_queue(z, &q, n, i, j, data);
+   }
+   stbi__jpeg_idct_flush(z, &q);
+   stbi__stage(stage);
+}
+
+#ifndef STBI_NO_THREADS
+typedef struct
+{
+   stbi__jpeg *z;
+   int count;           // items
+   stbi__atomic next;   // next item nobody took yet
+} stbi__jpeg_work;
+
+// block rows of all components, taken one at a time
+static void stbi__jpeg_finish_task(void *task_data, int index)
+{
+   stbi__jpeg_work *work = (stbi__jpeg_work *) task_data;
+   stbi__jpeg *z = work->z;
+   long item;
+   STBI_NOTUSED(index);
+   while ((item = stbi__atomic_add(&work->next, 1)) < work->count) {
+      int n = 0, j = (int) item;
+      while (j >= (z->img_comp[n].y+7) >> 3)
+         j -= (z->img_comp[n++].y+7) >> 3;
+      stbi__jpeg_finish_row(z, n, j);
+   }
+}
+#endif
+
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
+      int j,n;
+#ifndef STBI_NO_THREADS
+      if (stbi__jpeg_threads(z) > 1) {
+         stbi__jpeg_work work;
+         work.z = z;
+         work.count = 0;
+         work.next = 0;
+         for (n=0; n < z->s->img_n; ++n)
+            work.count += (z->img_comp[n].y+7) >> 3;
+         stbi__parallel(stbi__jpeg_finish_task, &work, stbi__jpeg_threads(z));
+         return;
       }
+#endif
+      for (n=0; n < z->s->img_n; ++n)
+         for (j=0; j < (z->img_comp[n].y+7) >> 3; ++j)
+            stbi__jpeg_finish_row(z, n, j);
    }
 }
 
@@ -2980,17 +4825,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__scratch_free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__scratch_free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__scratch_free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
@@ -3044,8 +4889,19 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    // these sizes can't be more than 17 bits
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->out_w = (s->img_x + (1 << z->scale)-1) >> z->scale;
+   z->out_h = (s->img_y + (1 << z->scale)-1) >> z->scale;
 
    for (i=0; i < s->img_n; ++i) {
+      // a component subsampled 2x or 4x both ways already is at 1/2 or 1/4
+      // the size, so it only needs scaling the rest of the way. saves
+      // upsampling it again, which would lose detail the coefficients have
+      int cs = z->scale;
+      while (cs > 0 && h_max % (z->img_comp[i].h << (z->scale-cs+1)) == 0 && v_max % (z->img_comp[i].v << (z->scale-cs+1)) == 0)
+         --cs;
+      z->img_comp[i].scale = cs;
+      z->img_comp[i].idct_size = 8 >> z->img_comp[i].scale;
+      z->img_comp[i].idct = z->img_comp[i].scale ? stbi__idct_reduced[z->img_comp[i].scale-1] : z->idct_block_kernel;
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
       z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
@@ -3056,21 +4912,21 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->img_comp[i].idct_size;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->img_comp[i].idct_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      z->img_comp[i].raw_data = stbi__scratch_malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // a block of coefficients for every idct_size x idct_size of plane
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__scratch_malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3351,6 +5207,74 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// stbi__resample_row_hv_2_simd 16 pixels at a time
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass, 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff);
+
+      // "prev" and "next" are curr shifted by a pixel. alignr shifts each
+      // 128-bit half on its own, so the half it shifts in from comes first.
+      __m256i lo_up = _mm256_permute2x128_si256(curr, curr, 0x08); // 0, curr.lo
+      __m256i hi_dn = _mm256_permute2x128_si256(curr, curr, 0x81); // curr.hi, 0
+      __m256i prv0  = _mm256_alignr_epi8(curr, lo_up, 14);
+      __m256i nxt0  = _mm256_alignr_epi8(hi_dn, curr, 2);
+      __m256i prev  = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next  = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal pass, even = cur*4 + (prev - cur), odd = cur*4 + (next - cur)
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave and pack; per half that's pixels 0-7 then 8-15, in order
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   // the rest like the scalar loop, which the simd versions match exactly
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3385,7 +5309,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255; // with step 3 this would be the next row's first byte
       out += step;
    }
 }
@@ -3519,32 +5443,123 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
 #endif
 
+#ifdef STBI_AVX2
+// the sse2 loop on 16 pixels at a time, 8 in each 128-bit half
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4) {
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      // load 16 bytes with pixels 0-7 in the low half, 8-15 in the high one
+      #define stbi__load_halves(p) _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (p))), 0x50)
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m256i y_bytes = stbi__load_halves(y+i);
+         __m256i cr_bytes = stbi__load_halves(pcr+i);
+         __m256i cb_bytes = stbi__load_halves(pcb+i);
+         __m256i cr_biased = _mm256_xor_si256(cr_bytes, signflip); // -128
+         __m256i cb_biased = _mm256_xor_si256(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_unpacklo_epi8(y_bias, y_bytes);
+         __m256i crw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cr_biased);
+         __m256i cbw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cb_biased);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+      #undef stbi__load_halves
+   }
+
+   // gcc makes this a tail jump without the vzeroupper it puts before a
+   // return, and the dirty upper halves then slow down every SSE instruction
+   // after the decode (pow in the HDR conversion ran 10x slower)
+   _mm256_zeroupper();
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+#ifdef STBI_SSE2
+   int simd_limit = stbi__call_simd_limit();
+#endif
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_pair_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
 #ifdef STBI_SSE2
-   if (stbi__sse2_available()) {
+   if (simd_limit >= STBI_simd_sse2 && stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (simd_limit >= STBI_simd_avx2 && stbi__sse2_available() && stbi__avx2_available()) {
+      j->idct_pair_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   // the pair kernel is 8x8 only, and the queue pairs blocks of any component
+   j->scale = j->s->jpeg_scale;
+   if (j->scale)
+      j->idct_pair_kernel = NULL;
 }
 
 // clean up the temporary component buffers
@@ -3570,186 +5585,541 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// pick the number of output components and allocate the output, the
+// caller's if it gave us one
+static int stbi__jpeg_alloc_output(stbi__jpeg *z)
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   // determine actual number of components to generate
+   int n = z->req_comp ? z->req_comp : z->s->img_n >= 3 ? 3 : 1;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   z->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   if (z->s->img_n == 3 && n < 3 && !z->is_rgb)
+      z->decode_n = 1;
+   else
+      z->decode_n = z->s->img_n;
+   z->out_n = n;
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   if (z->s->out_user) {
+      if (!stbi__user_output_fits(z->s, z->out_w, z->out_h, n)) return 0;
+      z->output = z->s->out_user;
+   } else {
+      z->output = (stbi_uc *) stbi__malloc_mad3(n, z->out_w, z->out_h, 1);
+      if (!z->output) return stbi__err("outofmem", "Out of memory");
+   }
+   return 1;
+}
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+static void stbi__jpeg_free_output(stbi__jpeg *z)
+{
+   if (z->output && z->output != z->s->out_user)
+      stbi__free(z->output);
+   z->output = NULL;
+}
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+// line buffers big enough for upsampling off the edges with upsample factor
+// of 4, one per decoded component
+static int stbi__jpeg_alloc_linebufs(stbi__jpeg *z, stbi_uc *linebuf[4])
+{
+   int k;
+   for (k=0; k < z->decode_n; ++k) {
+      linebuf[k] = (stbi_uc *) stbi__scratch_malloc(z->s->img_x + 3);
+      if (!linebuf[k]) {
+         while (k--) stbi__scratch_free(linebuf[k]);
+         return stbi__err("outofmem", "Out of memory");
+      }
+   }
+   return 1;
+}
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4];
+static void stbi__jpeg_free_linebufs(stbi__jpeg *z, stbi_uc *linebuf[4])
+{
+   int k;
+   for (k=0; k < z->decode_n; ++k)
+      stbi__scratch_free(linebuf[k]);
+}
+
+// resample and color-convert output rows [y0, y1) from the component planes
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, int y0, int y1, stbi_uc *linebuf[4])
+{
+   int k, n = z->out_n, decode_n = z->decode_n, is_rgb = z->is_rgb, stage = stbi__stage(STBI__STAGE_convert);
+   unsigned int i;
+   int j;
+   stbi_uc *coutput[4];
+   stbi__resample res_comp[4];
+
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      int cs = z->img_comp[k].scale, steps, wraps, last = ((z->img_comp[k].y + (1 << cs)-1) >> cs) - 1;
+
+      // what's left of the subsampling once the component is scaled less
+      r->hs      = (z->img_h_max / z->img_comp[k].h) >> (z->scale - cs);
+      r->vs      = (z->img_v_max / z->img_comp[k].v) >> (z->scale - cs);
+      r->w_lores = (z->out_w + r->hs-1) / r->hs;
 
-      stbi__resample res_comp[4];
+      // where stepping row by row from the top (below) would be at row y0
+      steps      = (r->vs >> 1) + y0;
+      wraps      = steps / r->vs;
+      r->ystep   = steps % r->vs;
+      r->ypos    = wraps;
+      r->line1   = z->img_comp[k].data + z->img_comp[k].w2 * (wraps < last ? wraps : last);
+      r->line0   = wraps == 0 ? z->img_comp[k].data : z->img_comp[k].data + z->img_comp[k].w2 * (wraps-1 < last ? wraps-1 : last);
 
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   for (j=y0; j < y1; ++j) {
+      stbi_uc *out = stbi__output_row(z->s, z->output, n * z->out_w, j, z->out_h);
       for (k=0; k < decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if ((++r->ypos << z->img_comp[k].scale) < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->out_w; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  if (n == 4) out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->out_w; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  if (n == 4) out[3] = 255;
+                  out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+               for (i=0; i < z->out_w; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->out_w, n);
+            }
+         } else
+            for (i=0; i < z->out_w; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               if (n == 4) out[3] = 255;
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->out_w; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->out_w; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
                   out[1] = 255;
-                  out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
             }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->out_w; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->out_w; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->out_w; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->out_w; ++i) *out++ = y[i], *out++ = 255;
+         }
+      }
+   }
+   stbi__stage(stage);
+}
+
+#ifndef STBI_NO_THREADS
+// convert the output rows MCU row k makes, the last band may be short
+static void stbi__jpeg_convert_band(stbi__jpeg *z, int k, stbi_uc *linebuf[4])
+{
+   int rows = z->img_mcu_h >> z->scale, y0 = k * rows, y1 = y0 + rows;
+   stbi__jpeg_convert_rows(z, y0, y1 < (int) z->out_h ? y1 : (int) z->out_h, linebuf);
+}
+
+// color conversion a band of output rows at a time
+static void stbi__jpeg_convert_task(void *task_data, int index)
+{
+   stbi__jpeg_work *work = (stbi__jpeg_work *) task_data;
+   stbi__jpeg *z = work->z;
+   stbi_uc *linebuf[4];
+   long band;
+   STBI_NOTUSED(index);
+   if (!stbi__jpeg_alloc_linebufs(z, linebuf)) return; // the others do our share
+   while ((band = stbi__atomic_add(&work->next, 1)) < work->count)
+      stbi__jpeg_convert_band(z, (int) band, linebuf);
+   stbi__jpeg_free_linebufs(z, linebuf);
+}
+
+// the threaded baseline decoder. every task takes whatever work is ready,
+// in order of how close it is to finished pixels: converting a band of
+// output rows once its MCU row and the ones above and below are
+// done, the IDCT of a decoded MCU row, the entropy decoding of the next MCU
+// row. the entropy decoding is one stream so only one task does it at a time,
+// into a ring of coefficient rows the IDCTs empty. when the image has restart
+// markers and is all in memory, the segments between them are independent,
+// so tasks entropy decode (and IDCT) whole segments at once instead.
+// no task ever waits on a task that hasn't started, so it works with however
+// many threads the caller's parallel-for really runs the tasks on.
+typedef struct
+{
+   stbi__jpeg *z;
+   int rows;                  // MCU rows
+   stbi__atomic *row_mcus;    // MCUs of each row with pixels in the planes
+   stbi__atomic stop, error;
+   stbi__atomic convert_next, converted;
+   // one entropy stream
+   short *ring;
+   int ring_rows, row_coeff;
+   int entropy_end;           // rows the stream has, less if it stops early
+   stbi__atomic entropy_busy, entropy_rows, idct_next;
+   // restart segments
+   stbi_uc **segment;         // segments+1 pointers, the last one past the end
+   int segments;
+   stbi__atomic segment_next, diverged;
+} stbi__jpeg_pipeline;
+
+static int stbi__jpeg_band_ready(stbi__jpeg_pipeline *p, int k)
+{
+   int r, r0 = k > 0 ? k-1 : 0, r1 = k+1 < p->rows ? k+1 : p->rows-1;
+   for (r=r0; r <= r1; ++r)
+      if (stbi__atomic_get(&p->row_mcus[r]) != p->z->img_mcu_x)
+         return 0;
+   return 1;
+}
+
+// entropy decode and idct restart segment k with our own decoder and
+// context. timed, the MCUs go to coeff (a row of them) and through the IDCT
+// a row at a time
+static void stbi__jpeg_decode_segment(stbi__jpeg_pipeline *p, stbi__jpeg *local, stbi__context *ls, int k, short *coeff)
+{
+   stbi__jpeg *z = p->z;
+   int ri = z->restart_interval, total = z->img_mcu_x * z->img_mcu_y;
+   int m = k * ri, end = m + ri < total ? m + ri : total;
+   int row = m / z->img_mcu_x, first = m % z->img_mcu_x, count = 0;
+   int mcu_coeff = coeff ? stbi__jpeg_mcu_coeff(z) : 0;
+   stbi__idct_queue q;
+
+   *ls = *z->s;
+   ls->img_buffer = p->segment[k];
+   ls->img_buffer_end = p->segment[k+1];
+   local->s = ls;
+   stbi__jpeg_reset(local);
+   stbi__jpeg_idct_init(&q);
+   for (; m < end; ++m) {
+      int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+      if (j != row) {
+         stbi__jpeg_idct_flush(local, &q);
+         if (coeff) stbi__jpeg_idct_mcus(local, row, first, first + count, coeff + first * mcu_coeff);
+         stbi__atomic_add(&p->row_mcus[row], count);
+         row = j;
+         first = 0;
+         count = 0;
+      }
+      if (!stbi__jpeg_decode_mcu(local, i, j, coeff ? coeff + i * mcu_coeff : NULL, &q)) {
+         // serial decoding may have stopped before getting here
+         stbi__atomic_set(&p->diverged, 1);
+         stbi__atomic_set(&p->stop, 1);
+         return;
+      }
+      ++count;
+   }
+   stbi__jpeg_idct_flush(local, &q);
+   if (coeff) stbi__jpeg_idct_mcus(local, row, first, first + count, coeff + first * mcu_coeff);
+   stbi__atomic_add(&p->row_mcus[row], count);
+   // where the serial decoder checks for the restart marker
+   if (end - k * ri == ri && k+1 < p->segments) {
+      if (local->code_bits < 24) stbi__grow_buffer_unsafe(local);
+      if (!STBI__RESTART(local->marker)) {
+         stbi__atomic_set(&p->diverged, 1);
+         stbi__atomic_set(&p->stop, 1);
+      }
+   }
+}
+
+static void stbi__jpeg_pipeline_task(void *task_data, int index)
+{
+   stbi__jpeg_pipeline *p = (stbi__jpeg_pipeline *) task_data;
+   stbi__jpeg *z = p->z, *local = NULL;
+   stbi__context ls;
+   stbi_uc *linebuf[4], *coeff_raw = NULL;
+   short *coeff = NULL;
+   STBI_NOTUSED(index);
+
+   if (!stbi__jpeg_alloc_linebufs(z, linebuf)) goto fail;
+   if (p->segments) {
+      // stbi__jpeg is too big for some stacks
+      local = (stbi__jpeg *) stbi__scratch_malloc(sizeof(stbi__jpeg));
+      if (!local) { stbi__jpeg_free_linebufs(z, linebuf); goto fail; }
+      *local = *z;
+#ifdef STBI_STAGE_TIMING
+      if (stbi__thread_clock && !(coeff = stbi__jpeg_coeff_row(z->img_mcu_x * stbi__jpeg_mcu_coeff(z), &coeff_raw))) {
+         stbi__scratch_free(local);
+         stbi__jpeg_free_linebufs(z, linebuf);
+         goto fail;
+      }
+#endif
+   }
+
+   while (!stbi__atomic_get(&p->stop) && stbi__atomic_get(&p->converted) < p->rows) {
+      long k = stbi__atomic_get(&p->convert_next);
+      if (k < p->rows && stbi__jpeg_band_ready(p, (int) k) && stbi__atomic_cas(&p->convert_next, k, k+1)) {
+         stbi__jpeg_convert_band(z, (int) k, linebuf);
+         stbi__atomic_add(&p->converted, 1);
+         continue;
+      }
+      if (p->segments) {
+         k = stbi__atomic_add(&p->segment_next, 1);
+         if (k < p->segments) {
+            stbi__jpeg_decode_segment(p, local, &ls, (int) k, coeff);
+            continue;
+         }
+      } else {
+         k = stbi__atomic_get(&p->idct_next);
+         if (k < stbi__atomic_get(&p->entropy_rows) && stbi__atomic_cas(&p->idct_next, k, k+1)) {
+            stbi__jpeg_idct_mcus(z, (int) k, 0, z->img_mcu_x, p->ring + (k % p->ring_rows) * p->row_coeff);
+            stbi__atomic_set(&p->row_mcus[k], z->img_mcu_x);
+            continue;
+         }
+         if (stbi__atomic_cas(&p->entropy_busy, 0, 1)) {
+            int e = (int) stbi__atomic_get(&p->entropy_rows), r;
+            // the ring row is free once the row that was in it has been idct'd
+            if (e < p->entropy_end && (e < p->ring_rows || stbi__atomic_get(&p->row_mcus[e - p->ring_rows]) == z->img_mcu_x)) {
+               r = stbi__jpeg_decode_mcu_row(z, e, p->ring + (e % p->ring_rows) * p->row_coeff);
+               if (r == 0) {
+                  stbi__atomic_set(&p->error, 1);
+                  stbi__atomic_set(&p->stop, 1);
+               } else if (r == 2) {
+                  // no more data, the rest of the planes stay as they are
+                  int j;
+                  p->entropy_end = e+1;
+                  for (j=e+1; j < p->rows; ++j)
+                     stbi__atomic_set(&p->row_mcus[j], z->img_mcu_x);
+               }
+               stbi__atomic_set(&p->entropy_rows, e+1);
+               stbi__atomic_set(&p->entropy_busy, 0);
+               continue;
+            }
+            stbi__atomic_set(&p->entropy_busy, 0);
          }
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      stbi__idle();
+   }
+   stbi__jpeg_free_linebufs(z, linebuf);
+   if (coeff_raw) stbi__scratch_free(coeff_raw);
+   if (local) stbi__scratch_free(local);
+   return;
+
+fail:
+   stbi__atomic_set(&p->error, 1);
+   stbi__atomic_set(&p->stop, 1);
+}
+
+// find the restart segments of the scan starting at the context's position.
+// returns the marker ending the scan, or 0 if the segments don't line up
+// with the restart interval (the serial decoder copes with that, we don't)
+static int stbi__jpeg_find_segments(stbi__jpeg_pipeline *p)
+{
+   stbi__jpeg *z = p->z;
+   stbi_uc *at = z->s->img_buffer, *end = z->s->img_buffer_end;
+   int n = 0, m;
+   p->segment[n++] = at;
+   while (at < end) {
+      if (*at++ != 0xff) continue;
+      while (at < end && *at == 0xff) ++at; // fill bytes
+      if (at == end) break;
+      m = *at++;
+      if (m == 0) continue; // stuffed 0xff
+      if (STBI__RESTART(m)) {
+         if (n == p->segments) return 0;
+         p->segment[n++] = at;
+         continue;
+      }
+      if (n != p->segments) return 0;
+      p->segment[n] = at;
+      return m;
+   }
+   return 0;
+}
+
+static int stbi__jpeg_decode_threaded(stbi__jpeg *z)
+{
+   stbi__jpeg_pipeline p;
+   stbi_uc *ring_raw = NULL;
+   int j, r, marker = 0, ok = 1;
+
+   if (!z->output && !stbi__jpeg_alloc_output(z)) return 0;
+
+   memset(&p, 0, sizeof(p));
+   p.z = z;
+   p.rows = z->img_mcu_y;
+   p.row_mcus = (stbi__atomic *) stbi__scratch_malloc(sizeof(stbi__atomic) * p.rows);
+   if (!p.row_mcus) return stbi__err("outofmem", "Out of memory");
+   for (j=0; j < p.rows; ++j) p.row_mcus[j] = 0;
+
+   if (z->restart_interval && !z->s->read_from_callbacks) {
+      int total = z->img_mcu_x * z->img_mcu_y;
+      p.segments = (total + z->restart_interval - 1) / z->restart_interval;
+      if (p.segments > 1) {
+         p.segment = (stbi_uc **) stbi__scratch_malloc(sizeof(stbi_uc *) * (p.segments + 1));
+         if (!p.segment) { stbi__scratch_free((void *) p.row_mcus); return stbi__err("outofmem", "Out of memory"); }
+         marker = stbi__jpeg_find_segments(&p);
+      }
+      if (!marker) {
+         if (p.segment) stbi__scratch_free(p.segment);
+         p.segment = NULL;
+         p.segments = 0;
+      }
+   }
+   if (!p.segments) {
+      p.ring_rows = 2 * stbi__jpeg_threads(z) + 2;
+      if (p.ring_rows > p.rows) p.ring_rows = p.rows;
+      p.row_coeff = z->img_mcu_x * stbi__jpeg_mcu_coeff(z);
+      p.entropy_end = p.rows;
+      ring_raw = (stbi_uc *) stbi__scratch_malloc_mad3(p.ring_rows, p.row_coeff, sizeof(short), 15);
+      if (!ring_raw) { stbi__scratch_free((void *) p.row_mcus); return stbi__err("outofmem", "Out of memory"); }
+      // the SIMD IDCTs want their coefficients 16-byte aligned
+      p.ring = (short *) (ring_raw + ((16 - ((stbi__uint32) (size_t) ring_raw & 15)) & 15));
+   }
+
+   stbi__parallel(stbi__jpeg_pipeline_task, &p, stbi__jpeg_threads(z));
+
+   if (p.segments && p.diverged) {
+      // a segment didn't end the way the serial decoder expects; let it
+      // decode the whole scan to get exactly what it would have
+      stbi__jpeg_reset(z);
+      z->s->img_buffer = p.segment[0];
+      for (j=0; j < z->img_mcu_y; ++j) {
+         r = stbi__jpeg_decode_mcu_row(z, j, NULL);
+         if (r != 1) { ok = r != 0; break; }
+      }
+   } else if (p.error) {
+      ok = 0;
+   } else {
+      if (p.segments) {
+         // carry on after the scan's closing marker, as if we'd read up to it
+         z->s->img_buffer = p.segment[p.segments];
+         z->marker = (stbi_uc) marker;
+      }
+      z->converted = 1;
    }
+
+   stbi__scratch_free((void *) p.row_mcus);
+   if (p.segment) stbi__scratch_free(p.segment);
+   if (ring_raw) stbi__scratch_free(ring_raw);
+   return ok;
+}
+#endif
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   z->output = NULL;
+   z->converted = 0;
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   z->req_comp = req_comp;
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   // (unless the threaded decoder already converted it on the way)
+   if (!stbi__decode_jpeg_image(z)) { stbi__jpeg_free_output(z); stbi__cleanup_jpeg(z); return NULL; }
+
+   if (!z->output && !stbi__jpeg_alloc_output(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   if (!z->converted) {
+#ifndef STBI_NO_THREADS
+      if (stbi__jpeg_threads(z) > 1) {
+         stbi__jpeg_work work;
+         work.z = z;
+         work.count = z->img_mcu_y;
+         work.next = 0;
+         stbi__parallel(stbi__jpeg_convert_task, &work, stbi__jpeg_threads(z));
+         // a task that couldn't get line buffers leaves its bands to the
+         // others; if none could, do it here
+         if (work.next < work.count) {
+            stbi__jpeg_convert_task(&work, 0);
+            if (work.next < work.count) { stbi__jpeg_free_output(z); stbi__cleanup_jpeg(z); return NULL; }
+         }
+      } else
+#endif
+      {
+         stbi_uc *linebuf[4];
+         if (!stbi__jpeg_alloc_linebufs(z, linebuf)) { stbi__jpeg_free_output(z); stbi__cleanup_jpeg(z); return NULL; }
+         stbi__jpeg_convert_rows(z, 0, z->out_h, linebuf);
+         stbi__jpeg_free_linebufs(z, linebuf);
+      }
+   }
+   stbi__cleanup_jpeg(z);
+   // every row went through stbi__output_row
+   z->s->flipped = z->s->flip;
+   *out_x = z->out_w;
+   *out_y = z->out_h;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return z->output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
-   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = (stbi__jpeg*) stbi__scratch_malloc(sizeof(stbi__jpeg));
    STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   stbi__scratch_free(j);
    return result;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
-   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = (stbi__jpeg*)stbi__scratch_malloc(sizeof(stbi__jpeg));
    j->s = s;
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__scratch_free(j);
    return r;
 }
 
@@ -3768,10 +6138,10 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
 static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 {
    int result;
-   stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
+   stbi__jpeg* j = (stbi__jpeg*) (stbi__scratch_malloc(sizeof(stbi__jpeg)));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__scratch_free(j);
    return result;
 }
 #endif
@@ -3789,6 +6159,23 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// tables for the fast inflate path: a first level indexed by the next 11 (8
+// for distances) bits of input and second levels for the longer codes, one
+// 32-bit entry per slot:
+//    bits  0..7   bits the entry consumes (0 means no such code)
+//    bits  8..15  STBI__ZF_* flags, or the number of extra bits of a
+//                 length/distance
+//    bits 16..31  literal(s), length/distance base, or second level start
+// an entry can hold two literals whose codes together fit the first level.
+// the sizes are zlib's "enough" for the worst case codes.
+#define STBI__ZF_LBITS       11
+#define STBI__ZF_DBITS       8
+#define STBI__ZF_LENOUGH     2342
+#define STBI__ZF_DENOUGH     402
+#define STBI__ZF_LITERAL     0x80  // | 1 if two literals
+#define STBI__ZF_EOB         0x40
+#define STBI__ZF_SUB         0x20  // | bits of the second level
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3871,7 +6258,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
-typedef struct
+typedef struct stbi__zbuf_s
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
@@ -3881,8 +6268,15 @@ typedef struct
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_fast;
+   // when set, called instead of growing the output to make room for n more
+   // bytes. returning 0 with z_stop set ends the stream without an error
+   int (*z_flush)(struct stbi__zbuf_s *z, int n);
+   void *z_user;
+   int   z_stop;
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 zf_length[STBI__ZF_LENOUGH], zf_distance[STBI__ZF_DENOUGH];
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -3947,12 +6341,13 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->z_flush) return z->z_flush(z, n);
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -3969,52 +6364,323 @@ static const int stbi__zlength_base[31] = {
 static const int stbi__zlength_extra[31]=
 { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
 
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static int stbi__parse_huffman_block(stbi__zbuf *a)
+{
+   char *zout = a->zout;
+   for(;;) {
+      int z = stbi__zhuffman_decode(a, &a->z_length);
+      if (z < 256) {
+         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+         if (zout >= a->zout_end) {
+            if (!stbi__zexpand(a, zout, 1)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) z;
+      } else {
+         stbi_uc *p;
+         int len,dist;
+         if (z == 256) {
+            a->zout = zout;
+            return 1;
+         }
+         z -= 257;
+         len = stbi__zlength_base[z];
+         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
+         z = stbi__zhuffman_decode(a, &a->z_distance);
+         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+         dist = stbi__zdist_base[z];
+         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
+         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+         if (zout + len > a->zout_end) {
+            if (!stbi__zexpand(a, zout, len)) return 0;
+            zout = a->zout;
+         }
+         p = (stbi_uc *) (zout - dist);
+         if (dist == 1) { // run of one byte; common in images.
+            stbi_uc v = *p;
+            if (len) { do *zout++ = v; while (--len); }
+         } else {
+            if (len) { do *zout++ = *p++; while (--len); }
+         }
+      }
+   }
+}
+
+// fast inflate, in the manner of libdeflate: a 64-bit bit buffer refilled a
+// word at a time, so a whole length/distance pair (at most 48 bits) decodes
+// from one refill, bigger tables that resolve nearly every code in one
+// lookup, and matches copied 8 bytes at a time. same output as the code
+// above, which stays as the reference (stbi_set_fast_inflate(0), or
+// fast_inflate 0 in the load options).
+
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_fast)
+{
+   stbi__zfast_inflate = flag_true_if_fast;
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) (p[0] | (p[1] << 8) | (p[2] << 16) | ((stbi__uint32) p[3] << 24))
+        | ((stbi__uint64) (p[4] | (p[5] << 8) | (p[6] << 16) | ((stbi__uint32) p[7] << 24)) << 32);
+#endif
+}
+
+// builds a two level table from code lengths like stbi__zbuild_huffman, with
+// the same checks. kind is 0 for literal/lengths, 1 for distances
+static int stbi__zbuild_fast(stbi__uint32 *table, const stbi_uc *sizelist, int num, int kind)
+{
+   int i, s, k, code, max_len = 0, next = 0;
+   int table_bits = kind ? STBI__ZF_DBITS : STBI__ZF_LBITS;
+   int enough = kind ? STBI__ZF_DENOUGH : STBI__ZF_LENOUGH;
+   int next_code[16], sizes[17], left[16], sorted[288];
+   int sub_prefix = -1, sub_start = 0, sub_bits = 0;
+
+   memset(sizes, 0, sizeof(sizes));
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   for (i=1; i < 16; ++i)
+      if (sizes[i] > (1 << i))
+         return stbi__err("bad sizes", "Corrupt PNG");
+   code = 0;
+   for (i=1; i < 16; ++i) {
+      next_code[i] = code;
+      code = (code + sizes[i]);
+      if (sizes[i]) {
+         if (code-1 >= (1 << i)) return stbi__err("bad codelengths","Corrupt PNG");
+         max_len = i;
+      }
+      code <<= 1;
+      left[i] = sizes[i];
+   }
+
+   // symbols in canonical order (by length, then value), so codes sharing a
+   // first level slot come together and the last of them is the longest
+   k = 0;
+   for (s=1; s < 16; ++s)
+      for (i=0; i < num; ++i)
+         if (sizelist[i] == s)
+            sorted[k++] = i;
+
+   memset(table, 0, sizeof(*table) << table_bits);
+   next = 1 << table_bits;
+   for (i=0; i < k; ++i) {
+      int sym = sorted[i], j, rev, step;
+      stbi__uint32 e;
+      s = sizelist[sym];
+      rev = stbi__bit_reverse(next_code[s]++, s);
+      if (kind == 0) {
+         if (sym < 256)
+            e = ((stbi__uint32) sym << 16) | (STBI__ZF_LITERAL << 8);
+         else if (sym == 256)
+            e = STBI__ZF_EOB << 8;
+         else if (sym < 286)
+            e = ((stbi__uint32) stbi__zlength_base[sym-257] << 16) | (stbi__zlength_extra[sym-257] << 8);
+         else
+            e = 0; // 286 and 287 can't occur in valid data
+      } else {
+         if (sym < 30)
+            e = ((stbi__uint32) stbi__zdist_base[sym] << 16) | (stbi__zdist_extra[sym] << 8);
+         else
+            e = 0;
+      }
+      if (e) e |= (stbi__uint32) s;
+
+      if (s <= table_bits) {
+         for (j = rev; j < (1 << table_bits); j += 1 << s)
+            table[j] = e;
+      } else {
+         int prefix = rev & ((1 << table_bits) - 1);
+         if (prefix != sub_prefix) {
+            // as few bits as the codes left under this prefix need (zlib's
+            // inflate_table)
+            int room;
+            sub_bits = s - table_bits;
+            room = 1 << sub_bits;
+            while (sub_bits + table_bits < max_len) {
+               room -= left[sub_bits + table_bits];
+               if (room <= 0) break;
+               ++sub_bits;
+               room <<= 1;
+            }
+            if (next + (1 << sub_bits) > enough) return stbi__err("bad codelengths","Corrupt PNG");
+            memset(table + next, 0, sizeof(*table) << sub_bits);
+            table[prefix] = ((stbi__uint32) next << 16) | ((STBI__ZF_SUB | sub_bits) << 8);
+            sub_prefix = prefix;
+            sub_start = next;
+            next += 1 << sub_bits;
+         }
+         step = 1 << (s - table_bits);
+         for (j = rev >> table_bits; j < (1 << sub_bits); j += step)
+            table[sub_start + j] = e;
+      }
+      --left[s];
+   }
+
+   // pair up literals whose codes fit the first level together. going down,
+   // the slot for the second literal (a lower index) is still a single one
+   if (kind == 0) {
+      for (i = (1 << table_bits) - 1; i >= 0; --i) {
+         stbi__uint32 e1 = table[i], e2;
+         int n1 = e1 & 255;
+         if (((e1 >> 8) & 255) != STBI__ZF_LITERAL || n1 >= table_bits) continue;
+         e2 = table[i >> n1];
+         if (((e2 >> 8) & 255) != STBI__ZF_LITERAL || (int) (e2 & 255) > table_bits - n1) continue;
+         table[i] = (e1 & 0xff0000) | ((e2 & 0xff0000) << 8) | ((STBI__ZF_LITERAL | 1) << 8) | (n1 + (e2 & 255));
+      }
+   }
+   return 1;
+}
 
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+stbi_inline static stbi__uint32 stbi__zfast_lookup(const stbi__uint32 *table, int table_bits, stbi__uint64 bitbuf)
+{
+   stbi__uint32 e = table[bitbuf & ((1 << table_bits) - 1)];
+   if ((e >> 8) & STBI__ZF_SUB)
+      e = table[(e >> 16) + ((bitbuf >> table_bits) & ((1 << ((e >> 8) & 15)) - 1))];
+   return e;
+}
 
-static int stbi__parse_huffman_block(stbi__zbuf *a)
+static int stbi__zfast_parse_huffman_block(stbi__zbuf *a)
 {
-   char *zout = a->zout;
+   const stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end;
+   stbi__uint64 bitbuf = a->code_buffer;
+   int bitsleft = a->num_bits, overread = 0, n;
+   char *zout = a->zout, *zout_end = a->zout_end;
+   const stbi__uint32 *ltable = a->zf_length, *dtable = a->zf_distance;
+
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (zout >= a->zout_end) {
-            if (!stbi__zexpand(a, zout, 1)) return 0;
-            zout = a->zout;
-         }
-         *zout++ = (char) z;
+      stbi__uint32 e;
+      int len, dist;
+      char *src, *end;
+
+      // refill to at least 56 bits. bits above bitsleft are left over from
+      // the last word load, and the next one ORs the same bits back in
+      if (in_end - in >= 8) {
+         bitbuf |= stbi__zload64(in) << bitsleft;
+         in += (63 - bitsleft) >> 3;
+         bitsleft |= 56;
       } else {
-         stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
-            a->zout = zout;
-            return 1;
+         // near the end, past which the stream reads as zeros like stbi__zget8
+         while (bitsleft < 56) {
+            if (in < in_end)
+               bitbuf |= (stbi__uint64) *in++ << bitsleft;
+            else
+               ++overread;
+            bitsleft += 8;
          }
-         z -= 257;
-         len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-         if (zout + len > a->zout_end) {
-            if (!stbi__zexpand(a, zout, len)) return 0;
-            zout = a->zout;
+         if (overread > 8) return stbi__err("read past buffer","Corrupt PNG");
+      }
+
+      e = stbi__zfast_lookup(ltable, STBI__ZF_LBITS, bitbuf);
+      if ((e >> 8) & STBI__ZF_LITERAL) {
+         // three codes of at most 15 bits fit in what the refill left, so
+         // literals keep going until three of them or something else
+         int k = 0;
+         for(;;) {
+            n = 1 + ((e >> 8) & 1);
+            if (zout_end - zout < 2) {
+               if (zout_end - zout < n) {
+                  if (!stbi__zexpand(a, zout, n)) return 0;
+                  zout = a->zout;
+                  zout_end = a->zout_end;
+               }
+               if (zout_end - zout < 2) {
+                  // the last byte of a fixed size buffer
+                  *zout++ = (char) (e >> 16);
+                  bitbuf >>= e & 255;
+                  bitsleft -= e & 255;
+                  break;
+               }
+            }
+            zout[0] = (char) (e >> 16);
+            zout[1] = (char) (e >> 24);
+            zout += n;
+            bitbuf >>= e & 255;
+            bitsleft -= e & 255;
+            if (++k == 3) break;
+            e = stbi__zfast_lookup(ltable, STBI__ZF_LBITS, bitbuf);
+            if (!((e >> 8) & STBI__ZF_LITERAL)) break;
          }
-         p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+         continue;
+      }
+      n = e & 255;
+      if (!n) return stbi__err("bad huffman code","Corrupt PNG");
+      bitbuf >>= n;
+      bitsleft -= n;
+      if ((e >> 8) & STBI__ZF_EOB)
+         break;
+
+      n = (e >> 8) & 31;
+      len = (int) (e >> 16) + (int) (bitbuf & ((1 << n) - 1));
+      bitbuf >>= n;
+      bitsleft -= n;
+
+      e = stbi__zfast_lookup(dtable, STBI__ZF_DBITS, bitbuf);
+      n = e & 255;
+      if (!n) return stbi__err("bad huffman code","Corrupt PNG");
+      bitbuf >>= n;
+      bitsleft -= n;
+      n = (e >> 8) & 31;
+      dist = (int) (e >> 16) + (int) (bitbuf & ((1 << n) - 1));
+      bitbuf >>= n;
+      bitsleft -= n;
+
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+      if (zout_end - zout < len) {
+         if (!stbi__zexpand(a, zout, len)) return 0;
+         zout = a->zout;
+         zout_end = a->zout_end;
+      }
+      src = zout - dist;
+      end = zout + len;
+      if (zout_end - end >= 8) {
+         // whole words, the last one running up to 7 bytes past the match
+         if (dist >= 8) {
+            do {
+               memcpy(zout, src, 8);
+               zout += 8;
+               src += 8;
+            } while (zout < end);
          } else {
-            if (len) { do *zout++ = *p++; while (--len); }
+            // a period shorter than a word: write a word of the pattern and
+            // step by the largest multiple of the period that fits in it
+            stbi_uc pattern[8];
+            int i, step = 8 - 8 % dist;
+            for (i=0; i < 8; ++i)
+               pattern[i] = (stbi_uc) src[i % dist];
+            do {
+               memcpy(zout, pattern, 8);
+               zout += step;
+            } while (zout < end);
          }
+      } else {
+         do *zout++ = *src++; while (zout < end);
       }
-   }
+      zout = end;
+   }
+
+   // give back the whole bytes still in the bit buffer, stbi__zbuf only
+   // holds 32 bits. the padding past the end was never taken from the input
+   n = (bitsleft >> 3) - overread;
+   if (n < 0) return stbi__err("read past buffer","Corrupt PNG");
+   in -= n;
+   bitsleft &= 7;
+   a->zbuffer = (stbi_uc *) in;
+   a->code_buffer = (stbi__uint32) (bitbuf & ((1 << bitsleft) - 1));
+   a->num_bits = bitsleft;
+   a->zout = zout;
+   return 1;
 }
 
 static int stbi__compute_huffman_codes(stbi__zbuf *a)
@@ -4061,6 +6727,11 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
+   if (a->z_fast) {
+      if (!stbi__zbuild_fast(a->zf_length, lencodes, hlit, 0)) return 0;
+      if (!stbi__zbuild_fast(a->zf_distance, lencodes+hlit, hdist, 1)) return 0;
+      return 1;
+   }
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
    return 1;
@@ -4152,14 +6823,21 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       } else if (type == 3) {
          return 0;
       } else {
-         if (type == 1) {
+         if (type == 1 && a->z_fast) {
+            if (!stbi__zbuild_fast(a->zf_length  , stbi__zdefault_length  , 288, 0)) return 0;
+            if (!stbi__zbuild_fast(a->zf_distance, stbi__zdefault_distance,  32, 1)) return 0;
+         } else if (type == 1) {
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
-         if (!stbi__parse_huffman_block(a)) return 0;
+         if (a->z_fast) {
+            if (!stbi__zfast_parse_huffman_block(a)) return 0;
+         } else {
+            if (!stbi__parse_huffman_block(a)) return 0;
+         }
       }
    } while (!final);
    return 1;
@@ -4171,6 +6849,9 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_fast = stbi__call_fast_inflate();
+   a->z_flush = NULL;
+   a->z_stop = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4186,7 +6867,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4207,7 +6888,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4234,7 +6915,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4276,6 +6957,25 @@ static stbi__pngchunk stbi__get_chunk_header(stbi__context *s)
    return c;
 }
 
+// the length of this IDAT chunk's data and of the ones right after it that
+// are already in memory (all of them when decoding from memory or a
+// mapping), so the compressed stream can be collected into one allocation
+static stbi__uint32 stbi__png_idata_size(stbi__context *s, stbi__uint32 length)
+{
+   stbi_uc *p = s->img_buffer;
+   stbi__uint32 total = length, next;
+   // this chunk's data and CRC, and the next chunk's header
+   while ((size_t) (s->img_buffer_end - p) >= (size_t) length + 12) {
+      p += (size_t) length + 4;
+      next = ((stbi__uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      if (p[4] != 'I' || p[5] != 'D' || p[6] != 'A' || p[7] != 'T' || total + next < total) break;
+      total += next;
+      length = next;
+      p += 8;
+   }
+   return total;
+}
+
 static int stbi__check_png_header(stbi__context *s)
 {
    static const stbi_uc png_sig[8] = { 137,80,78,71,13,10,26,10 };
@@ -4288,7 +6988,7 @@ static int stbi__check_png_header(stbi__context *s)
 typedef struct
 {
    stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
+   stbi_uc *idata, *out;
    int depth;
 } stbi__png;
 
@@ -4324,54 +7024,319 @@ static int stbi__paeth(int a, int b, int c)
    return c;
 }
 
-static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+#ifdef STBI_SSE2
+// unfiltering 8-bit RGB and RGBA rows. Sub, Avg and Paeth depend on the
+// pixel to the left, so they go a pixel at a time with its 3 or 4 bytes in
+// one register (Paeth in 16-bit lanes, without branches); Up goes 16 bytes
+// at a time, 32 with AVX2. the filters are the *_first ones on the first
+// row, which never read prior. same bytes as the scalar loops.
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int n, int last)
+{
+   stbi__uint32 v;
+   // all but the last pixel can read a byte too many: raw has the next
+   // row's filter byte there, prior the next row
+   if (n == 4 || !last)
+      memcpy(&v, p, 4);
+   else
+      v = p[0] | (p[1] << 8) | (p[2] << 16);
+   return _mm_cvtsi32_si128((int) v);
+}
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i px, int img_n, int out_n, int last)
+{
+   stbi__uint32 v = (stbi__uint32) _mm_cvtsi128_si32(px);
+   if (img_n != out_n)
+      v |= 0xff000000u; // alpha for RGB into RGBA
+   // the byte too many of an RGB pixel is overwritten by the next one
+   if (out_n == 4 || !last)
+      memcpy(p, &v, 4);
+   else {
+      p[0] = (stbi_uc) v;
+      p[1] = (stbi_uc) (v >> 8);
+      p[2] = (stbi_uc) (v >> 16);
+   }
+}
+
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static int stbi__png_up_avx2(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n)
 {
-   int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
+   for (k=0; k + 32 <= n; k += 32) {
+      __m256i r = _mm256_loadu_si256((const __m256i *) (raw + k));
+      __m256i b = _mm256_loadu_si256((const __m256i *) (prior + k));
+      _mm256_storeu_si256((__m256i *) (cur + k), _mm256_add_epi8(r, b));
+   }
+   return k;
+}
+#endif
 
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
+static void stbi__png_unfilter_row_simd(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, stbi__uint32 x, int img_n, int out_n, int filter, int avx2)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero; // left and upper left pixels
+   stbi__uint32 i;
+   int k, n, last;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
+   if (img_n == out_n && (filter == STBI__F_none || filter == STBI__F_up)) {
+      n = (int) x * img_n;
+      if (filter == STBI__F_none) {
+         memcpy(cur, raw, n);
+         return;
+      }
+      k = 0;
+#ifdef STBI_AVX2
+      if (avx2)
+         k = stbi__png_up_avx2(cur, prior, raw, n);
+#else
+      STBI_NOTUSED(avx2);
+#endif
+      for (; k + 16 <= n; k += 16) {
+         __m128i r = _mm_loadu_si128((const __m128i *) (raw + k));
+         __m128i b = _mm_loadu_si128((const __m128i *) (prior + k));
+         _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(r, b));
+      }
+      for (; k < n; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return;
+   }
+
+   for (i=0; i < x; ++i, raw += img_n, cur += out_n, prior += out_n) {
+      __m128i r, b;
+      last = i == x-1;
+      r = stbi__png_load_px(raw, img_n, last);
+      switch (filter) {
+         case STBI__F_none:
+            a = r;
+            break;
+         case STBI__F_sub:
+         case STBI__F_paeth_first: // paeth(a,0,0) is a
+            a = _mm_add_epi8(r, a);
+            break;
+         case STBI__F_up:
+            a = _mm_add_epi8(r, stbi__png_load_px(prior, out_n, last));
+            break;
+         case STBI__F_avg:
+            // floor((a+b)/2): pavgb rounds up, so take off the odd bit
+            b = stbi__png_load_px(prior, out_n, last);
+            a = _mm_add_epi8(r, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))));
+            break;
+         case STBI__F_avg_first:
+            a = _mm_add_epi8(r, _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7f)));
+            break;
+         case STBI__F_paeth: {
+            // pa = |b-c|, pb = |a-c|, pc = |a+b-2c|; a if pa is the smallest,
+            // else b if pb is, else c, like stbi__paeth
+            __m128i a16, b16, c16, pa, pb, pc, smallest, pick;
+            b = stbi__png_load_px(prior, out_n, last);
+            a16 = _mm_unpacklo_epi8(a, zero);
+            b16 = _mm_unpacklo_epi8(b, zero);
+            c16 = _mm_unpacklo_epi8(c, zero);
+            pa = _mm_sub_epi16(b16, c16);
+            pb = _mm_sub_epi16(a16, c16);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            pick = _mm_cmpeq_epi16(smallest, pb);
+            pick = _mm_or_si128(_mm_and_si128(pick, b16), _mm_andnot_si128(pick, c16));
+            smallest = _mm_cmpeq_epi16(smallest, pa);
+            pick = _mm_or_si128(_mm_and_si128(smallest, a16), _mm_andnot_si128(smallest, pick));
+            a = _mm_add_epi8(r, _mm_packus_epi16(pick, zero));
+            c = b;
+            break;
+         }
+      }
+      stbi__png_store_px(cur, a, img_n, out_n, last);
+   }
+}
+#endif
+
+static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
+// one image, or one Adam7 pass of it, unfiltered a row at a time as the
+// inflated data comes in. a pass unfilters into two rows that take turns
+// and copies each one to its pixels in the final image once it's done.
+// with flip set the rows land bottom-up in the image
+typedef struct
+{
+   stbi_uc *out;
+   stbi__uint32 x, y, stride, width_bytes, row; // width_bytes without the filter type
+   int img_n, out_n, depth, color, ring, flip;
+#ifdef STBI_SSE2
+   int simd, avx2;
+#endif
+   // Adam7 pass
+   stbi_uc *final;
+   stbi__uint32 final_x, final_y;
+   int xorig, yorig, xspc, yspc;
+} stbi__png_rows;
 
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+static int stbi__png_rows_init(stbi__png_rows *r, stbi__context *s, stbi_uc *out, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   memset(r, 0, sizeof(*r));
+   if (!stbi__mad3sizes_valid(s->img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   r->out = out;
+   r->x = x;
+   r->y = y;
+   r->stride = x*out_n*bytes;
+   r->width_bytes = (((s->img_n * x * depth) + 7) >> 3);
+   r->img_n = s->img_n;
+   r->out_n = out_n;
+   r->depth = depth;
+   r->color = color;
+   r->flip = s->flip;
+#ifdef STBI_SSE2
+   r->simd = depth == 8 && (r->img_n == 3 || r->img_n == 4) && stbi__call_simd_limit() >= STBI_simd_sse2 && stbi__sse2_available();
+#endif
+#ifdef STBI_AVX2
+   r->avx2 = r->simd && stbi__call_simd_limit() >= STBI_simd_avx2 && stbi__avx2_available();
+#endif
+   return 1;
+}
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
+stbi_inline static stbi_uc *stbi__png_row(stbi__png_rows *r, stbi__uint32 j)
+{
+   if (r->ring) return r->out + r->stride * (j & 1);
+   return r->out + r->stride * (r->flip ? r->y-1-j : j);
+}
 
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
+// expand row j to 8 bits or to native 16-bit order, and copy a pass's row
+// to the final image. the unfiltering of row j+1 needs it as it was, so
+// this runs a row behind
+static void stbi__png_finish_row(stbi__png_rows *r, stbi__uint32 j)
+{
+   stbi__uint32 i, x = r->x;
+   int k, img_n = r->img_n, out_n = r->out_n, depth = r->depth;
+   stbi_uc *cur = stbi__png_row(r, j);
 
-      if (depth < 8) {
-         STBI_ASSERT(img_width_bytes <= x);
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
+   if (depth < 8) {
+      stbi_uc *in  = cur + x*out_n - r->width_bytes;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (r->color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+      // note that the final byte might overshoot and write more data than desired.
+      // we can allocate enough data that this never writes out of memory, but it
+      // could also overwrite the next scanline. can it overwrite non-empty data
+      // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+      // so we need to explicitly clamp the final ones
+
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *cur++ = scale * ((*in >> 4)       );
+            *cur++ = scale * ((*in     ) & 0x0f);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *cur++ = scale * ((*in >> 6)       );
+            *cur++ = scale * ((*in >> 4) & 0x03);
+            *cur++ = scale * ((*in >> 2) & 0x03);
+            *cur++ = scale * ((*in     ) & 0x03);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 6)       );
+         if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *cur++ = scale * ((*in >> 7)       );
+            *cur++ = scale * ((*in >> 6) & 0x01);
+            *cur++ = scale * ((*in >> 5) & 0x01);
+            *cur++ = scale * ((*in >> 4) & 0x01);
+            *cur++ = scale * ((*in >> 3) & 0x01);
+            *cur++ = scale * ((*in >> 2) & 0x01);
+            *cur++ = scale * ((*in >> 1) & 0x01);
+            *cur++ = scale * ((*in     ) & 0x01);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 7)       );
+         if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+      }
+      cur = stbi__png_row(r, j);
+      if (img_n != out_n) {
+         int q;
+         // insert alpha = 255
+         if (img_n == 1) {
+            for (q=x-1; q >= 0; --q) {
+               cur[q*2+1] = 255;
+               cur[q*2+0] = cur[q];
+            }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (q=x-1; q >= 0; --q) {
+               cur[q*4+3] = 255;
+               cur[q*4+2] = cur[q*3+2];
+               cur[q*4+1] = cur[q*3+1];
+               cur[q*4+0] = cur[q*3+0];
+            }
+         }
+      }
+   } else if (depth == 16) {
+      // force the image data from big-endian to platform-native.
+      // this is done a row behind due to the decoding relying
+      // on the data being untouched
+      stbi__uint16 *cur16 = (stbi__uint16*)cur;
+      for(i=0; i < x*out_n; ++i,cur16++,cur+=2) {
+         *cur16 = (cur[0] << 8) | cur[1];
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      cur = stbi__png_row(r, j);
+   }
+
+   if (r->final) {
+      int out_bytes = out_n * (depth == 16 ? 2 : 1);
+      stbi__uint32 final_j = j*r->yspc+r->yorig;
+      stbi_uc *dest = r->final + ((r->flip ? r->final_y-1-final_j : final_j)*r->final_x + r->xorig)*out_bytes;
+      for (i=0; i < x; ++i)
+         memcpy(dest + i*r->xspc*out_bytes, cur + i*out_bytes, out_bytes);
+   }
+}
+
+// unfilter the next row from raw, which starts with its filter type
+static int stbi__png_unfilter_row(stbi__png_rows *r, stbi_uc *raw)
+{
+   int bytes = (r->depth == 16? 2 : 1);
+   stbi__uint32 i, j = r->row, x = r->x;
+   int k;
+   int img_n = r->img_n, out_n = r->out_n, depth = r->depth;
+   int output_bytes = out_n*bytes;
+   int filter_bytes = img_n*bytes;
+   int width = x;
+   stbi_uc *row = stbi__png_row(r, j);
+   stbi_uc *cur = row;
+   stbi_uc *prior;
+   int filter = *raw++, stage;
+
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+   stage = stbi__stage(STBI__STAGE_transform);
+
+   if (depth < 8) {
+      STBI_ASSERT(r->width_bytes <= x);
+      cur += x*out_n - r->width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
+      filter_bytes = 1;
+      width = r->width_bytes;
+   }
+   // bugfix: need to compute this after 'cur +=' computation above
+   // (the first row has no prior, the filters below don't read it)
+   prior = stbi__png_row(r, j ? j-1 : j) + (cur - row);
 
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
 
+#ifdef STBI_SSE2
+   if (r->simd) {
+      stbi__png_unfilter_row_simd(cur, prior, raw, x, img_n, out_n, filter, r->avx2);
+   } else
+#endif
+   {
       // handle first byte explicitly
       for (k=0; k < filter_bytes; ++k) {
          switch (filter) {
@@ -4422,7 +7387,6 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
          }
          #undef STBI__CASE
-         raw += nk;
       } else {
          STBI_ASSERT(img_n+1 == out_n);
          #define STBI__CASE(f) \
@@ -4443,7 +7407,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          // the loop above sets the high byte of the pixels' alpha, but for
          // 16 bit png files we also need the low byte set. we'll do that here.
          if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
+            cur = row; // start at the beginning of the row again
             for (i=0; i < x; ++i,cur+=output_bytes) {
                cur[filter_bytes+1] = 255;
             }
@@ -4451,136 +7415,302 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       }
    }
 
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
-      }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
-
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
-      }
-   }
-
+   stbi__stage(STBI__STAGE_convert);
+   if (j > 0) stbi__png_finish_row(r, j-1);
+   if (++r->row == r->y) stbi__png_finish_row(r, j);
+   stbi__stage(stage);
    return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+// the image, or its Adam7 passes, fed from the inflated data in order
+typedef struct
 {
-   int bytes = (depth == 16 ? 2 : 1);
-   int out_bytes = out_n * bytes;
-   stbi_uc *final;
+   stbi__png_rows pass[7];
+   stbi__uint32 pass_end[7];  // where each one's data ends in the inflated stream
+   int passes;
+   stbi_uc *final, *rings;
+} stbi__png_image;
+
+static int stbi__png_image_init(stbi__png *a, stbi__png_image *im, int out_n, int depth, int color, int interlaced)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__context *s = a->s;
+   int out_bytes = out_n * (depth == 16 ? 2 : 1);
+   stbi__uint32 end = 0, ring_bytes = 0;
    int p;
-   if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+
+   memset(im, 0, sizeof(*im));
+   if (!interlaced) {
+      a->out = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_bytes, 0); // extra bytes to write off the end into
+      if (!a->out) return stbi__err("outofmem", "Out of memory");
+      if (!stbi__png_rows_init(&im->pass[0], s, a->out, out_n, s->img_x, s->img_y, depth, color)) return 0;
+      im->pass_end[0] = (im->pass[0].width_bytes + 1) * s->img_y;
+      im->passes = 1;
+      return 1;
+   }
 
    // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+   im->final = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_bytes, 0);
+   if (!im->final) return stbi__err("outofmem", "Out of memory");
    for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
       // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
-      if (x && y) {
-         stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j) {
-            for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                      a->out + (j*x+i)*out_bytes, out_bytes);
-            }
+      stbi__uint32 x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      stbi__png_rows *r = &im->pass[im->passes];
+      if (!x || !y) continue;
+      if (!stbi__png_rows_init(r, s, NULL, out_n, x, y, depth, color)) return 0;
+      r->ring = 1;
+      r->final = im->final;
+      r->final_x = s->img_x;
+      r->final_y = s->img_y;
+      r->xorig = xorig[p];
+      r->yorig = yorig[p];
+      r->xspc = xspc[p];
+      r->yspc = yspc[p];
+      end += (r->width_bytes + 1) * y;
+      im->pass_end[im->passes++] = end;
+      ring_bytes += 2 * r->stride;
+   }
+   im->rings = (stbi_uc *) stbi__scratch_malloc(ring_bytes);
+   if (!im->rings) return stbi__err("outofmem", "Out of memory");
+   for (p=0, ring_bytes=0; p < im->passes; ++p) {
+      im->pass[p].out = im->rings + ring_bytes;
+      ring_bytes += 2 * im->pass[p].stride;
+   }
+   return 1;
+}
+
+// streaming: the inflated data goes through a window that only keeps what
+// deflate can still refer back to and the row in progress, the rows are
+// unfiltered as soon as they're all in
+typedef struct
+{
+   stbi__png_image *im;
+   int current;              // image or pass being fed
+   stbi__uint32 consumed;    // bytes of the window it has taken
+} stbi__png_stream;
+
+static int stbi__png_stream_rows(stbi__png_stream *st, stbi__zbuf *z)
+{
+   stbi__uint32 have = (stbi__uint32) (z->zout - z->zout_start);
+   while (st->current < st->im->passes) {
+      stbi__png_rows *r = &st->im->pass[st->current];
+      if (have - st->consumed < r->width_bytes + 1) break;
+      if (!stbi__png_unfilter_row(r, (stbi_uc *) z->zout_start + st->consumed)) return 0;
+      st->consumed += r->width_bytes + 1;
+      if (r->row == r->y) ++st->current;
+   }
+   return 1;
+}
+
+static int stbi__png_stream_flush(stbi__zbuf *z, int n)
+{
+   stbi__png_stream *st = (stbi__png_stream *) z->z_user;
+   stbi__uint32 have, from;
+   if (!stbi__png_stream_rows(st, z)) return 0;
+   if (st->current == st->im->passes) {
+      // every row is in, anything after them is of no use
+      z->z_stop = 1;
+      return 0;
+   }
+   have = (stbi__uint32) (z->zout - z->zout_start);
+   from = have > 32768 ? have - 32768 : 0;
+   if (from > st->consumed) from = st->consumed;
+   memmove(z->zout_start, z->zout_start + from, have - from);
+   st->consumed -= from;
+   z->zout = z->zout_start + (have - from);
+   // what's left is the history or a partial row, the window was sized for
+   // either plus the longest stored block
+   if (z->zout_end - z->zout < n) return stbi__err("output buffer limit","Corrupt PNG");
+   return 1;
+}
+
+#define STBI__PNG_WINDOW  (1 << 18)
+
+// big enough to never grow: after a flush it holds at most the 32KB of
+// history or the row in progress, and inflate asks for at most 64KB more
+static stbi__uint32 stbi__png_window_size(stbi__png_image *im)
+{
+   stbi__uint32 row = 0, size;
+   int p;
+   for (p=0; p < im->passes; ++p)
+      if (im->pass[p].width_bytes + 1 > row) row = im->pass[p].width_bytes + 1;
+   size = (row > 32768 ? row : 32768) + 65536;
+   return size > STBI__PNG_WINDOW ? size : STBI__PNG_WINDOW;
+}
+
+static int stbi__png_inflate_streaming(stbi__png_image *im, stbi__zbuf *z, int parse_header)
+{
+   stbi__png_stream st;
+   stbi__uint32 window = stbi__png_window_size(im);
+   int ok;
+   st.im = im;
+   st.current = 0;
+   st.consumed = 0;
+   z->zout_start = (char *) stbi__scratch_malloc(window);
+   if (!z->zout_start) return stbi__err("outofmem", "Out of memory");
+   z->zout = z->zout_start;
+   z->zout_end = z->zout_start + window;
+   z->z_expandable = 1;
+   z->z_fast = stbi__call_fast_inflate();
+   z->z_flush = stbi__png_stream_flush;
+   z->z_user = &st;
+   z->z_stop = 0;
+   ok = stbi__parse_zlib(z, parse_header) || z->z_stop;
+   if (ok) ok = stbi__png_stream_rows(&st, z);
+   if (ok && st.current < im->passes) ok = stbi__err("not enough pixels","Corrupt PNG");
+   stbi__scratch_free(z->zout_start);
+   return ok;
+}
+
+#ifndef STBI_NO_THREADS
+// interlaced images on several threads: one task inflates the whole stream
+// into one buffer, the others unfilter each pass as soon as its data is
+// in, all seven at once if there are threads for them. no task waits on
+// one that hasn't started
+#define STBI__PNG_CHUNK  (1 << 18)
+
+typedef struct
+{
+   stbi__png_image *im;
+   stbi__zbuf *z;
+   int parse_header;
+   stbi_uc *raw;
+   stbi__uint32 total;
+   stbi__atomic inflated, inflate_busy, done, stop, error;
+   stbi__atomic claimed[7];
+} stbi__png_pipeline;
+
+static int stbi__png_threads(stbi__png *a, int interlaced)
+{
+   int threads = stbi__call_threads();
+   if (!interlaced || threads < 2 || a->s->img_x * a->s->img_y < (1u << 18)) return 1;
+   return threads < 8 ? threads : 8;
+}
+
+// tells the pass tasks how far the data is, a chunk at a time
+static int stbi__png_pipeline_flush(stbi__zbuf *z, int n)
+{
+   stbi__png_pipeline *p = (stbi__png_pipeline *) z->z_user;
+   stbi__uint32 have = (stbi__uint32) (z->zout - z->zout_start);
+   char *end;
+   stbi__atomic_set(&p->inflated, (long) have);
+   if (have >= p->total) {
+      z->z_stop = 1;
+      return 0;
+   }
+   // the buffer has room for the largest block past the end, so a match
+   // or stored block that runs over it still fits
+   end = z->zout_end + STBI__PNG_CHUNK;
+   if (end > z->zout_start + p->total + 65536) end = z->zout_start + p->total + 65536;
+   if (end - z->zout < n) return stbi__err("output buffer limit","Corrupt PNG");
+   z->zout_end = end;
+   return 1;
+}
+
+// the task that failed has set the caller's failure reason
+static void stbi__png_pipeline_fail(stbi__png_pipeline *p)
+{
+   stbi__atomic_set(&p->error, 1);
+   stbi__atomic_set(&p->stop, 1);
+}
+
+static void stbi__png_pipeline_task(void *task_data, int index)
+{
+   stbi__png_pipeline *p = (stbi__png_pipeline *) task_data;
+   stbi__png_image *im = p->im;
+   STBI_NOTUSED(index);
+
+   while (!stbi__atomic_get(&p->stop) && stbi__atomic_get(&p->done) < im->passes) {
+      long inflated = stbi__atomic_get(&p->inflated);
+      int k;
+      for (k=0; k < im->passes; ++k)
+         if (!stbi__atomic_get(&p->claimed[k]) && inflated >= (long) im->pass_end[k] && stbi__atomic_cas(&p->claimed[k], 0, 1))
+            break;
+      if (k < im->passes) {
+         stbi__png_rows *r = &im->pass[k];
+         stbi_uc *raw = p->raw + (k ? im->pass_end[k-1] : 0);
+         while (r->row < r->y) {
+            if (!stbi__png_unfilter_row(r, raw)) { stbi__png_pipeline_fail(p); break; }
+            raw += r->width_bytes + 1;
          }
-         STBI_FREE(a->out);
-         image_data += img_len;
-         image_data_len -= img_len;
+         stbi__atomic_add(&p->done, 1);
+         continue;
+      }
+      // only ever taken once
+      if (stbi__atomic_cas(&p->inflate_busy, 0, 1)) {
+         stbi__zbuf *z = p->z;
+         if (!stbi__parse_zlib(z, p->parse_header) && !z->z_stop)
+            stbi__png_pipeline_fail(p);
+         else if ((stbi__uint32) (z->zout - z->zout_start) < p->total) {
+            stbi__err("not enough pixels","Corrupt PNG");
+            stbi__png_pipeline_fail(p);
+         } else
+            stbi__atomic_set(&p->inflated, (long) p->total);
+         continue;
       }
+      stbi__idle();
    }
-   a->out = final;
+}
 
-   return 1;
+static int stbi__png_inflate_threaded(stbi__png_image *im, stbi__zbuf *z, int parse_header, int threads)
+{
+   stbi__png_pipeline p;
+   memset(&p, 0, sizeof(p));
+   p.im = im;
+   p.z = z;
+   p.parse_header = parse_header;
+   p.total = im->pass_end[im->passes-1];
+   p.raw = (stbi_uc *) stbi__scratch_malloc_mad2(1, p.total, 65536);
+   if (!p.raw) return stbi__err("outofmem", "Out of memory");
+   z->zout_start = (char *) p.raw;
+   z->zout = z->zout_start;
+   z->zout_end = z->zout_start + (p.total < STBI__PNG_CHUNK ? p.total : STBI__PNG_CHUNK);
+   z->z_expandable = 1;
+   z->z_fast = stbi__call_fast_inflate();
+   z->z_flush = stbi__png_pipeline_flush;
+   z->z_user = &p;
+   z->z_stop = 0;
+
+   stbi__parallel(stbi__png_pipeline_task, &p, threads);
+
+   stbi__scratch_free(p.raw);
+   return !p.error;
+}
+#endif
+
+// inflate the image data and unfilter it as it comes
+static int stbi__create_png_image(stbi__png *a, stbi__uint32 idata_len, int out_n, int depth, int color, int interlaced, int parse_header)
+{
+   stbi__png_image im;
+   stbi__zbuf z;
+   int ok;
+
+   if (!stbi__png_image_init(a, &im, out_n, depth, color, interlaced)) {
+      if (im.final) stbi__free(im.final);
+      if (im.rings) stbi__scratch_free(im.rings);
+      return 0;
+   }
+   z.zbuffer = a->idata;
+   z.zbuffer_end = a->idata + idata_len;
+#ifndef STBI_NO_THREADS
+   if (stbi__png_threads(a, interlaced) > 1)
+      ok = stbi__png_inflate_threaded(&im, &z, parse_header, stbi__png_threads(a, interlaced));
+   else
+#endif
+      ok = stbi__png_inflate_streaming(&im, &z, parse_header);
+
+   if (im.rings) stbi__scratch_free(im.rings);
+   if (interlaced) {
+      if (ok)
+         a->out = im.final;
+      else
+         stbi__free(im.final);
+   }
+   return ok;
 }
 
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
@@ -4662,7 +7792,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
+   stbi__free(a->out);
    a->out = temp_out;
 
    STBI_NOTUSED(len);
@@ -4670,9 +7800,6 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
-
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
    stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
@@ -4698,7 +7825,7 @@ static void stbi__de_iphone(stbi__png *z)
       }
    } else {
       STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      if (s->unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -4734,10 +7861,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    stbi_uc has_trans=0, tc[3];
    stbi__uint16 tc16[3];
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, stage;
    stbi__context *s = z->s;
 
-   z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
 
@@ -4770,7 +7896,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
-               if (scan == STBI__SCAN_header) return 1;
+               // a tRNS adds an alpha channel, so SCAN_header has to look for one too
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
@@ -4809,6 +7935,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
                has_trans = 1;
+               // a color key is decoded as alpha, which is all SCAN_header wanted to know
+               if (scan == STBI__SCAN_header) { ++s->img_n; return 1; }
                if (z->depth == 16) {
                   for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
                } else {
@@ -4821,16 +7949,18 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
-            if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            // no tRNS before the first IDAT means there is none
+            if (scan == STBI__SCAN_header) { if (pal_img_n) s->img_n = pal_img_n; return 1; }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
                stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
+               if (idata_limit == 0) idata_limit = stbi__png_idata_size(s, c.length);
+               if (idata_limit < 4096) idata_limit = 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__scratch_realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -4839,21 +7969,16 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (!stbi__create_png_image(z, ioff, s->img_out_n, z->depth, color, interlace, !is_iphone)) return 0;
+            stbi__scratch_free(z->idata); z->idata = NULL;
+            stage = stbi__stage(STBI__STAGE_convert);
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -4861,7 +7986,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                   if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (is_iphone && s->de_iphone && s->img_out_n > 2)
                stbi__de_iphone(z);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
@@ -4874,7 +7999,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__stage(stage);
             return 1;
          }
 
@@ -4911,11 +8036,12 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
          ri->bits_per_channel = p->depth;
       result = p->out;
       p->out = NULL;
+      p->s->flipped = p->s->flip; // the rows went in bottom-up already
       if (req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
-            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            result = stbi__convert_format(p->s, (unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          else
-            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            result = stbi__convert_format16(p->s, (stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          p->s->img_out_n = req_comp;
          if (result == NULL) return result;
       }
@@ -4923,9 +8049,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);           p->out   = NULL;
+   stbi__scratch_free(p->idata); p->idata = NULL;
 
    return result;
 }
@@ -5185,7 +8310,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5197,7 +8322,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
@@ -5252,7 +8377,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
@@ -5305,7 +8430,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
 
    if (req_comp && req_comp != target) {
-      out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
+      out = stbi__convert_format(s, out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
 
@@ -5524,7 +8649,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5535,8 +8660,8 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
@@ -5617,7 +8742,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -5636,7 +8761,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    // convert to target component count
    if (req_comp && req_comp != tga_comp)
-      tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+      tga_data = stbi__convert_format(s, tga_data, tga_comp, req_comp, tga_width, tga_height);
 
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -5805,7 +8930,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -5881,9 +9006,9 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
    // convert to desired output format
    if (req_comp && req_comp != 4) {
       if (ri->bits_per_channel == 16)
-         out = (stbi_uc *) stbi__convert_format16((stbi__uint16 *) out, 4, req_comp, w, h);
+         out = (stbi_uc *) stbi__convert_format16(s, (stbi__uint16 *) out, 4, req_comp, w, h);
       else
-         out = stbi__convert_format(out, 4, req_comp, w, h);
+         out = stbi__convert_format(s, out, 4, req_comp, w, h);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
 
@@ -6092,13 +9217,13 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
    *py = y;
    if (req_comp == 0) req_comp = *comp;
-   result=stbi__convert_format(result,4,req_comp,x,y);
+   result=stbi__convert_format(s,result,4,req_comp,x,y);
 
    return result;
 }
@@ -6180,7 +9305,7 @@ static int stbi__gif_header(stbi__context *s, stbi__gif *g, int *comp, int is_in
    if (version != '7' && version != '9')    return stbi__err("not GIF", "Corrupt GIF");
    if (stbi__get8(s) != 'a')                return stbi__err("not GIF", "Corrupt GIF");
 
-   stbi__g_failure_reason = "";
+   stbi__call_state()->failure_reason = "";
    g->w = stbi__get16le(s);
    g->h = stbi__get16le(s);
    g->flags = stbi__get8(s);
@@ -6202,13 +9327,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6346,7 +9471,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
    // on first frame, any non-written pixels get the background colour (non-transparent)
    first_frame = 0; 
    if (g->out == 0) {
-      if (!stbi__gif_header(s, g, comp,0))     return 0; // stbi__g_failure_reason set by stbi__gif_header
+      if (!stbi__gif_header(s, g, comp,0))     return 0; // failure reason set by stbi__gif_header
       g->out = (stbi_uc *) stbi__malloc(4 * g->w * g->h);
       g->background = (stbi_uc *) stbi__malloc(4 * g->w * g->h); 
       g->history = (stbi_uc *) stbi__malloc(g->w * g->h); 
@@ -6523,9 +9648,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4; 
          
             if (out) {
-               out = (stbi_uc*) STBI_REALLOC( out, layers * stride ); 
+               out = (stbi_uc*) stbi__realloc_sized( out, (layers - 1) * stride, layers * stride ); 
                if (delays) {
-                  *delays = (int*) STBI_REALLOC( *delays, sizeof(int) * layers ); 
+                  *delays = (int*) stbi__realloc_sized( *delays, sizeof(int) * (layers - 1), sizeof(int) * layers ); 
                }
             } else {
                out = (stbi_uc*)stbi__malloc( layers * stride ); 
@@ -6545,13 +9670,13 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0); 
 
       // free temp buffer; 
-      STBI_FREE(g.out); 
-      STBI_FREE(g.history); 
-      STBI_FREE(g.background); 
+      stbi__free(g.out); 
+      stbi__free(g.history); 
+      stbi__free(g.background); 
 
       // do the final conversion after loading everything; 
       if (req_comp && req_comp != 4)
-         out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
+         out = stbi__convert_format(NULL, out, 4, req_comp, layers * g.w, g.h); // the caller flips each frame
 
       *z = layers; 
       return out;
@@ -6575,12 +9700,12 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
       // moved conversion to after successful load so that the same
       // can be done for multiple frames. 
       if (req_comp && req_comp != 4)
-         u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
+         u = stbi__convert_format(s, u, 4, req_comp, g.w, g.h);
    }
 
    // free buffers needed for multiple frame loading; 
-   STBI_FREE(g.history);
-   STBI_FREE(g.background); 
+   stbi__free(g.history);
+   stbi__free(g.background); 
 
    return u;
 }
@@ -6676,7 +9801,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    float *hdr_data;
    int len;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2, z, stage;
    const char *headerToken;
    STBI_NOTUSED(ri);
 
@@ -6750,16 +9875,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
             scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
@@ -6773,22 +9898,24 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = value;
                } else {
                   // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = stbi__get8(s);
                }
             }
          }
+         stage = stbi__stage(STBI__STAGE_convert);
          for (i=0; i < width; ++i)
             stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         stbi__stage(stage);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
@@ -7026,7 +10153,7 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
    stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
 
    if (req_comp && req_comp != s->img_n) {
-      out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
+      out = stbi__convert_format(s, out, s->img_n, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
    return out;
@@ -7184,6 +10311,19 @@ STBIDEF int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
    return r;
 }
 
+STBIDEF int stbi_info_ex(char const *filename, int *x, int *y, int *comp, stbi_load_options *opt)
+{
+   stbi__call call, *saved = stbi__begin_call(&call, opt);
+   stbi__file_source src;
+   stbi__context s;
+   int r = 0;
+   if (stbi__start_filename(&s, &src, filename)) {
+      r = stbi__info_main(&s,x,y,comp);
+      stbi__end_filename(&src);
+   }
+   return stbi__end_call(&call, saved, opt, r);
+}
+
 STBIDEF int stbi_is_16_bit(char const *filename)
 {
     FILE *f = stbi__fopen(filename, "rb");
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Scale the cube field from 10 to 1M instances and record the instanced and
+# per-object draw paths side by side.
+#
+#   usage: benchmarks/instance_sweep.sh [build dir] [output dir]
+#
+# the build dir has to sit directly under the repo root (the app loads
+# ../shaders and ../textures). FRAMES, WIDTH and HEIGHT can be overridden
+# from the environment, the defaults keep a 1M run short on llvmpipe.
+set -e
+
+BUILD_DIR=${1:-build}
+OUT_DIR=${2:-instance_sweep}
+FRAMES=${FRAMES:-30}
+WIDTH=${WIDTH:-1280}
+HEIGHT=${HEIGHT:-720}
+
+mkdir -p "$OUT_DIR"
+OUT_DIR=$(cd "$OUT_DIR" && pwd)
+cd "$BUILD_DIR"
+
+printf "%-10s %-10s %12s %12s %12s\n" instances path cpu_p50_ms cpu_p99_ms gpu_p50_ms
+for count in 10 100 1000 10000 100000 1000000; do
+	for path in instanced per-object; do
+		flag=""
+		[ "$path" = "per-object" ] && flag="--no-instancing"
+		json="$OUT_DIR/instances_${count}_${path}.json"
+		./HelloWindow --headless --benchmark "$json" --frames "$FRAMES" --warmup 3 \
+			--instances "$count" $flag --width "$WIDTH" --height "$HEIGHT" > /dev/null
+		cpu=$(sed -n 's/.*"cpu_frame_ms".*"p50": \([0-9.e+-]*\), "p95".*"p99": \([0-9.e+-]*\) }.*/\1 \2/p' "$json")
+		gpu=$(sed -n 's/.*"gpu_frame_ms".*"p50": \([0-9.e+-]*\), "p95".*/\1/p' "$json")
+		printf "%-10s %-10s %12s %12s %12s\n" "$count" "$path" $cpu "$gpu"
+	done
+done
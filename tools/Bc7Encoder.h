@@ -0,0 +1,242 @@
+#ifndef BC7_ENCODER_H
+#define BC7_ENCODER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// BC7 encoder that only uses mode 6: one subset, RGBA endpoints with 7 bits per
+// channel plus a shared p-bit each, 4 bit indices. That is a single line
+// through colour space per 4x4 block, which holds up well for photos and
+// texture art; it gives away some quality on blocks with two distinct colours
+// that the partitioned modes would handle. Endpoints start on the principal
+// axis of the block and are refined with a least squares fit to the chosen
+// indices.
+namespace Bc7
+{
+	static const int WEIGHTS[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	struct Endpoints
+	{
+		int color[2][4];	// 7 bit per channel
+		int pbit[2];
+
+		int value(int e, int c) const
+		{
+			return (color[e][c] << 1) | pbit[e];
+		}
+	};
+
+	// quantise a float endpoint to 7 bits + p-bit, picking the p-bit that
+	// lands closest over all four channels
+	inline void quantise(const float v[4], int color[4], int* pbit)
+	{
+		float bestError = 1e30f;
+		for (int p = 0; p < 2; p++)
+		{
+			int c[4];
+			float error = 0.0f;
+			for (int i = 0; i < 4; i++)
+			{
+				c[i] = std::min(std::max((int)std::lround((v[i] - p) * 0.5f), 0), 127);
+				float d = (float)((c[i] << 1) | p) - v[i];
+				error += d * d;
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				*pbit = p;
+				memcpy(color, c, sizeof(c));
+			}
+		}
+	}
+
+	// best index per pixel for the quantised endpoints, returns the squared error
+	inline int pickIndices(const unsigned char* pixels, const Endpoints& e, int indices[16])
+	{
+		int palette[16][4];
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 4; c++)
+				palette[i][c] = (e.value(0, c) * (64 - WEIGHTS[i]) + e.value(1, c) * WEIGHTS[i] + 32) >> 6;
+		int total = 0;
+		for (int p = 0; p < 16; p++)
+		{
+			const unsigned char* px = pixels + p * 4;
+			int best = 0, bestError = 1 << 30;
+			for (int i = 0; i < 16; i++)
+			{
+				int error = 0;
+				for (int c = 0; c < 4; c++)
+				{
+					int d = palette[i][c] - px[c];
+					error += d * d;
+				}
+				if (error < bestError)
+				{
+					bestError = error;
+					best = i;
+				}
+			}
+			indices[p] = best;
+			total += bestError;
+		}
+		return total;
+	}
+
+	// endpoints minimising the error for fixed indices, per channel:
+	// minimise sum((1 - w) a + w b - x)^2 over a, b
+	inline bool refit(const unsigned char* pixels, const int indices[16], float a[4], float b[4])
+	{
+		float aa = 0, ab = 0, bb = 0, ax[4] = {}, bx[4] = {};
+		for (int p = 0; p < 16; p++)
+		{
+			float w = WEIGHTS[indices[p]] / 64.0f, iw = 1.0f - w;
+			aa += iw * iw;
+			ab += iw * w;
+			bb += w * w;
+			for (int c = 0; c < 4; c++)
+			{
+				ax[c] += iw * pixels[p * 4 + c];
+				bx[c] += w * pixels[p * 4 + c];
+			}
+		}
+		float det = aa * bb - ab * ab;
+		if (std::fabs(det) < 1e-6f)
+			return false;
+		for (int c = 0; c < 4; c++)
+		{
+			a[c] = std::min(std::max((ax[c] * bb - bx[c] * ab) / det, 0.0f), 255.0f);
+			b[c] = std::min(std::max((bx[c] * aa - ax[c] * ab) / det, 0.0f), 255.0f);
+		}
+		return true;
+	}
+
+	// writes count bits of value at bit position *at, least significant first
+	inline void putBits(unsigned char out[16], int* at, int value, int count)
+	{
+		for (int i = 0; i < count; i++, (*at)++)
+			if (value & (1 << i))
+				out[*at >> 3] |= (unsigned char)(1 << (*at & 7));
+	}
+
+	// pixels: 16 RGBA texels, row by row. out: the 16 byte block
+	// ------------------------------------------------------------------------
+	inline void encodeBlock(const unsigned char* pixels, unsigned char out[16])
+	{
+		// principal axis of the block through its mean, by power iteration
+		float mean[4] = {};
+		for (int p = 0; p < 16; p++)
+			for (int c = 0; c < 4; c++)
+				mean[c] += pixels[p * 4 + c] / 16.0f;
+		float cov[4][4] = {};
+		for (int p = 0; p < 16; p++)
+		{
+			float d[4];
+			for (int c = 0; c < 4; c++)
+				d[c] = pixels[p * 4 + c] - mean[c];
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+					cov[i][j] += d[i] * d[j];
+		}
+		float axis[4] = { 1.0f, 1.0f, 1.0f, 0.25f };
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[4] = {};
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+					next[i] += cov[i][j] * axis[j];
+			float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2] + next[3] * next[3]);
+			if (length < 1e-6f)
+				break;
+			for (int i = 0; i < 4; i++)
+				axis[i] = next[i] / length;
+		}
+		float lo = 1e30f, hi = -1e30f;
+		for (int p = 0; p < 16; p++)
+		{
+			float t = 0.0f;
+			for (int c = 0; c < 4; c++)
+				t += (pixels[p * 4 + c] - mean[c]) * axis[c];
+			lo = std::min(lo, t);
+			hi = std::max(hi, t);
+		}
+		float a[4], b[4];
+		for (int c = 0; c < 4; c++)
+		{
+			a[c] = std::min(std::max(mean[c] + lo * axis[c], 0.0f), 255.0f);
+			b[c] = std::min(std::max(mean[c] + hi * axis[c], 0.0f), 255.0f);
+		}
+
+		Endpoints best;
+		int bestIndices[16];
+		int bestError = 1 << 30;
+		for (int pass = 0; pass < 3; pass++)
+		{
+			Endpoints e;
+			quantise(a, e.color[0], &e.pbit[0]);
+			quantise(b, e.color[1], &e.pbit[1]);
+			int indices[16];
+			int error = pickIndices(pixels, e, indices);
+			if (error < bestError)
+			{
+				bestError = error;
+				best = e;
+				memcpy(bestIndices, indices, sizeof(indices));
+			}
+			if (bestError == 0 || !refit(pixels, indices, a, b))
+				break;
+		}
+
+		// the first index is stored with its top bit implied zero
+		if (bestIndices[0] & 8)
+		{
+			std::swap(best.color[0], best.color[1]);
+			std::swap(best.pbit[0], best.pbit[1]);
+			for (int p = 0; p < 16; p++)
+				bestIndices[p] = 15 - bestIndices[p];
+		}
+
+		memset(out, 0, 16);
+		int at = 0;
+		putBits(out, &at, 1 << 6, 7);	// mode 6
+		for (int c = 0; c < 4; c++)
+		{
+			putBits(out, &at, best.color[0][c], 7);
+			putBits(out, &at, best.color[1][c], 7);
+		}
+		putBits(out, &at, best.pbit[0], 1);
+		putBits(out, &at, best.pbit[1], 1);
+		putBits(out, &at, bestIndices[0], 3);
+		for (int p = 1; p < 16; p++)
+			putBits(out, &at, bestIndices[p], 4);
+	}
+
+	// whole RGBA8 image, 16 bytes per 4x4 block in row order. edge blocks of
+	// sizes that aren't a multiple of 4 repeat the last row / column.
+	// rows [firstBlockRow, endBlockRow) only, so callers can split the work.
+	// ------------------------------------------------------------------------
+	inline void encodeImage(const unsigned char* rgba, int width, int height, unsigned char* out,
+		int firstBlockRow, int endBlockRow)
+	{
+		int blocksX = (width + 3) / 4;
+		unsigned char block[64];
+		for (int by = firstBlockRow; by < endBlockRow; by++)
+		{
+			for (int bx = 0; bx < blocksX; bx++)
+			{
+				for (int y = 0; y < 4; y++)
+				{
+					int sy = std::min(by * 4 + y, height - 1);
+					for (int x = 0; x < 4; x++)
+					{
+						int sx = std::min(bx * 4 + x, width - 1);
+						memcpy(block + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+					}
+				}
+				encodeBlock(block, out + ((size_t)by * blocksX + bx) * 16);
+			}
+		}
+	}
+}
+#endif
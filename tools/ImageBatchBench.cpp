@@ -0,0 +1,466 @@
+// Decodes every image in a set of directories (a game's texture folder, or
+// what tools/MakeImageCorpus writes) with stb_image, the way a loading
+// screen would, and reports throughput per format path and for the batch:
+//
+//     ImageBatchBench [--threads N] [--runs N] [--channels N] [--cold] [--json out.json] dir...
+//
+// files are sorted by the path stb_image takes through them: jpeg baseline
+// (with restart markers or not) and progressive, png 8-bit, 16-bit and
+// interlaced, tga, bmp, hdr, gif, and psd/pic/pnm; files it can't read are
+// skipped. each one is read into memory (the "io" time) and decoded from
+// there with stbi_load_from_memory_ex to --channels (4 by default) at 8 bits,
+// with a scratch arena per thread and stage timing on, which splits the
+// decode into "decode" (Huffman, inflate, RLE, LZW), "transform" (IDCT, PNG
+// unfiltering), "convert" (upsampling, colour and channel conversion, 16 to
+// 8 bits, HDR tone mapping) and "wait" (threads idle inside a decode). the
+// batch runs three ways:
+//   - serial: one image after another on one thread;
+//   - per image: one image after another, each split between N threads with
+//     the load options' parallel_for (big JPEGs and interlaced PNGs split);
+//   - per file: N threads each taking the next file.
+// N is --threads, the hardware threads by default and at least 2. the
+// batch lines are wall clock, best of --runs; the format lines add up the
+// time spent on their files on whichever thread, so their MB/s (of file
+// bytes) is per thread. stage times are summed over threads too. peak RSS is
+// the high water mark over the mode (reset between modes on Linux, the
+// process's so far elsewhere). every decode has to give the same pixels as
+// the serial one. with --cold the files are dropped from the page cache
+// before every run (Linux only).
+#define STBI_STAGE_TIMING
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+void dropFromCache(const std::string& path)
+{
+#if defined(__linux__)
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#else
+	(void)path;
+#endif
+}
+
+// on Linux the peak can be put back to what's resident now
+void resetPeakRss()
+{
+#if defined(__linux__)
+	std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+// in MB, 0 where we can't tell
+double peakRssMb()
+{
+#if defined(__linux__)
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return atof(line.c_str() + 6) / 1024.0;
+	return 0.0;
+#elif !defined(_WIN32)
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1048576.0;
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#else
+	return 0.0;
+#endif
+}
+
+bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data.resize(size > 0 ? (size_t)size : 0);
+	bool ok = size > 0 && fread(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return ok;
+}
+
+// the decoder stb_image picks for the file, and which of its paths
+std::string formatPath(const std::vector<unsigned char>& data)
+{
+	const unsigned char* p = data.data();
+	size_t n = data.size();
+	if (n > 3 && p[0] == 0xFF && p[1] == 0xD8)
+	{
+		// the frame header says baseline or progressive, a DRI before it restarts
+		bool restarts = false;
+		for (size_t at = 2; at + 4 <= n;)
+		{
+			if (p[at] != 0xFF)
+				break;
+			int marker = p[at + 1];
+			if (marker == 0xFF)
+			{
+				at++;
+				continue;
+			}
+			if (marker == 0xDD && at + 6 <= n && (p[at + 4] | p[at + 5]))
+				restarts = true;
+			if (marker == 0xC2)
+				return "jpeg progressive";
+			if (marker == 0xC0 || marker == 0xC1)
+				return restarts ? "jpeg baseline rst" : "jpeg baseline";
+			at += 2 + ((p[at + 2] << 8) | p[at + 3]);
+		}
+		return "jpeg";
+	}
+	if (n > 29 && memcmp(p, "\x89PNG", 4) == 0)
+	{
+		// IHDR: depth at 24, interlace at 28
+		if (p[28])
+			return "png interlaced";
+		return p[24] == 16 ? "png 16-bit" : "png 8-bit";
+	}
+	if (n > 2 && p[0] == 'B' && p[1] == 'M')
+		return "bmp";
+	if (n > 4 && memcmp(p, "GIF8", 4) == 0)
+		return "gif";
+	if (n > 2 && p[0] == '#' && p[1] == '?')
+		return "hdr";
+	if (n > 4 && memcmp(p, "8BPS", 4) == 0)
+		return "psd";
+	if (n > 4 && p[0] == 0x53 && p[1] == 0x80 && p[2] == 0xF6 && p[3] == 0x34)
+		return "pic";
+	if (n > 2 && p[0] == 'P' && (p[1] == '5' || p[1] == '6'))
+		return "pnm";
+	// stb_image tries TGA last, on what's left
+	return "tga";
+}
+
+struct Image
+{
+	std::string path, format;
+	size_t fileBytes = 0;
+	unsigned long long hash = 0;	// of the serial decode
+};
+
+// what one decode, or a sum of them, took
+struct Stats
+{
+	int files = 0;
+	size_t fileBytes = 0;
+	double ms = 0.0, io = 0.0;
+	stbi_stage_times stages = {};
+
+	void add(const Stats& other)
+	{
+		files += other.files;
+		fileBytes += other.fileBytes;
+		ms += other.ms;
+		io += other.io;
+		stages.decode += other.stages.decode;
+		stages.transform += other.stages.transform;
+		stages.convert += other.stages.convert;
+		stages.wait += other.stages.wait;
+		stages.read += other.stages.read;
+	}
+};
+
+struct Mode
+{
+	std::string name;
+	int threads = 1;
+	double wallMs = 1e30, peakRss = 0.0;
+	std::map<std::string, Stats> formats;
+	Stats total;
+};
+
+unsigned long long hashPixels(const unsigned char* pixels, size_t bytes)
+{
+	unsigned long long h = 1469598103934665603ull;
+	size_t i = 0;
+	for (; i + 8 <= bytes; i += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, pixels + i, 8);
+		h = (h ^ word) * 1099511628211ull;
+	}
+	for (; i < bytes; i++)
+		h = (h ^ pixels[i]) * 1099511628211ull;
+	return h;
+}
+
+// read and decode one image, on this thread's buffer and arena, split over
+// pool when there is one
+bool decode(const Image& image, int channels, ThreadPool* pool, int threads, std::vector<unsigned char>& buffer, stbi_arena& arena,
+	Stats& stats, unsigned long long& hash)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (!readFile(image.path, buffer))
+	{
+		std::cout << "ERROR::BATCHBENCH::can't read " << image.path << std::endl;
+		return false;
+	}
+	std::chrono::steady_clock::time_point read = std::chrono::steady_clock::now();
+	stbi_load_options options;
+	stbi_load_options_init(&options);
+	options.desired_channels = channels;
+	options.scratch = &arena.allocator;
+	options.stage_times = &stats.stages;
+	if (pool)
+	{
+		options.parallel_for = ThreadPool::runTasks;
+		options.parallel_user = pool;
+		options.parallel_threads = threads;
+	}
+	int width, height, fileChannels;
+	unsigned char* pixels = stbi_load_from_memory_ex(buffer.data(), (int)buffer.size(), &width, &height, &fileChannels, &options);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	stbi_arena_reset(&arena);
+	if (!pixels)
+	{
+		std::cout << "ERROR::BATCHBENCH::can't decode " << image.path << ": " << options.failure_reason << std::endl;
+		return false;
+	}
+	hash = hashPixels(pixels, (size_t)width * height * channels);
+	stbi_image_free(pixels);
+	stats.files = 1;
+	stats.fileBytes = image.fileBytes;
+	stats.io = std::chrono::duration<double, std::milli>(read - start).count();
+	stats.ms = std::chrono::duration<double, std::milli>(end - start).count();
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	int runs = 3, channels = 4;
+	int threads = (int)std::max(2u, std::thread::hardware_concurrency());
+	bool cold = false;
+	const char* json = NULL;
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = std::max(2, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+			runs = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc)
+			channels = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cold") == 0)
+			cold = true;
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			json = argv[++i];
+		else
+			inputs.push_back(argv[i]);
+	}
+	if (inputs.empty() || channels < 1 || channels > 4)
+	{
+		std::cout << "usage: ImageBatchBench [--threads N] [--runs N] [--channels N] [--cold] [--json out.json] dir..." << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> paths;
+	for (const std::string& input : inputs)
+	{
+		std::error_code error;
+		if (std::filesystem::is_regular_file(input, error))
+			paths.push_back(input);
+		else
+			for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(input, error))
+				if (entry.is_regular_file())
+					paths.push_back(entry.path().string());
+		if (error)
+			std::cout << "ERROR::BATCHBENCH::can't list " << input << ": " << error.message() << std::endl;
+	}
+	std::sort(paths.begin(), paths.end());
+
+	// what stb_image reads, and the reference pixels from a plain serial decode
+	std::vector<Image> images;
+	int skipped = 0, failed = 0;
+	std::vector<unsigned char> buffer;
+	for (const std::string& path : paths)
+	{
+		int w, h, c;
+		if (!readFile(path, buffer) || !stbi_info_from_memory(buffer.data(), (int)buffer.size(), &w, &h, &c))
+		{
+			skipped++;
+			continue;
+		}
+		Image image;
+		image.path = path;
+		image.format = formatPath(buffer);
+		image.fileBytes = buffer.size();
+		unsigned char* pixels = stbi_load_from_memory(buffer.data(), (int)buffer.size(), &w, &h, &c, channels);
+		if (!pixels)
+		{
+			std::cout << "ERROR::BATCHBENCH::can't decode " << path << ": " << stbi_failure_reason() << std::endl;
+			failed++;
+			continue;
+		}
+		image.hash = hashPixels(pixels, (size_t)w * h * channels);
+		stbi_image_free(pixels);
+		images.push_back(image);
+	}
+	if (images.empty())
+	{
+		std::cout << "ERROR::BATCHBENCH::no images stb_image can read in";
+		for (const std::string& input : inputs)
+			std::cout << " " << input;
+		std::cout << std::endl;
+		return 1;
+	}
+	std::vector<unsigned char>().swap(buffer);
+
+	// the caller helps, so N - 1 workers
+	ThreadPool pool(threads - 1);
+	std::vector<Mode> modes(3);
+	modes[0].name = "serial";
+	modes[1].name = "per image";
+	modes[1].threads = threads;
+	modes[2].name = "per file";
+	modes[2].threads = threads;
+	for (Mode& mode : modes)
+	{
+		ThreadPool* splitOver = mode.name == "per image" ? &pool : NULL;
+		resetPeakRss();
+		for (int run = 0; run < runs; run++)
+		{
+			if (cold)
+				for (const Image& image : images)
+					dropFromCache(image.path);
+			std::vector<Stats> stats(images.size());
+			std::atomic<size_t> next{ 0 };
+			std::atomic<int> errors{ 0 };
+			// each thread takes the next file; one of them for the first two modes
+			auto work = [&]
+			{
+				std::vector<unsigned char> data;
+				stbi_arena arena;
+				stbi_arena_init(&arena, 0);
+				size_t i;
+				while ((i = next.fetch_add(1)) < images.size())
+				{
+					unsigned long long hash = 0;
+					if (!decode(images[i], channels, splitOver, threads, data, arena, stats[i], hash))
+						errors++;
+					else if (hash != images[i].hash)
+					{
+						std::cout << "ERROR::BATCHBENCH::" << mode.name << " decode of " << images[i].path << " differs from the serial one" << std::endl;
+						errors++;
+					}
+				}
+				stbi_arena_free(&arena);
+			};
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if (mode.name == "per file")
+			{
+				std::vector<std::thread> workers;
+				for (int t = 0; t < threads; t++)
+					workers.emplace_back(work);
+				for (std::thread& worker : workers)
+					worker.join();
+			}
+			else
+				work();
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			failed += errors;
+			if (ms < mode.wallMs)
+			{
+				mode.wallMs = ms;
+				mode.formats.clear();
+				mode.total = Stats();
+				for (size_t i = 0; i < images.size(); i++)
+				{
+					mode.formats[images[i].format].add(stats[i]);
+					mode.total.add(stats[i]);
+				}
+			}
+		}
+		mode.peakRss = peakRssMb();
+	}
+
+	auto mb = [](size_t bytes) { return bytes / 1048576.0; };
+	std::cout << images.size() << " images, " << mb(modes[0].total.fileBytes) << " MB";
+	if (skipped)
+		std::cout << " (" << skipped << " other files skipped)";
+	std::cout << ", decoded to " << channels << " channels, best of " << runs << (cold ? ", cold cache" : "") << std::endl;
+	for (const Mode& mode : modes)
+	{
+		double seconds = mode.wallMs / 1000.0;
+		std::cout << mode.name << ", " << mode.threads << (mode.threads > 1 ? " threads: " : " thread: ") << mode.wallMs << " ms, "
+			<< mb(mode.total.fileBytes) / seconds << " MB/s, " << mode.total.files / seconds << " images/s, peak RSS "
+			<< mode.peakRss << " MB" << std::endl;
+		auto print = [&](const std::string& name, const Stats& s)
+		{
+			const stbi_stage_times& t = s.stages;
+			std::cout << "  " << name << ": " << s.files << " files, " << mb(s.fileBytes) << " MB, " << s.ms << " ms, "
+				<< mb(s.fileBytes) / (s.ms / 1000.0) << " MB/s, " << s.files / (s.ms / 1000.0) << " images/s; io " << s.io
+				<< ", decode " << t.decode * 1000.0 << ", transform " << t.transform * 1000.0 << ", convert " << t.convert * 1000.0
+				<< ", wait " << t.wait * 1000.0 << " ms" << std::endl;
+		};
+		for (const std::pair<const std::string, Stats>& format : mode.formats)
+			print(format.first, format.second);
+		print("all", mode.total);
+	}
+
+	if (json)
+	{
+		std::ofstream out(json);
+		out << "{\n  \"images\": " << images.size() << ",\n  \"bytes\": " << modes[0].total.fileBytes << ",\n  \"channels\": " << channels
+			<< ",\n  \"runs\": " << runs << ",\n  \"cold\": " << (cold ? "true" : "false") << ",\n  \"modes\": {\n";
+		for (size_t m = 0; m < modes.size(); m++)
+		{
+			const Mode& mode = modes[m];
+			double seconds = mode.wallMs / 1000.0;
+			out << "    \"" << mode.name << "\": {\n      \"threads\": " << mode.threads << ",\n      \"ms\": " << mode.wallMs
+				<< ",\n      \"mbPerSecond\": " << mb(mode.total.fileBytes) / seconds << ",\n      \"imagesPerSecond\": "
+				<< mode.total.files / seconds << ",\n      \"peakRssMb\": " << mode.peakRss << ",\n      \"formats\": {\n";
+			size_t f = 0;
+			for (const std::pair<const std::string, Stats>& format : mode.formats)
+			{
+				const Stats& s = format.second;
+				out << "        \"" << format.first << "\": { \"files\": " << s.files << ", \"bytes\": " << s.fileBytes
+					<< ", \"ms\": " << s.ms << ", \"mbPerSecond\": " << mb(s.fileBytes) / (s.ms / 1000.0)
+					<< ", \"imagesPerSecond\": " << s.files / (s.ms / 1000.0) << ", \"io\": " << s.io
+					<< ", \"decode\": " << s.stages.decode * 1000.0 << ", \"transform\": " << s.stages.transform * 1000.0
+					<< ", \"convert\": " << s.stages.convert * 1000.0 << ", \"wait\": " << s.stages.wait * 1000.0 << " }"
+					<< (++f < mode.formats.size() ? ",\n" : "\n");
+			}
+			out << "      }\n    }" << (m + 1 < modes.size() ? ",\n" : "\n");
+		}
+		out << "  }\n}\n";
+		if (!out)
+		{
+			std::cout << "ERROR::BATCHBENCH::can't write " << json << std::endl;
+			return 1;
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,515 @@
+// Times stb_image on a set of image files (tools/MakeImageCorpus writes big
+// JPEG/PNG ones, the image_corpus target puts them in the build directory):
+//
+//     ImageDecodeBench [--runs N] [--threads N] [--cold] [--json out.json] image...
+//
+// every image is read and decoded through stdio (stbi_load, 128 byte refills)
+// and through a memory mapping (stbi_load_mapped). the "read" rows only move
+// the file into the decoder's hands: fread in 128 byte pieces like
+// stbi__refill_buffer, against mapping the file and touching every page.
+// "stbi_load + copy" is a decode followed by copying the image to where it's
+// needed (what the texture streamer used to do), "stbi_load_into" decodes
+// straight into that memory. with --threads N (N > 1) the "threaded" rows
+// decode again with stbi_set_parallel_for on a pool of N threads, which
+// must give the same pixels as the single threaded decode.
+// JPEGs also get a row per instruction set the decoder can be limited to
+// (stbi_set_simd_limit), decoding to RGBA like the texture streamer does;
+// all of them must give the same pixels. the "jpeg rgba 1/2" to "1/8" rows
+// decode at reduced size (stbi_load_into_scaled), MB/s of their smaller
+// output. PNGs get "png inflate classic" and "png inflate fast" rows that
+// inflate just the IDAT data with stbi_set_fast_inflate off and on, MB/s of
+// inflated bytes, which must come out the same, and a "png rgba" row per
+// instruction set like the JPEG ones (the SIMD unfiltering). every image
+// also gets "stbi_load rgba" and "stbi_load rgba flipped", which must hold
+// the same rows in opposite order, and "stbi_load rgba arena", the first one
+// with its scratch memory from an stbi_arena. a grey decode into padded rows
+// must match stbi_load's and leave the padding alone, and a flipped grey one
+// must hold its rows in opposite order. the summary at the end adds
+// up every row over all images, for MB/s over the whole corpus rather than
+// per file.
+// with --cold the file is dropped from the page cache before every run
+// (posix_fadvise, Linux only), so the rows include reading the disk.
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// best of runs, in ms. before runs outside the timing
+double timeBest(int runs, const std::function<void()>& before, const std::function<void()>& fn)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; i++)
+	{
+		before();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		fn();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+void dropFromCache(const std::string& path)
+{
+#if defined(__linux__)
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#else
+	(void)path;
+#endif
+}
+
+// what stbi__refill_buffer does with a FILE, without decoding anything
+size_t readStdio(const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return 0;
+	char buffer[128];
+	size_t total = 0, n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		total += n;
+	fclose(file);
+	return total;
+}
+
+// map and fault in every page
+size_t readMapped(const std::string& path)
+{
+#ifndef _WIN32
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	fstat(fd, &st);
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+	posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+	volatile unsigned char sink = 0;
+	for (size_t at = 0; at < (size_t)st.st_size; at += 4096)
+		sink += ((const unsigned char*)data)[at];
+	munmap(data, (size_t)st.st_size);
+	return (size_t)st.st_size;
+#else
+	return readStdio(path);
+#endif
+}
+
+// the zlib stream of a PNG: every IDAT chunk's data, concatenated
+std::vector<char> pngIdat(const std::string& path)
+{
+	std::vector<char> idat;
+	std::ifstream in(path, std::ios::binary);
+	unsigned char header[8];
+	if (!in.read((char*)header, 8) || header[0] != 0x89 || header[1] != 'P')
+		return idat;
+	unsigned char chunk[8];
+	while (in.read((char*)chunk, 8))
+	{
+		size_t length = ((size_t)chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
+		if (memcmp(chunk + 4, "IDAT", 4) == 0)
+		{
+			size_t at = idat.size();
+			idat.resize(at + length);
+			in.read(&idat[at], (std::streamsize)length);
+			in.seekg(4, std::ios::cur);
+		}
+		else
+			in.seekg((std::streamoff)length + 4, std::ios::cur);
+	}
+	return idat;
+}
+
+struct Simd
+{
+	const char* name;
+	int limit;
+};
+
+struct Row
+{
+	std::string name;
+	double ms;
+	double mbPerSecond;	// of file bytes for the read rows, of decoded pixels otherwise
+	size_t bytes;
+};
+
+struct Result
+{
+	std::string path;
+	int width = 0, height = 0, channels = 0;
+	size_t fileBytes = 0;
+	std::vector<Row> rows;
+};
+
+int main(int argc, char* argv[])
+{
+	int runs = 5, threads = 1;
+	bool cold = false;
+	const char* json = NULL;
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cold") == 0)
+			cold = true;
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			json = argv[++i];
+		else
+			inputs.push_back(argv[i]);
+	}
+	if (inputs.empty())
+	{
+		std::cout << "usage: ImageDecodeBench [--runs N] [--threads N] [--cold] [--json out.json] image..." << std::endl;
+		return 1;
+	}
+	// the caller helps, so N - 1 workers
+	std::unique_ptr<ThreadPool> pool;
+	if (threads > 1)
+		pool.reset(new ThreadPool(threads - 1));
+
+	std::vector<Result> results;
+	int failed = 0;
+	for (const std::string& input : inputs)
+	{
+		Result result;
+		result.path = input;
+		unsigned char* reference = stbi_load(input.c_str(), &result.width, &result.height, &result.channels, 0);
+		if (!reference)
+		{
+			std::cout << "ERROR::DECODEBENCH::can't load " << input << ": " << stbi_failure_reason() << std::endl;
+			failed++;
+			continue;
+		}
+		result.fileBytes = readStdio(input);
+		size_t pixelBytes = (size_t)result.width * result.height * result.channels;
+		std::function<void()> before = [&] { if (cold) dropFromCache(input); };
+		auto add = [&](const std::string& name, size_t bytes, const std::function<void()>& fn)
+		{
+			double ms = timeBest(runs, before, fn);
+			result.rows.push_back({ name, ms, bytes / 1048576.0 / (ms / 1000.0), bytes });
+		};
+
+		add("read stdio", result.fileBytes, [&] { readStdio(input); });
+		add("read mapped", result.fileBytes, [&] { readMapped(input); });
+		add("stbi_load", pixelBytes, [&] {
+			int w, h, c;
+			stbi_image_free(stbi_load(input.c_str(), &w, &h, &c, 0)); });
+		add("stbi_load_mapped", pixelBytes, [&] {
+			int w, h, c;
+			stbi_image_free(stbi_load_mapped(input.c_str(), &w, &h, &c, 0)); });
+
+		std::vector<unsigned char> destination(pixelBytes);
+		add("stbi_load + copy", pixelBytes, [&] {
+			int w, h, c;
+			unsigned char* pixels = stbi_load_mapped(input.c_str(), &w, &h, &c, 0);
+			memcpy(destination.data(), pixels, pixelBytes);
+			stbi_image_free(pixels); });
+		add("stbi_load_into", pixelBytes, [&] {
+			int w, h, c;
+			stbi_load_into(input.c_str(), destination.data(), result.width * result.channels, (int)pixelBytes, &w, &h, &c, 0); });
+
+		int w, h, c;
+		unsigned char* mapped = stbi_load_mapped(input.c_str(), &w, &h, &c, 0);
+		if (!mapped || memcmp(mapped, reference, pixelBytes) != 0)
+		{
+			std::cout << "ERROR::DECODEBENCH::stbi_load_mapped differs from stbi_load on " << input << std::endl;
+			failed++;
+		}
+		stbi_image_free(mapped);
+		if (pool)
+		{
+			stbi_set_parallel_for(ThreadPool::runTasks, pool.get(), threads);
+			add("stbi_load_mapped threaded", pixelBytes, [&] {
+				int w, h, c;
+				stbi_image_free(stbi_load_mapped(input.c_str(), &w, &h, &c, 0)); });
+			add("stbi_load_into threaded", pixelBytes, [&] {
+				int w, h, c;
+				stbi_load_into(input.c_str(), destination.data(), result.width * result.channels, (int)pixelBytes, &w, &h, &c, 0); });
+			mapped = stbi_load_mapped(input.c_str(), &w, &h, &c, 0);
+			if (!mapped || memcmp(mapped, reference, pixelBytes) != 0)
+			{
+				std::cout << "ERROR::DECODEBENCH::threaded decode differs from stbi_load on " << input << std::endl;
+				failed++;
+			}
+			stbi_image_free(mapped);
+			// from a FILE there are no restart segments to split at
+			mapped = stbi_load(input.c_str(), &w, &h, &c, 0);
+			if (!mapped || memcmp(mapped, reference, pixelBytes) != 0)
+			{
+				std::cout << "ERROR::DECODEBENCH::threaded stbi_load differs from stbi_load on " << input << std::endl;
+				failed++;
+			}
+			stbi_image_free(mapped);
+			stbi_set_parallel_for(NULL, NULL, 1);
+		}
+		FILE* file = fopen(input.c_str(), "rb");
+		bool jpeg = file && fgetc(file) == 0xFF && fgetc(file) == 0xD8;
+		if (file)
+			fclose(file);
+		if (jpeg)
+		{
+			const Simd simds[] = { { "jpeg rgba scalar", STBI_simd_none }, { "jpeg rgba sse2", STBI_simd_sse2 }, { "jpeg rgba avx2", STBI_simd_avx2 } };
+			size_t rgbaBytes = (size_t)result.width * result.height * 4;
+			std::vector<unsigned char> rgba(rgbaBytes), scalar;
+			for (const Simd& simd : simds)
+			{
+				stbi_set_simd_limit(simd.limit);
+				add(simd.name, rgbaBytes, [&] {
+					stbi_load_into(input.c_str(), rgba.data(), result.width * 4, (int)rgbaBytes, &w, &h, &c, 4); });
+				if (scalar.empty())
+					scalar = rgba;
+				else if (rgba != scalar)
+				{
+					std::cout << "ERROR::DECODEBENCH::" << simd.name << " differs from the scalar decode of " << input << std::endl;
+					failed++;
+				}
+			}
+			stbi_set_simd_limit(STBI_simd_avx2);
+			for (int scale = 1; scale <= 3; scale++)
+			{
+				int scaledWidth = (result.width + (1 << scale) - 1) >> scale, scaledHeight = (result.height + (1 << scale) - 1) >> scale;
+				size_t scaledBytes = (size_t)scaledWidth * scaledHeight * 4;
+				bool ok = true;
+				add("jpeg rgba 1/" + std::to_string(1 << scale), scaledBytes, [&] {
+					ok = stbi_load_into_scaled(input.c_str(), scale, rgba.data(), scaledWidth * 4, (int)scaledBytes, &w, &h, &c, 4) != 0; });
+				if (!ok || w != scaledWidth || h != scaledHeight)
+				{
+					std::cout << "ERROR::DECODEBENCH::1/" << (1 << scale) << " decode of " << input << " failed" << std::endl;
+					failed++;
+				}
+			}
+		}
+		std::vector<char> idat = pngIdat(input);
+		if (!idat.empty())
+		{
+			// a filter byte per row
+			int inflatedGuess = (int)(pixelBytes + result.height);
+			std::vector<char> classic;
+			for (int fast = 0; fast <= 1; fast++)
+			{
+				stbi_set_fast_inflate(fast);
+				int length = 0;
+				char* inflated = NULL;
+				add(fast ? "png inflate fast" : "png inflate classic", (size_t)inflatedGuess, [&] {
+					free(inflated);
+					inflated = stbi_zlib_decode_malloc_guesssize_headerflag(idat.data(), (int)idat.size(), inflatedGuess, &length, 1); });
+				if (!inflated)
+				{
+					std::cout << "ERROR::DECODEBENCH::can't inflate " << input << ": " << stbi_failure_reason() << std::endl;
+					failed++;
+				}
+				else if (!fast)
+					classic.assign(inflated, inflated + length);
+				else if (classic != std::vector<char>(inflated, inflated + length))
+				{
+					std::cout << "ERROR::DECODEBENCH::fast inflate differs from classic on " << input << std::endl;
+					failed++;
+				}
+				free(inflated);
+			}
+			stbi_set_fast_inflate(1);
+
+			const Simd simds[] = { { "png rgba scalar", STBI_simd_none }, { "png rgba sse2", STBI_simd_sse2 }, { "png rgba avx2", STBI_simd_avx2 } };
+			size_t rgbaBytes = (size_t)result.width * result.height * 4;
+			std::vector<unsigned char> rgba(rgbaBytes), scalar;
+			for (const Simd& simd : simds)
+			{
+				stbi_set_simd_limit(simd.limit);
+				add(simd.name, rgbaBytes, [&] {
+					stbi_load_into(input.c_str(), rgba.data(), result.width * 4, (int)rgbaBytes, &w, &h, &c, 4); });
+				if (scalar.empty())
+					scalar = rgba;
+				else if (rgba != scalar)
+				{
+					std::cout << "ERROR::DECODEBENCH::" << simd.name << " differs from the scalar decode of " << input << std::endl;
+					failed++;
+				}
+			}
+			stbi_set_simd_limit(STBI_simd_avx2);
+		}
+		// padded rows, flipped, must still hold the same pixels
+		size_t rowBytes = (size_t)result.width * result.channels, stride = rowBytes + 64;
+		std::vector<unsigned char> padded(stride * result.height);
+		stbi_load_options flipped;
+		stbi_load_options_init(&flipped);
+		flipped.flip_vertically = 1;
+		bool into = stbi_load_into_ex(input.c_str(), padded.data(), (int)stride, (int)padded.size(), &w, &h, &c, &flipped) != 0;
+		for (int y = 0; into && y < result.height; y++)
+			into = memcmp(&padded[stride * (result.height - 1 - y)], reference + rowBytes * y, rowBytes) == 0;
+		if (!into)
+		{
+			std::cout << "ERROR::DECODEBENCH::stbi_load_into differs from stbi_load on " << input << std::endl;
+			failed++;
+		}
+		// to grey into padded rows: stbi_load's pixels, and nothing written to
+		// the padding or the byte after the last row
+		unsigned char* grey = stbi_load(input.c_str(), &w, &h, &c, 1);
+		size_t greyStride = (size_t)result.width + 3, greyBytes = greyStride * result.height;
+		std::vector<unsigned char> greyInto(greyBytes + 1, 0xA5);
+		bool greySame = grey && stbi_load_into(input.c_str(), greyInto.data(), (int)greyStride, (int)greyBytes, &w, &h, &c, 1) != 0;
+		for (int y = 0; greySame && y < result.height; y++)
+			greySame = memcmp(&greyInto[greyStride * y], grey + (size_t)result.width * y, result.width) == 0;
+		for (size_t i = 0; greySame && i < greyInto.size(); i++)
+			if (i >= greyBytes || i % greyStride >= (size_t)result.width)
+				greySame = greyInto[i] == 0xA5;
+		if (!greySame)
+		{
+			std::cout << "ERROR::DECODEBENCH::grey stbi_load_into differs from stbi_load or writes past its rows on " << input << std::endl;
+			failed++;
+		}
+		// and flipped, through stbi_load_ex's own allocation: the rows are
+		// written bottom-up, so a stray byte would land on the row before
+		stbi_load_options greyFlipped;
+		stbi_load_options_init(&greyFlipped);
+		greyFlipped.desired_channels = 1;
+		greyFlipped.flip_vertically = 1;
+		unsigned char* flippedGrey = stbi_load_ex(input.c_str(), &w, &h, &c, &greyFlipped);
+		greySame = grey && flippedGrey;
+		for (int y = 0; greySame && y < result.height; y++)
+			greySame = memcmp(flippedGrey + (size_t)result.width * (result.height - 1 - y), grey + (size_t)result.width * y, result.width) == 0;
+		if (!greySame)
+		{
+			std::cout << "ERROR::DECODEBENCH::flipped grey decode differs from the upright one on " << input << std::endl;
+			failed++;
+		}
+		stbi_image_free(flippedGrey);
+		stbi_image_free(grey);
+		// to RGBA like a texture, and flipped on top: the conversion writes
+		// the rows bottom-up, there's no second pass for the flip
+		size_t rgbaRow = (size_t)result.width * 4, rgbaBytes = rgbaRow * result.height;
+		stbi_load_options rgba;
+		stbi_load_options_init(&rgba);
+		rgba.desired_channels = 4;
+		unsigned char* upright = stbi_load_ex(input.c_str(), &w, &h, &c, &rgba);
+		add("stbi_load rgba", rgbaBytes, [&] {
+			stbi_image_free(stbi_load_ex(input.c_str(), &w, &h, &c, &rgba)); });
+		// scratch memory from an arena kept across runs, like a decode thread's
+		stbi_arena arena;
+		stbi_arena_init(&arena, 0);
+		rgba.scratch = &arena.allocator;
+		add("stbi_load rgba arena", rgbaBytes, [&] {
+			stbi_image_free(stbi_load_ex(input.c_str(), &w, &h, &c, &rgba));
+			stbi_arena_reset(&arena); });
+		unsigned char* arenaRgba = stbi_load_ex(input.c_str(), &w, &h, &c, &rgba);
+		if (!upright || !arenaRgba || memcmp(arenaRgba, upright, rgbaBytes) != 0)
+		{
+			std::cout << "ERROR::DECODEBENCH::decode with an arena differs from stbi_load on " << input << std::endl;
+			failed++;
+		}
+		stbi_image_free(arenaRgba);
+		stbi_arena_free(&arena);
+		rgba.scratch = NULL;
+		rgba.flip_vertically = 1;
+		add("stbi_load rgba flipped", rgbaBytes, [&] {
+			stbi_image_free(stbi_load_ex(input.c_str(), &w, &h, &c, &rgba)); });
+		unsigned char* flippedRgba = stbi_load_ex(input.c_str(), &w, &h, &c, &rgba);
+		bool same = upright && flippedRgba;
+		for (int y = 0; same && y < result.height; y++)
+			same = memcmp(flippedRgba + rgbaRow * (result.height - 1 - y), upright + rgbaRow * y, rgbaRow) == 0;
+		if (!same)
+		{
+			std::cout << "ERROR::DECODEBENCH::flipped RGBA decode differs from the upright one on " << input << std::endl;
+			failed++;
+		}
+		stbi_image_free(upright);
+		stbi_image_free(flippedRgba);
+		stbi_image_free(reference);
+		results.push_back(result);
+	}
+
+	for (const Result& result : results)
+	{
+		std::cout << result.path << ": " << result.width << "x" << result.height << "x" << result.channels << ", "
+			<< result.fileBytes << " bytes, best of " << runs << (cold ? ", cold cache" : "")
+			<< (pool ? ", " + std::to_string(threads) + " threads" : "") << std::endl;
+		for (const Row& row : result.rows)
+			std::cout << "  " << row.name << ": " << row.ms << " ms, " << row.mbPerSecond << " MB/s" << std::endl;
+	}
+
+	// the same rows over every image that has them
+	std::vector<Row> corpus;
+	std::vector<int> corpusImages;
+	for (const Result& result : results)
+	{
+		for (const Row& row : result.rows)
+		{
+			size_t i = 0;
+			while (i < corpus.size() && corpus[i].name != row.name)
+				i++;
+			if (i == corpus.size())
+			{
+				corpus.push_back({ row.name, 0.0, 0.0, 0 });
+				corpusImages.push_back(0);
+			}
+			corpus[i].ms += row.ms;
+			corpus[i].bytes += row.bytes;
+			corpusImages[i]++;
+		}
+	}
+	if (results.size() > 1)
+	{
+		std::cout << "corpus:" << std::endl;
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			corpus[i].mbPerSecond = corpus[i].bytes / 1048576.0 / (corpus[i].ms / 1000.0);
+			std::cout << "  " << corpus[i].name << ": " << corpus[i].ms << " ms over " << corpusImages[i] << " images, "
+				<< corpus[i].mbPerSecond << " MB/s" << std::endl;
+		}
+	}
+
+	if (json)
+	{
+		std::ofstream out(json);
+		out << "{\n  \"runs\": " << runs << ",\n  \"threads\": " << threads << ",\n  \"cold\": " << (cold ? "true" : "false") << ",\n  \"images\": [\n";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const Result& result = results[i];
+			out << "    {\n      \"path\": \"" << result.path << "\",\n";
+			out << "      \"width\": " << result.width << ",\n      \"height\": " << result.height << ",\n";
+			out << "      \"channels\": " << result.channels << ",\n      \"file_bytes\": " << result.fileBytes << ",\n";
+			out << "      \"ms\": {\n";
+			for (size_t j = 0; j < result.rows.size(); j++)
+				out << "        \"" << result.rows[j].name << "\": " << result.rows[j].ms << (j + 1 < result.rows.size() ? ",\n" : "\n");
+			out << "      }\n    }" << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		out << "  ],\n  \"corpus_mb_per_s\": {\n";
+		for (size_t i = 0; i < corpus.size(); i++)
+			out << "    \"" << corpus[i].name << "\": " << corpus[i].bytes / 1048576.0 / (corpus[i].ms / 1000.0)
+				<< (i + 1 < corpus.size() ? ",\n" : "\n");
+		out << "  }\n}\n";
+		if (!out)
+		{
+			std::cout << "ERROR::DECODEBENCH::can't write " << json << std::endl;
+			return 1;
+		}
+	}
+	return failed ? 1 : 0;
+}
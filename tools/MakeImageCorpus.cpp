@@ -0,0 +1,503 @@
+// Writes the synthetic images the decode benchmarks run on, with libjpeg and
+// libpng so the files look like what artists export rather than what
+// stb_image itself would write:
+//
+//     MakeImageCorpus [--size N] dir
+//
+// the picture is a few octaves of value noise over smooth gradients, which
+// compresses about like a photo (busy enough that JPEG and deflate have work
+// to do, smooth enough that they compress at all). default size 4096.
+// besides the plain JPEG there's one with a restart marker every MCU row
+// (what cameras write, and what lets a decoder split the entropy coded data
+// between threads), a progressive one, and an Adobe CMYK and a YCCK one
+// (their own color conversion paths). the PNGs come as RGB, RGBA, an
+// Adam7 interlaced RGBA one and a 16-bit RGB one. the rest of what
+// stb_image reads in a texture folder is written by hand: TGA plain and RLE,
+// a 24-bit BMP, a Radiance HDR with RLE scanlines and a GIF on a 6x7x6
+// colour cube.
+#include <cstdio>	// before jpeglib.h, which uses FILE and size_t
+#include <jpeglib.h>
+#include <png.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// hash of a lattice point, 0..1
+float lattice(int x, int y, int seed)
+{
+	unsigned int h = (unsigned int)x * 374761393u + (unsigned int)y * 668265263u + (unsigned int)seed * 2246822519u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return (float)((h ^ (h >> 16)) & 0xFFFF) / 65535.0f;
+}
+
+float valueNoise(float x, float y, int seed)
+{
+	int ix = (int)std::floor(x), iy = (int)std::floor(y);
+	float fx = x - ix, fy = y - iy;
+	fx = fx * fx * (3.0f - 2.0f * fx);
+	fy = fy * fy * (3.0f - 2.0f * fy);
+	float a = lattice(ix, iy, seed), b = lattice(ix + 1, iy, seed);
+	float c = lattice(ix, iy + 1, seed), d = lattice(ix + 1, iy + 1, seed);
+	return (a + (b - a) * fx) + ((c + (d - c) * fx) - (a + (b - a) * fx)) * fy;
+}
+
+// RGBA8, alpha is a soft vignette so the RGBA files have a real alpha channel
+std::vector<unsigned char> makeImage(int size)
+{
+	std::vector<unsigned char> image((size_t)size * size * 4);
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			float u = (float)x / size, v = (float)y / size;
+			float n = 0.0f, amplitude = 0.5f, frequency = 8.0f;
+			for (int octave = 0; octave < 6; octave++)
+			{
+				n += amplitude * valueNoise(u * frequency, v * frequency, octave);
+				amplitude *= 0.5f;
+				frequency *= 2.1f;
+			}
+			float grain = lattice(x, y, 99) * 0.06f;
+			float du = u - 0.5f, dv = v - 0.5f;
+			unsigned char* p = &image[((size_t)y * size + x) * 4];
+			p[0] = (unsigned char)std::min(255.0f, 255.0f * (0.55f * n + 0.35f * u + grain));
+			p[1] = (unsigned char)std::min(255.0f, 255.0f * (0.6f * n + 0.25f * v + grain));
+			p[2] = (unsigned char)std::min(255.0f, 255.0f * (0.8f * n * (1.0f - 0.5f * u) + grain));
+			p[3] = (unsigned char)std::max(0.0f, 255.0f * (1.0f - 2.0f * (du * du + dv * dv)));
+		}
+	}
+	return image;
+}
+
+enum JpegKind
+{
+	BASELINE,
+	RESTARTS,
+	PROGRESSIVE,
+	CMYK,			// Adobe inverted CMYK, what print workflows export
+	YCCK
+};
+
+bool writeJpeg(const std::string& path, const unsigned char* rgba, int size, int quality, JpegKind kind)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	jpeg_compress_struct info;
+	jpeg_error_mgr error;
+	info.err = jpeg_std_error(&error);
+	jpeg_create_compress(&info);
+	jpeg_stdio_dest(&info, file);
+	info.image_width = size;
+	info.image_height = size;
+	bool cmyk = kind == CMYK || kind == YCCK;
+	info.input_components = cmyk ? 4 : 3;
+	info.in_color_space = cmyk ? JCS_CMYK : JCS_RGB;
+	jpeg_set_defaults(&info);
+	// libjpeg writes the Adobe marker that tells the two apart
+	if (kind == YCCK)
+		jpeg_set_colorspace(&info, JCS_YCCK);
+	jpeg_set_quality(&info, quality, TRUE);
+	if (kind == RESTARTS)
+		info.restart_in_rows = 1;
+	else if (kind == PROGRESSIVE)
+		jpeg_simple_progression(&info);
+	jpeg_start_compress(&info, TRUE);
+	std::vector<unsigned char> row((size_t)size * info.input_components);
+	while (info.next_scanline < info.image_height)
+	{
+		const unsigned char* source = rgba + (size_t)info.next_scanline * size * 4;
+		for (int x = 0; x < size; x++)
+		{
+			const unsigned char* p = source + x * 4;
+			if (!cmyk)
+			{
+				memcpy(&row[x * 3], p, 3);
+				continue;
+			}
+			// stored inverted, so each of r, g, b is the channel times k / 255
+			int k = std::max(p[0], std::max(p[1], p[2]));
+			for (int i = 0; i < 3; i++)
+				row[x * 4 + i] = (unsigned char)(k ? (p[i] * 255 + k / 2) / k : 0);
+			row[x * 4 + 3] = (unsigned char)k;
+		}
+		JSAMPROW rows[1] = { row.data() };
+		jpeg_write_scanlines(&info, rows, 1);
+	}
+	jpeg_finish_compress(&info);
+	jpeg_destroy_compress(&info);
+	return fclose(file) == 0;
+}
+
+bool writePng(const std::string& path, const unsigned char* rgba, int size, int channels, bool interlaced = false, int depth = 8)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
+	if (setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_write_struct(&png, &info);
+		fclose(file);
+		return false;
+	}
+	png_init_io(png, file);
+	png_set_IHDR(png, info, size, size, depth, channels == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+		interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	// libpng picks each pass's pixels out of the full rows it's given
+	int passes = interlaced ? png_set_interlace_handling(png) : 1;
+	int bytes = depth / 8;
+	std::vector<unsigned char> row((size_t)size * channels * bytes);
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (int y = 0; y < size; y++)
+		{
+			const unsigned char* source = rgba + (size_t)y * size * 4;
+			for (int x = 0; x < size; x++)
+			{
+				if (depth == 8)
+					memcpy(&row[(size_t)x * channels], source + x * 4, channels);
+				else
+				{
+					// big endian, with some grain below the 8 bits we have
+					for (int c = 0; c < channels; c++)
+					{
+						row[((size_t)x * channels + c) * 2] = source[x * 4 + c];
+						row[((size_t)x * channels + c) * 2 + 1] = (unsigned char)(lattice(x, y, 7 + c) * 255.0f);
+					}
+				}
+			}
+			png_write_row(png, row.data());
+		}
+	}
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	return fclose(file) == 0;
+}
+
+bool writeFile(const std::string& path, const std::vector<unsigned char>& bytes)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	return fclose(file) == 0 && ok;
+}
+
+void put16(std::vector<unsigned char>& out, unsigned int v)
+{
+	out.push_back(v & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+}
+
+void put32(std::vector<unsigned char>& out, unsigned int v)
+{
+	put16(out, v & 0xFFFF);
+	put16(out, v >> 16);
+}
+
+// top-down BGR(A), RLE packets never cross a row
+bool writeTga(const std::string& path, const unsigned char* rgba, int size, int channels, bool rle)
+{
+	std::vector<unsigned char> out = { 0, 0, (unsigned char)(rle ? 10 : 2), 0, 0, 0, 0, 0 };
+	put16(out, 0);
+	put16(out, 0);
+	put16(out, size);
+	put16(out, size);
+	out.push_back((unsigned char)(channels * 8));
+	out.push_back((unsigned char)(0x20 | (channels == 4 ? 8 : 0)));
+	std::vector<unsigned char> row((size_t)size * channels);
+	for (int y = 0; y < size; y++)
+	{
+		const unsigned char* source = rgba + (size_t)y * size * 4;
+		for (int x = 0; x < size; x++)
+		{
+			unsigned char* p = &row[(size_t)x * channels];
+			p[0] = source[x * 4 + 2];
+			p[1] = source[x * 4 + 1];
+			p[2] = source[x * 4];
+			if (channels == 4)
+				p[3] = source[x * 4 + 3];
+		}
+		if (!rle)
+		{
+			out.insert(out.end(), row.begin(), row.end());
+			continue;
+		}
+		for (int x = 0; x < size;)
+		{
+			auto same = [&](int a, int b) { return memcmp(&row[(size_t)a * channels], &row[(size_t)b * channels], channels) == 0; };
+			int run = 1;
+			while (x + run < size && run < 128 && same(x, x + run))
+				run++;
+			if (run > 1)
+			{
+				out.push_back((unsigned char)(0x80 | (run - 1)));
+				out.insert(out.end(), &row[(size_t)x * channels], &row[(size_t)x * channels] + channels);
+				x += run;
+				continue;
+			}
+			// raw packet up to the next run of two
+			int count = 1;
+			while (x + count < size && count < 128 && !(x + count + 1 < size && same(x + count, x + count + 1)))
+				count++;
+			out.push_back((unsigned char)(count - 1));
+			out.insert(out.end(), &row[(size_t)x * channels], &row[(size_t)(x + count) * channels]);
+			x += count;
+		}
+	}
+	return writeFile(path, out);
+}
+
+// 24-bit, bottom-up, rows padded to 4 bytes
+bool writeBmp(const std::string& path, const unsigned char* rgba, int size)
+{
+	int rowBytes = (size * 3 + 3) & ~3;
+	std::vector<unsigned char> out = { 'B', 'M' };
+	put32(out, 54 + rowBytes * size);
+	put32(out, 0);
+	put32(out, 54);
+	put32(out, 40);
+	put32(out, size);
+	put32(out, size);
+	put16(out, 1);
+	put16(out, 24);
+	for (int i = 0; i < 6; i++)
+		put32(out, 0);
+	for (int y = size - 1; y >= 0; y--)
+	{
+		const unsigned char* source = rgba + (size_t)y * size * 4;
+		for (int x = 0; x < size; x++)
+		{
+			out.push_back(source[x * 4 + 2]);
+			out.push_back(source[x * 4 + 1]);
+			out.push_back(source[x * 4]);
+		}
+		out.resize(out.size() + rowBytes - size * 3, 0);
+	}
+	return writeFile(path, out);
+}
+
+// Radiance RGBE of the picture in linear light, up to 4x brighter than
+// white. scanlines of 8 to 32767 pixels are run-length coded a channel at a
+// time, like every HDR exporter does
+bool writeHdr(const std::string& path, const unsigned char* rgba, int size)
+{
+	std::string header = "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " + std::to_string(size) + " +X " + std::to_string(size) + "\n";
+	std::vector<unsigned char> out(header.begin(), header.end());
+	bool rle = size >= 8 && size < 32768;
+	std::vector<unsigned char> rgbe((size_t)size * 4);
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			const unsigned char* source = rgba + ((size_t)y * size + x) * 4;
+			float c[3];
+			for (int k = 0; k < 3; k++)
+				c[k] = 4.0f * std::pow(source[k] / 255.0f, 2.2f);
+			float m = std::max(c[0], std::max(c[1], c[2]));
+			unsigned char* p = &rgbe[(size_t)x * 4];
+			if (m < 1e-32f)
+			{
+				p[0] = p[1] = p[2] = p[3] = 0;
+				continue;
+			}
+			int e;
+			float scale = std::frexp(m, &e) * 256.0f / m;
+			for (int k = 0; k < 3; k++)
+				p[k] = (unsigned char)(c[k] * scale);
+			p[3] = (unsigned char)(e + 128);
+		}
+		if (!rle)
+		{
+			out.insert(out.end(), rgbe.begin(), rgbe.end());
+			continue;
+		}
+		out.push_back(2);
+		out.push_back(2);
+		out.push_back((unsigned char)(size >> 8));
+		out.push_back((unsigned char)(size & 0xFF));
+		for (int k = 0; k < 4; k++)
+		{
+			for (int x = 0; x < size;)
+			{
+				int run = 1;
+				while (x + run < size && run < 127 && rgbe[(size_t)(x + run) * 4 + k] == rgbe[(size_t)x * 4 + k])
+					run++;
+				if (run > 2)
+				{
+					out.push_back((unsigned char)(128 + run));
+					out.push_back(rgbe[(size_t)x * 4 + k]);
+					x += run;
+					continue;
+				}
+				// a dump up to the next run of three
+				int count = 1;
+				while (x + count < size && count < 128)
+				{
+					int next = x + count;
+					if (next + 2 < size && rgbe[(size_t)next * 4 + k] == rgbe[(size_t)(next + 1) * 4 + k]
+						&& rgbe[(size_t)next * 4 + k] == rgbe[(size_t)(next + 2) * 4 + k])
+						break;
+					count++;
+				}
+				out.push_back((unsigned char)count);
+				for (int i = 0; i < count; i++)
+					out.push_back(rgbe[(size_t)(x + i) * 4 + k]);
+				x += count;
+			}
+		}
+	}
+	return writeFile(path, out);
+}
+
+// GIF89a on a 6x7x6 colour cube (nearest colour, no dithering), LZW coded
+// with the code size growing and the table cleared the way decoders expect
+bool writeGif(const std::string& path, const unsigned char* rgba, int size)
+{
+	std::vector<unsigned char> out = { 'G', 'I', 'F', '8', '9', 'a' };
+	put16(out, size);
+	put16(out, size);
+	out.push_back(0xF7);	// global colour table of 256, 8 bits per primary
+	out.push_back(0);
+	out.push_back(0);
+	for (int i = 0; i < 256; i++)
+	{
+		int r = i < 252 ? i / 42 : 0, g = i < 252 ? i / 6 % 7 : 0, b = i < 252 ? i % 6 : 0;
+		out.push_back((unsigned char)(r * 255 / 5));
+		out.push_back((unsigned char)(g * 255 / 6));
+		out.push_back((unsigned char)(b * 255 / 5));
+	}
+	out.push_back(0x2C);
+	put16(out, 0);
+	put16(out, 0);
+	put16(out, size);
+	put16(out, size);
+	out.push_back(0);
+	out.push_back(8);	// minimum code size
+
+	const int clear = 256, end = 257;
+	std::vector<short> child((size_t)4096 * 256, -1);
+	std::vector<size_t> filled;	// what to put back on a clear
+	std::vector<unsigned char> codes;
+	unsigned int bits = 0;
+	int bitCount = 0, width = 9, next = end + 1;
+	auto emit = [&](int code)
+	{
+		bits |= (unsigned int)code << bitCount;
+		for (bitCount += width; bitCount >= 8; bitCount -= 8, bits >>= 8)
+			codes.push_back((unsigned char)(bits & 0xFF));
+	};
+	auto index = [&](size_t i)
+	{
+		const unsigned char* p = rgba + i * 4;
+		return (p[0] * 5 + 127) / 255 * 42 + (p[1] * 6 + 127) / 255 * 6 + (p[2] * 5 + 127) / 255;
+	};
+	emit(clear);
+	int prefix = index(0);
+	for (size_t i = 1; i < (size_t)size * size; i++)
+	{
+		int k = index(i);
+		int code = child[(size_t)prefix * 256 + k];
+		if (code >= 0)
+		{
+			prefix = code;
+			continue;
+		}
+		emit(prefix);
+		if (next < 4096)
+		{
+			child[(size_t)prefix * 256 + k] = (short)next++;
+			filled.push_back((size_t)prefix * 256 + k);
+			// the decoder adds each code a step behind us, so it widens in time
+			if (next > (1 << width) && width < 12)
+				width++;
+		}
+		else
+		{
+			emit(clear);
+			for (size_t slot : filled)
+				child[slot] = -1;
+			filled.clear();
+			width = 9;
+			next = end + 1;
+		}
+		prefix = k;
+	}
+	emit(prefix);
+	emit(end);
+	if (bitCount > 0)
+		codes.push_back((unsigned char)(bits & 0xFF));
+	for (size_t i = 0; i < codes.size(); i += 255)
+	{
+		size_t n = std::min<size_t>(255, codes.size() - i);
+		out.push_back((unsigned char)n);
+		out.insert(out.end(), codes.begin() + i, codes.begin() + i + n);
+	}
+	out.push_back(0);
+	out.push_back(0x3B);
+	return writeFile(path, out);
+}
+
+int main(int argc, char* argv[])
+{
+	int size = 4096;
+	std::string dir;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else
+			dir = argv[i];
+	}
+	if (dir.empty() || size <= 0)
+	{
+		std::cout << "usage: MakeImageCorpus [--size N] dir" << std::endl;
+		return 1;
+	}
+	std::filesystem::create_directories(dir);
+	std::vector<unsigned char> image = makeImage(size);
+	std::string prefix = dir + "/photo" + std::to_string(size);
+
+	struct Output
+	{
+		std::string path;
+		bool ok;
+	};
+	std::vector<Output> outputs;
+	outputs.push_back({ prefix + ".jpg", writeJpeg(prefix + ".jpg", image.data(), size, 90, BASELINE) });
+	outputs.push_back({ prefix + "_rst.jpg", writeJpeg(prefix + "_rst.jpg", image.data(), size, 90, RESTARTS) });
+	outputs.push_back({ prefix + "_prog.jpg", writeJpeg(prefix + "_prog.jpg", image.data(), size, 90, PROGRESSIVE) });
+	outputs.push_back({ prefix + "_cmyk.jpg", writeJpeg(prefix + "_cmyk.jpg", image.data(), size, 90, CMYK) });
+	outputs.push_back({ prefix + "_ycck.jpg", writeJpeg(prefix + "_ycck.jpg", image.data(), size, 90, YCCK) });
+	outputs.push_back({ prefix + ".png", writePng(prefix + ".png", image.data(), size, 3) });
+	outputs.push_back({ prefix + "_rgba.png", writePng(prefix + "_rgba.png", image.data(), size, 4) });
+	outputs.push_back({ prefix + "_adam7.png", writePng(prefix + "_adam7.png", image.data(), size, 4, true) });
+	outputs.push_back({ prefix + "_16.png", writePng(prefix + "_16.png", image.data(), size, 3, false, 16) });
+	outputs.push_back({ prefix + ".tga", writeTga(prefix + ".tga", image.data(), size, 3, false) });
+	outputs.push_back({ prefix + "_rle.tga", writeTga(prefix + "_rle.tga", image.data(), size, 4, true) });
+	outputs.push_back({ prefix + ".bmp", writeBmp(prefix + ".bmp", image.data(), size) });
+	outputs.push_back({ prefix + ".hdr", writeHdr(prefix + ".hdr", image.data(), size) });
+	outputs.push_back({ prefix + ".gif", writeGif(prefix + ".gif", image.data(), size) });
+
+	int failed = 0;
+	for (const Output& output : outputs)
+	{
+		if (output.ok)
+			std::cout << output.path << ": " << std::filesystem::file_size(output.path) << " bytes" << std::endl;
+		else
+		{
+			std::cout << "ERROR::CORPUS::can't write " << output.path << std::endl;
+			failed++;
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+// Times MipChain against glGenerateMipmap on a 4096x4096 RGBA texture (size
+// configurable) in a headless EGL context:
+//
+//     MipmapBench [--size N] [--runs N] [--json out.json]
+//
+// the CPU rows time building levels 1..n in memory, the GL rows the part the
+// render thread would wait for: uploading every prebuilt level vs uploading
+// level 0 and calling glGenerateMipmap, each up to a glFinish.
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "CpuFeatures.h"
+#include "HeadlessContext.h"
+#include "MipChain.h"
+
+// best of runs, in ms
+double timeBest(int runs, const std::function<void()>& fn)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; i++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		fn();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+int main(int argc, char* argv[])
+{
+	int size = 4096, runs = 5;
+	const char* json = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			json = argv[++i];
+	}
+
+	HeadlessContext context;
+	if (!context.create(4, 5) || !gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+	{
+		std::cout << "ERROR::MIPBENCH::no GL context" << std::endl;
+		return 1;
+	}
+
+	// something with detail at every scale: a few overlapping gradients and noise
+	std::vector<unsigned char> image((size_t)size * size * 4);
+	unsigned int seed = 12345;
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			unsigned char* p = &image[((size_t)y * size + x) * 4];
+			p[0] = (unsigned char)((x * 255 / size + (seed >> 28)) & 255);
+			p[1] = (unsigned char)((y * 255 / size) ^ ((x >> 3) & 31));
+			p[2] = (unsigned char)(((x + y) >> 4) * 7);
+			p[3] = 255;
+		}
+	}
+	int levels = MipChain::levelCount(size, size);
+	std::vector<unsigned char> chain(MipChain::chainBytes(size, size, 4, levels)), reference(chain.size());
+
+	struct Row
+	{
+		std::string name;
+		double ms;
+	};
+	std::vector<Row> rows;
+	const CpuFeatures& cpu = CpuFeatures::get();
+	MipChain::build(image.data(), size, size, 4, levels, false, MipChain::BOX, reference.data(), MipChain::SCALAR);
+	rows.push_back({ "cpu box scalar", timeBest(runs, [&] {
+		MipChain::build(image.data(), size, size, 4, levels, false, MipChain::BOX, chain.data(), MipChain::SCALAR); }) });
+	if (cpu.sse2)
+	{
+		rows.push_back({ "cpu box sse2", timeBest(runs, [&] {
+			MipChain::build(image.data(), size, size, 4, levels, false, MipChain::BOX, chain.data(), MipChain::SSE2); }) });
+		if (chain != reference)
+			std::cout << "ERROR::MIPBENCH::sse2 box differs from scalar" << std::endl;
+	}
+	if (cpu.avx2)
+	{
+		rows.push_back({ "cpu box avx2", timeBest(runs, [&] {
+			MipChain::build(image.data(), size, size, 4, levels, false, MipChain::BOX, chain.data(), MipChain::AVX2); }) });
+		if (chain != reference)
+			std::cout << "ERROR::MIPBENCH::avx2 box differs from scalar" << std::endl;
+	}
+	rows.push_back({ "cpu box srgb", timeBest(runs, [&] {
+		MipChain::build(image.data(), size, size, 4, levels, true, MipChain::BOX, chain.data()); }) });
+	rows.push_back({ "cpu kaiser", timeBest(runs, [&] {
+		MipChain::build(image.data(), size, size, 4, levels, false, MipChain::KAISER, chain.data()); }) });
+	rows.push_back({ "cpu kaiser srgb", timeBest(runs, [&] {
+		MipChain::build(image.data(), size, size, 4, levels, true, MipChain::KAISER, chain.data()); }) });
+	MipChain::build(image.data(), size, size, 4, levels, false, MipChain::BOX, chain.data());
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, size, size);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+	glFinish();
+	rows.push_back({ "gl upload level 0", timeBest(runs, [&] {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+		glFinish(); }) });
+	rows.push_back({ "gl glGenerateMipmap", timeBest(runs, [&] {
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glFinish(); }) });
+	rows.push_back({ "gl upload levels 1..n", timeBest(runs, [&] {
+		const unsigned char* source = chain.data();
+		for (int level = 1; level < levels; level++)
+		{
+			int w = std::max(size >> level, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, w, w, GL_RGBA, GL_UNSIGNED_BYTE, source);
+			source += (size_t)w * w * 4;
+		}
+		glFinish(); }) });
+	glDeleteTextures(1, &texture);
+
+	std::cout << size << "x" << size << " RGBA8, " << levels << " levels, best of " << runs << " on "
+		<< (const char*)glGetString(GL_RENDERER) << std::endl;
+	for (const Row& row : rows)
+		std::cout << "  " << row.name << ": " << row.ms << " ms" << std::endl;
+
+	if (json)
+	{
+		std::ofstream out(json);
+		out << "{\n  \"renderer\": \"" << (const char*)glGetString(GL_RENDERER) << "\",\n";
+		out << "  \"size\": " << size << ",\n  \"runs\": " << runs << ",\n  \"ms\": {\n";
+		for (size_t i = 0; i < rows.size(); i++)
+			out << "    \"" << rows[i].name << "\": " << rows[i].ms << (i + 1 < rows.size() ? ",\n" : "\n");
+		out << "  }\n}\n";
+		if (!out)
+		{
+			std::cout << "ERROR::MIPBENCH::can't write " << json << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,114 @@
+// Offline texture cooker: decodes source images once and writes them as BC7
+// with a prebuilt mip chain in a KTX2 container, so the app can upload them
+// with glCompressedTexSubImage2D instead of decoding JPEG/PNG at startup.
+//
+//     TextureCooker [--srgb] [--no-flip] [--no-mips] [--kaiser] image...
+//
+// each image is written next to its source with the extension replaced by
+// .ktx2. rows are flipped bottom-up by default, like the app's texture
+// streamer does.
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bc7Encoder.h"
+#include "Ktx2.h"
+#include "MipChain.h"
+#include "ThreadPool.h"
+
+struct CookOptions
+{
+	bool srgb = false;
+	bool flip = true;
+	bool mips = true;
+	MipChain::Filter filter = MipChain::BOX;
+};
+
+bool cook(const std::string& input, const CookOptions& options, ThreadPool& pool)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int width, height, channels;
+	stbi_load_options load;
+	stbi_load_options_init(&load);
+	load.desired_channels = 4;
+	load.flip_vertically = options.flip;
+	load.parallel_for = ThreadPool::runTasks;
+	load.parallel_user = &pool;
+	load.parallel_threads = (int)pool.size() + 1;
+	unsigned char* pixels = stbi_load_ex(input.c_str(), &width, &height, &channels, &load);
+	if (!pixels)
+	{
+		std::cout << "ERROR::COOKER::can't load " << input << ": " << load.failure_reason << std::endl;
+		return false;
+	}
+	// the whole chain as RGBA8 first, level 0 included
+	int levelCount = options.mips ? MipChain::levelCount(width, height) : 1;
+	size_t topBytes = (size_t)width * height * 4;
+	std::vector<unsigned char> chain(topBytes + MipChain::chainBytes(width, height, 4, levelCount));
+	memcpy(chain.data(), pixels, topBytes);
+	stbi_image_free(pixels);
+	MipChain::build(chain.data(), width, height, 4, levelCount, options.srgb, options.filter, chain.data() + topBytes);
+
+	std::vector<std::vector<unsigned char>> levels;
+	const unsigned char* level = chain.data();
+	for (int i = 0; i < levelCount; i++)
+	{
+		int w = std::max(width >> i, 1), h = std::max(height >> i, 1);
+		int blocksX = (w + 3) / 4, blocksY = (h + 3) / 4;
+		std::vector<unsigned char> blocks((size_t)blocksX * blocksY * 16);
+		pool.parallelFor(blocksY, 8, [&](size_t begin, size_t end)
+		{
+			Bc7::encodeImage(level, w, h, blocks.data(), (int)begin, (int)end);
+		});
+		levels.push_back(std::move(blocks));
+		level += (size_t)w * h * 4;
+	}
+
+	std::string output = std::filesystem::path(input).replace_extension(".ktx2").string();
+	if (!Ktx2::writeBc7(output, width, height, options.srgb, levels))
+		return false;
+	size_t bytes = 0;
+	for (const std::vector<unsigned char>& l : levels)
+		bytes += l.size();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << input << " -> " << output << ": " << width << "x" << height << ", " << levels.size() << " levels, "
+		<< bytes << " bytes (" << (double)width * height * 4 / levels[0].size() << ":1 over RGBA8 at level 0), "
+		<< ms << " ms" << std::endl;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	CookOptions options;
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--srgb") == 0)
+			options.srgb = true;
+		else if (strcmp(argv[i], "--no-flip") == 0)
+			options.flip = false;
+		else if (strcmp(argv[i], "--no-mips") == 0)
+			options.mips = false;
+		else if (strcmp(argv[i], "--kaiser") == 0)
+			options.filter = MipChain::KAISER;
+		else
+			inputs.push_back(argv[i]);
+	}
+	if (inputs.empty())
+	{
+		std::cout << "usage: TextureCooker [--srgb] [--no-flip] [--no-mips] [--kaiser] image..." << std::endl;
+		return 1;
+	}
+	ThreadPool pool;
+	int failed = 0;
+	for (const std::string& input : inputs)
+		if (!cook(input, options, pool))
+			failed++;
+	return failed ? 1 : 0;
+}